@@ -0,0 +1,597 @@
+/* -*- Mode: C; indent-tabs-mode: nil; tab-width: 4 -*-
+ *
+ * Copyright (C) 2017 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// rtld-audit module for the dynamic loader, used with
+// LD_AUDIT=$SNAP/lib/libsnapcraft-preload-audit.so.
+//
+// Looking for a library the loader tries every LD_LIBRARY_PATH directory (and
+// its glibc-hwcaps and legacy hwcaps subdirectories) in turn, opening the
+// library in each of them until one succeeds.  The preload library never sees
+// these opens, they're made by ld.so itself, for DT_NEEDED entries as much as
+// for dlopen of a bare soname.  Instead, when this module is loaded, the
+// LD_LIBRARY_PATH directories are indexed once, from the manifest of
+// SNAPCRAFT_PRELOAD when there is one (see manifest.h) and by listing them
+// otherwise, and la_objsearch maps a soname straight to the first directory
+// holding it, so the loader opens the library without probing for it.
+//
+// Whenever the index can't be sure the loader would have picked the same file
+// (directories it couldn't list, hwcaps subdirectories, objects with a
+// DT_RPATH), names are passed on unchanged and the usual search applies.
+//
+// This runs in its own link map namespace before the program is even loaded,
+// so it sticks to libc: no C++ runtime, exceptions or static constructors.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+#ifndef SQUASHFS_MAGIC
+#define SQUASHFS_MAGIC 0x73717368
+#endif
+
+// Directories are tracked as bits of a uint64_t in the name table
+#define MAX_SEARCH_DIRS 64
+
+extern "C" const ElfW(Ehdr) __ehdr_start __attribute__ ((visibility ("hidden")));
+
+namespace
+{
+enum dir_source {
+    // Couldn't be indexed, candidates below it are left to the loader
+    DIR_UNKNOWN,
+    // Doesn't exist, so nothing below it does either
+    DIR_MISSING,
+    // Listed into the name table
+    DIR_LISTED,
+    // Answered by the manifest of SNAPCRAFT_PRELOAD
+    DIR_MANIFEST,
+};
+
+struct search_dir
+{
+    char *path;
+    size_t len;
+    dir_source source;
+    // Below SNAPCRAFT_PRELOAD
+    bool in_snap;
+    // Can't change while we run: below a read-only SNAPCRAFT_PRELOAD or
+    // answered by the manifest, which is only valid for one tree anyway
+    bool permanent;
+    // Has subdirectories the loader tries before the directory itself
+    bool has_hwcaps;
+    // What the directory looked like when listed, to notice changes
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+// Open addressing table of every name in the listed directories, with the
+// directories each one is in.  Names stay in their slot when directories are
+// listed again, so probing never has to cope with removed slots.
+struct name_slot
+{
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t dirs;
+    bool used;
+};
+
+search_dir search_dirs[MAX_SEARCH_DIRS];
+size_t search_dir_count;
+
+name_slot *names;
+size_t names_capacity;
+size_t names_used;
+
+char *snap_root;
+size_t snap_root_len;
+bool snap_readonly;
+const manifest_entry *manifest_entries;
+uint64_t manifest_count;
+
+// The initial objects are loaded by then, later searches come from dlopen
+// and directories that may change are checked again first
+bool loader_started;
+// Some object has a DT_RPATH, which the loader searches before LD_LIBRARY_PATH
+bool rpath_seen;
+
+// Returned to the loader, which copies it before asking anything else
+char found_path[PATH_MAX];
+
+// Subdirectories the loader may search before a directory itself: the
+// glibc-hwcaps ones, and before glibc 2.37 'tls' and the platform and hwcap
+// names, possibly nested
+const char *const hwcaps_subdirs[] = {
+    "glibc-hwcaps", "tls", "haswell", "xeon_phi", "avx512_1", "x86_64",
+    "i386", "i486", "i586", "i686", "sse2",
+};
+
+bool
+names_grow ()
+{
+    size_t capacity = names_capacity ? names_capacity * 2 : 4096;
+    name_slot *grown = (name_slot *) calloc (capacity, sizeof (name_slot));
+    if (!grown) {
+        return false;
+    }
+
+    for (size_t i = 0; i < names_capacity; ++i) {
+        if (!names[i].used) {
+            continue;
+        }
+        size_t slot = names[i].lo & (capacity - 1);
+        while (grown[slot].used) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        grown[slot] = names[i];
+    }
+
+    free (names);
+    names = grown;
+    names_capacity = capacity;
+    return true;
+}
+
+name_slot *
+names_find (path_key const& key)
+{
+    if (names_capacity == 0) {
+        return NULL;
+    }
+
+    size_t slot = key.lo & (names_capacity - 1);
+    while (names[slot].used) {
+        if (names[slot].lo == key.lo && names[slot].hi == key.hi) {
+            return &names[slot];
+        }
+        slot = (slot + 1) & (names_capacity - 1);
+    }
+    return &names[slot];
+}
+
+bool
+names_add (const char *name, size_t index)
+{
+    if ((names_used + 1) * 2 > names_capacity && !names_grow ()) {
+        return false;
+    }
+
+    path_key key = hash_path (name, strlen (name));
+    name_slot *slot = names_find (key);
+    if (!slot->used) {
+        slot->lo = key.lo;
+        slot->hi = key.hi;
+        slot->used = true;
+        ++names_used;
+    }
+    slot->dirs |= 1ULL << index;
+    return true;
+}
+
+void
+names_forget (size_t index)
+{
+    for (size_t i = 0; i < names_capacity; ++i) {
+        names[i].dirs &= ~(1ULL << index);
+    }
+}
+
+bool
+is_hwcaps_subdir (const char *name)
+{
+    for (const char *subdir : hwcaps_subdirs) {
+        if (strcmp (name, subdir) == 0) {
+            return true;
+        }
+    }
+    const char *platform = (const char *) getauxval (AT_PLATFORM);
+    return platform && strcmp (name, platform) == 0;
+}
+
+bool
+is_below (const char *path, size_t len, const char *dir, size_t dir_len)
+{
+    return len > dir_len && path[dir_len] == '/' && memcmp (path, dir, dir_len) == 0;
+}
+
+// What the manifest lists path as, 0 if it isn't below SNAPCRAFT_PRELOAD
+// or not listed
+int
+manifest_type (const char *path, size_t len)
+{
+    if (!manifest_entries || !is_below (path, len, snap_root, snap_root_len)) {
+        return 0;
+    }
+
+    const char *relative = path + snap_root_len;
+    size_t relative_len = len - snap_root_len;
+    if (!is_plain_path (relative, relative_len) || relative[relative_len - 1] == '/') {
+        return 0;
+    }
+    return manifest_find (manifest_entries, manifest_count, hash_path (relative, relative_len));
+}
+
+// Entries of a directory the manifest lists are all listed, symbolic links
+// included, so a name that isn't doesn't exist
+int
+manifest_has (search_dir const& dir, const char *name)
+{
+    char path[PATH_MAX];
+    size_t name_len = strlen (name);
+    if (dir.len + 1 + name_len >= sizeof (path)) {
+        return -1;
+    }
+    memcpy (path, dir.path, dir.len);
+    path[dir.len] = '/';
+    memcpy (path + dir.len + 1, name, name_len + 1);
+    return manifest_type (path, dir.len + 1 + name_len) != 0 ? 1 : 0;
+}
+
+void
+list_dir (size_t index)
+{
+    search_dir& dir = search_dirs[index];
+    dir.source = DIR_UNKNOWN;
+    dir.has_hwcaps = false;
+
+    int fd = open (dir.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            dir.source = DIR_MISSING;
+        }
+        return;
+    }
+
+    struct stat st;
+    DIR *listing = fstat (fd, &st) == 0 ? fdopendir (fd) : NULL;
+    if (!listing) {
+        close (fd);
+        return;
+    }
+
+    dir.dev = st.st_dev;
+    dir.ino = st.st_ino;
+    dir.mtime = st.st_mtim;
+    dir.ctime = st.st_ctim;
+
+    bool complete = true;
+    errno = 0;
+    while (struct dirent *entry = readdir (listing)) {
+        if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (!names_add (entry->d_name, index)) {
+            complete = false;
+            break;
+        }
+        dir.has_hwcaps = dir.has_hwcaps || is_hwcaps_subdir (entry->d_name);
+    }
+    if (errno != 0) {
+        complete = false;
+    }
+    closedir (listing);
+
+    if (complete) {
+        dir.source = DIR_LISTED;
+    } else {
+        names_forget (index);
+    }
+}
+
+void
+index_dir (size_t index)
+{
+    search_dir& dir = search_dirs[index];
+
+    // The manifest answers for directories that are really in the tree
+    if (dir.in_snap && manifest_type (dir.path, dir.len) == MANIFEST_DIRECTORY) {
+        dir.source = DIR_MANIFEST;
+        dir.permanent = true;
+        dir.has_hwcaps = false;
+        for (const char *subdir : hwcaps_subdirs) {
+            dir.has_hwcaps = dir.has_hwcaps || manifest_has (dir, subdir) != 0;
+        }
+        const char *platform = (const char *) getauxval (AT_PLATFORM);
+        if (platform) {
+            dir.has_hwcaps = dir.has_hwcaps || manifest_has (dir, platform) != 0;
+        }
+        return;
+    }
+
+    list_dir (index);
+}
+
+// Lists a directory again if it changed since it was indexed.  Only done
+// for dlopen, the initial objects are all looked up straight after indexing.
+void
+revalidate_dir (size_t index)
+{
+    search_dir& dir = search_dirs[index];
+    if (!loader_started || dir.permanent || dir.source == DIR_UNKNOWN) {
+        return;
+    }
+
+    struct stat st;
+    bool exists = stat (dir.path, &st) == 0 && S_ISDIR (st.st_mode);
+    if (dir.source == DIR_MISSING) {
+        if (!exists) {
+            return;
+        }
+    } else if (exists && st.st_dev == dir.dev && st.st_ino == dir.ino &&
+               st.st_mtim.tv_sec == dir.mtime.tv_sec && st.st_mtim.tv_nsec == dir.mtime.tv_nsec &&
+               st.st_ctim.tv_sec == dir.ctime.tv_sec && st.st_ctim.tv_nsec == dir.ctime.tv_nsec) {
+        return;
+    }
+
+    if (dir.source == DIR_LISTED) {
+        names_forget (index);
+    }
+    list_dir (index);
+}
+
+// Whether name is an entry of a search directory: 1 if it is, 0 if it isn't
+// and -1 if we don't know
+int
+dir_has (size_t index, const char *name)
+{
+    revalidate_dir (index);
+
+    search_dir const& dir = search_dirs[index];
+    switch (dir.source) {
+    case DIR_UNKNOWN:
+        return -1;
+    case DIR_MISSING:
+        return 0;
+    case DIR_MANIFEST:
+        return manifest_has (dir, name);
+    case DIR_LISTED:
+        break;
+    }
+
+    name_slot *slot = names_find (hash_path (name, strlen (name)));
+    return slot && (slot->dirs & (1ULL << index)) ? 1 : 0;
+}
+
+// Whether the loader would accept path as a library of this process,
+// which it won't for one of another architecture
+bool
+is_loadable (const char *path)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    ElfW(Ehdr) header;
+    bool loadable = read (fd, &header, sizeof (header)) == sizeof (header) &&
+                    memcmp (header.e_ident, ELFMAG, SELFMAG) == 0 &&
+                    header.e_ident[EI_CLASS] == __ehdr_start.e_ident[EI_CLASS] &&
+                    header.e_ident[EI_DATA] == __ehdr_start.e_ident[EI_DATA] &&
+                    header.e_machine == __ehdr_start.e_machine &&
+                    header.e_type == ET_DYN;
+    close (fd);
+    return loadable;
+}
+
+bool
+has_dynamic_tag (const ElfW(Dyn) *dynamic, ElfW(Sxword) tag)
+{
+    for (; dynamic && dynamic->d_tag != DT_NULL; ++dynamic) {
+        if (dynamic->d_tag == tag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Where the loader would find soname in LD_LIBRARY_PATH, or NULL if it's not
+// there or we can't be sure
+const char *
+find_library (const char *soname)
+{
+    size_t soname_len = strlen (soname);
+
+    for (size_t i = 0; i < search_dir_count; ++i) {
+        search_dir const& dir = search_dirs[i];
+        int has = dir_has (i, soname);
+        if (has < 0 || (dir.has_hwcaps && dir.source != DIR_MISSING)) {
+            return NULL;
+        }
+        if (has == 0) {
+            continue;
+        }
+        if (dir.len + 1 + soname_len >= sizeof (found_path)) {
+            return NULL;
+        }
+
+        memcpy (found_path, dir.path, dir.len);
+        found_path[dir.len] = '/';
+        memcpy (found_path + dir.len + 1, soname, soname_len + 1);
+
+        // The loader skips it too if it's of another class or unreadable
+        if (is_loadable (found_path)) {
+            return found_path;
+        }
+    }
+
+    return NULL;
+}
+
+void
+add_search_dir (const char *entry, size_t len)
+{
+    // Anything after the last one is left to the loader
+    if (search_dir_count == MAX_SEARCH_DIRS) {
+        return;
+    }
+    while (len > 1 && entry[len - 1] == '/') {
+        --len;
+    }
+
+    for (size_t i = 0; i < search_dir_count; ++i) {
+        if (search_dirs[i].path && search_dirs[i].len == len && memcmp (search_dirs[i].path, entry, len) == 0) {
+            return;
+        }
+    }
+
+    search_dir& dir = search_dirs[search_dir_count++];
+    dir.path = strndup (entry, len);
+    dir.len = len;
+    dir.source = DIR_UNKNOWN;
+
+    // Relative entries depend on the working directory and dynamic string
+    // tokens on the object asking, the loader has to search those
+    if (!dir.path || len == 0 || entry[0] != '/' || memchr (entry, '$', len)) {
+        return;
+    }
+
+    dir.in_snap = snap_root && is_below (dir.path, len, snap_root, snap_root_len);
+    dir.permanent = dir.in_snap && snap_readonly;
+    index_dir (search_dir_count - 1);
+}
+
+void
+load_manifest (const char *path)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && (size_t) st.st_size >= sizeof (manifest_header)) {
+        map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close (fd);
+
+    const manifest_header *header = (const manifest_header *) map;
+    if (map == MAP_FAILED || !manifest_valid (map, st.st_size, manifest_tree_id (getenv ("SNAP_VERSION")))) {
+        // The preload library already complains about it
+        if (map != MAP_FAILED) {
+            munmap (map, st.st_size);
+        }
+        return;
+    }
+
+    manifest_count = header->count;
+    manifest_entries = (const manifest_entry *) (header + 1);
+}
+
+void
+audit_init ()
+{
+    // LD_LIBRARY_PATH is ignored for setuid programs anyway
+    const char *library_path = getenv ("LD_LIBRARY_PATH");
+    if (getauxval (AT_SECURE) || !library_path) {
+        return;
+    }
+
+    const char *root = getenv ("SNAPCRAFT_PRELOAD");
+    if (root && root[0] == '/') {
+        snap_root_len = strlen (root);
+        while (snap_root_len > 1 && root[snap_root_len - 1] == '/') {
+            --snap_root_len;
+        }
+        snap_root = strndup (root, snap_root_len);
+
+        struct statfs snap_fs;
+        snap_readonly = snap_root && statfs (snap_root, &snap_fs) == 0 && snap_fs.f_type == SQUASHFS_MAGIC;
+
+        // A tree that can change may not match its manifest anymore
+        const char *manifest = getenv ("SNAPCRAFT_PRELOAD_MANIFEST");
+        if (snap_readonly && manifest && manifest[0]) {
+            load_manifest (manifest);
+        }
+    }
+
+    // Split like the loader does
+    const char *entry = library_path;
+    while (true) {
+        size_t len = strcspn (entry, ":;");
+        add_search_dir (entry, len);
+        if (entry[len] == '\0') {
+            break;
+        }
+        entry += len + 1;
+    }
+}
+
+} // unnamed namespace
+
+extern "C" unsigned int
+la_version (unsigned int version)
+{
+    audit_init ();
+    return version < LAV_CURRENT ? version : LAV_CURRENT;
+}
+
+extern "C" unsigned int
+la_objopen (struct link_map *map, Lmid_t, uintptr_t *)
+{
+    // Its DT_RPATH is ignored if it also has a DT_RUNPATH
+    if (has_dynamic_tag (map->l_ld, DT_RPATH) && !has_dynamic_tag (map->l_ld, DT_RUNPATH)) {
+        rpath_seen = true;
+    }
+
+    // We don't need to see symbol bindings
+    return 0;
+}
+
+extern "C" void
+la_preinit (uintptr_t *)
+{
+    loader_started = true;
+}
+
+extern "C" char *
+la_objsearch (const char *name, uintptr_t *cookie, unsigned int flag)
+{
+    // Candidates are left alone: turning one down makes the loader give up
+    // on LD_LIBRARY_PATH unless its errno happens to be ENOENT
+    if (flag != LA_SER_ORIG || search_dir_count == 0 || strchr (name, '/')) {
+        return (char *) name;
+    }
+
+    // The cookie is the link map of the object asking, the loader tries the
+    // DT_RPATHs before LD_LIBRARY_PATH unless it has a DT_RUNPATH
+    struct link_map *requester = (struct link_map *) *cookie;
+    if (rpath_seen && (!requester || !has_dynamic_tag (requester->l_ld, DT_RUNPATH))) {
+        return (char *) name;
+    }
+
+    const char *found = find_library (name);
+    return (char *) (found ? found : name);
+}
@@ -0,0 +1,704 @@
+/* -*- Mode: C; indent-tabs-mode: nil; tab-width: 4 -*-
+ *
+ * Copyright (C) 2017 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures the per-call cost of the interposed entry points.  The benchmark
+// re-executes itself twice: once plain, calling straight into the files of a
+// synthetic snap tree, and once with the preload library, reaching the same
+// files through their redirected paths.  Every wrapper family is run with
+// absolute and relative paths, on files inside the snap (redirected) and next
+// to it (passed through), from 1 up to --threads threads.  sem_open is run
+// a second time with the library's mkstemp() creation path, to compare it
+// with the O_TMPFILE one.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <map>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef SNAPCRAFT_PRELOAD_LIBRARY_DEF
+#define SNAPCRAFT_PRELOAD_LIBRARY_DEF "libsnapcraft-preload.so"
+#endif
+
+namespace
+{
+const char *const BENCH_ROOT = "SNAPCRAFT_PRELOAD_BENCH_ROOT";
+const char *const BENCH_PRELOADED = "SNAPCRAFT_PRELOAD_BENCH_PRELOADED";
+const char *const BENCH_ITERATIONS = "SNAPCRAFT_PRELOAD_BENCH_ITERATIONS";
+const char *const BENCH_THREADS = "SNAPCRAFT_PRELOAD_BENCH_THREADS";
+const char *const BENCH_FILTER = "SNAPCRAFT_PRELOAD_BENCH_FILTER";
+
+const long BATCH_SIZE = 1000;
+
+// Location of the test directory relative to the snap, and next to it
+const std::string SNAP_DIR = "/snapcraft-preload-bench";
+const std::string HOST_DIR = "/host";
+
+enum location { REDIRECTED, PASSTHROUGH };
+enum path_form { ABSOLUTE, RELATIVE };
+
+const char *const location_names[] = { "redirected", "passthrough" };
+
+// How the preload library creates semaphores, see SNAPCRAFT_PRELOAD_SEM_TMPFILE
+const char *const SEM_CREATE_TMPFILE = "tmpfile";
+const char *const SEM_CREATE_MKSTEMP = "mkstemp";
+const char *const form_names[] = { "absolute", "relative" };
+
+// What a benchmark operates on: the directory holding the test files and the
+// names to pass, absolute or relative to the working directory.
+struct bench_paths
+{
+    std::string dir;
+    std::string file;
+    std::string executable;
+    std::string socket;
+    std::string bind_socket;
+    std::string sem_name;
+};
+
+enum {
+    // Paths don't matter, only run once
+    BENCH_NO_PATHS = 1 << 0,
+    // Files can't be created through redirected paths
+    BENCH_PASSTHROUGH_ONLY = 1 << 1,
+};
+
+struct benchmark
+{
+    const char *name;
+    void (*run) (const bench_paths& paths);
+    // Iterations are divided by this for expensive calls
+    long cost;
+    unsigned flags;
+};
+
+void
+fail (const char *what)
+{
+    perror (what);
+    exit (1);
+}
+
+void
+run_open (const bench_paths& paths)
+{
+    int fd = open (paths.file.c_str (), O_RDONLY);
+    if (fd < 0) {
+        fail ("open");
+    }
+    close (fd);
+}
+
+void
+run_stat (const bench_paths& paths)
+{
+    struct stat st;
+    if (stat (paths.file.c_str (), &st) != 0) {
+        fail ("stat");
+    }
+}
+
+void
+run_access (const bench_paths& paths)
+{
+    if (access (paths.file.c_str (), F_OK) != 0) {
+        fail ("access");
+    }
+}
+
+void
+run_opendir (const bench_paths& paths)
+{
+    DIR *dir = opendir (paths.dir.c_str ());
+    if (!dir) {
+        fail ("opendir");
+    }
+    closedir (dir);
+}
+
+void
+run_scandir (const bench_paths& paths)
+{
+    struct dirent **entries;
+    int n = scandir (paths.dir.c_str (), &entries, NULL, alphasort);
+    if (n < 0) {
+        fail ("scandir");
+    }
+    for (int i = 0; i < n; ++i) {
+        free (entries[i]);
+    }
+    free (entries);
+}
+
+void
+run_realpath (const bench_paths& paths)
+{
+    char resolved[PATH_MAX];
+    if (!realpath (paths.file.c_str (), resolved)) {
+        fail ("realpath");
+    }
+}
+
+void
+run_execve (const bench_paths& paths)
+{
+    pid_t pid = fork ();
+    if (pid == 0) {
+        char *const argv[] = { (char *) "true", NULL };
+        execve (paths.executable.c_str (), argv, environ);
+        _exit (127);
+    }
+
+    int status;
+    if (pid < 0 || waitpid (pid, &status, 0) != pid || !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+        fprintf (stderr, "execve of '%s' failed\n", paths.executable.c_str ());
+        exit (1);
+    }
+}
+
+void
+run_sem_open (const bench_paths& paths)
+{
+    sem_t *sem = sem_open (paths.sem_name.c_str (), O_CREAT, 0600, 0);
+    if (sem == SEM_FAILED) {
+        fail ("sem_open");
+    }
+    sem_close (sem);
+    sem_unlink (paths.sem_name.c_str ());
+}
+
+socklen_t
+unix_address (const std::string& path, struct sockaddr_un& addr)
+{
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strncpy (addr.sun_path, path.c_str (), sizeof (addr.sun_path) - 1);
+    return sizeof (addr);
+}
+
+void
+run_bind (const bench_paths& paths)
+{
+    struct sockaddr_un addr;
+    socklen_t len = unix_address (paths.bind_socket, addr);
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind (fd, (struct sockaddr *) &addr, len) != 0) {
+        fail ("bind");
+    }
+    close (fd);
+    unlink (paths.bind_socket.c_str ());
+}
+
+void
+run_connect (const bench_paths& paths)
+{
+    struct sockaddr_un addr;
+    socklen_t len = unix_address (paths.socket, addr);
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect (fd, (struct sockaddr *) &addr, len) != 0) {
+        fail ("connect");
+    }
+    close (fd);
+}
+
+const benchmark BENCHMARKS[] = {
+    { "open", run_open, 1, 0 },
+    { "stat", run_stat, 1, 0 },
+    { "access", run_access, 1, 0 },
+    { "opendir", run_opendir, 1, 0 },
+    { "scandir", run_scandir, 2, 0 },
+    { "realpath", run_realpath, 1, 0 },
+    { "execve", run_execve, 1000, 0 },
+    { "sem_open", run_sem_open, 10, BENCH_NO_PATHS },
+    { "bind", run_bind, 10, BENCH_PASSTHROUGH_ONLY },
+    { "connect", run_connect, 10, 0 },
+};
+
+double
+now_ns ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+struct bench_thread
+{
+    pthread_t thread;
+    const benchmark *bench;
+    bench_paths paths;
+    long iterations;
+    pthread_barrier_t *barrier;
+    double best;
+};
+
+void *
+run_thread (void *data)
+{
+    bench_thread& t = *static_cast<bench_thread *> (data);
+    long batch = t.iterations / 10 > BATCH_SIZE ? BATCH_SIZE : (t.iterations / 10 ? t.iterations / 10 : 1);
+
+    // Warm up caches on both sides
+    for (long i = 0; i < t.iterations / 10; ++i) {
+        t.bench->run (t.paths);
+    }
+
+    pthread_barrier_wait (t.barrier);
+
+    // Report the fastest batch, which filters out preemption and other
+    // noise that would otherwise dwarf the wrapper overhead.
+    t.best = 0;
+    for (long done = 0; done < t.iterations; done += batch) {
+        double start = now_ns ();
+        for (long i = 0; i < batch; ++i) {
+            t.bench->run (t.paths);
+        }
+        double elapsed = (now_ns () - start) / batch;
+        if (done == 0 || elapsed < t.best) {
+            t.best = elapsed;
+        }
+    }
+
+    return NULL;
+}
+
+// Average of the per thread call times, when run on `threads` threads at once
+double
+run_benchmark (const benchmark& bench, const bench_paths& paths, long iterations, unsigned threads)
+{
+    pthread_barrier_t barrier;
+    pthread_barrier_init (&barrier, NULL, threads);
+
+    std::vector<bench_thread> workers (threads);
+    for (unsigned i = 0; i < threads; ++i) {
+        bench_thread& t = workers[i];
+        t.bench = &bench;
+        t.paths = paths;
+        t.paths.bind_socket += "." + std::to_string (i);
+        t.paths.sem_name += "." + std::to_string (i);
+        t.iterations = iterations;
+        t.barrier = &barrier;
+        if (pthread_create (&t.thread, NULL, run_thread, &t) != 0) {
+            fail ("pthread_create");
+        }
+    }
+
+    double total = 0;
+    for (bench_thread& t : workers) {
+        pthread_join (t.thread, NULL);
+        total += t.best;
+    }
+
+    pthread_barrier_destroy (&barrier);
+    return total / threads;
+}
+
+std::vector<unsigned>
+thread_counts (unsigned max_threads)
+{
+    std::vector<unsigned> counts;
+    for (unsigned n = 1; n < max_threads; n *= 2) {
+        counts.push_back (n);
+    }
+    counts.push_back (max_threads);
+    return counts;
+}
+
+// Runs in the re-executed child, printing
+// '<family> <location> <form> <threads> <ns per call>' lines
+int
+run_child (const std::string& root, bool preloaded, long iterations, unsigned max_threads, const char *filter)
+{
+    for (const benchmark& b : BENCHMARKS) {
+        if (filter && strcmp (filter, b.name) != 0) {
+            continue;
+        }
+
+        for (int loc = REDIRECTED; loc <= PASSTHROUGH; ++loc) {
+            if ((b.flags & BENCH_PASSTHROUGH_ONLY) && loc != PASSTHROUGH) {
+                continue;
+            }
+
+            for (int form = ABSOLUTE; form <= RELATIVE; ++form) {
+                // Redirected files are reached through the virtual path in
+                // the preloaded run, and their real location otherwise
+                std::string dir = loc == PASSTHROUGH ? root + HOST_DIR :
+                                  preloaded ? SNAP_DIR : root + "/snap" + SNAP_DIR;
+                std::string base = form == ABSOLUTE ? dir + "/" : "";
+                if (chdir (dir.c_str ()) != 0) {
+                    fail ("chdir");
+                }
+
+                bench_paths paths;
+                paths.dir = form == ABSOLUTE ? dir : ".";
+                paths.file = base + "file";
+                paths.executable = base + "true";
+                paths.socket = base + "socket";
+                paths.bind_socket = base + "bind";
+                paths.sem_name = "/snapcraft-preload-bench." + std::to_string (getpid ());
+
+                for (unsigned threads : thread_counts (max_threads)) {
+                    double ns = run_benchmark (b, paths, iterations / b.cost, threads);
+                    if (b.flags & BENCH_NO_PATHS) {
+                        printf ("%s - - %u %.1f\n", b.name, threads, ns);
+                    } else {
+                        printf ("%s %s %s %u %.1f\n", b.name, location_names[loc], form_names[form], threads, ns);
+                    }
+                    fflush (stdout);
+                }
+
+                if (b.flags & BENCH_NO_PATHS) {
+                    break;
+                }
+            }
+
+            if (b.flags & BENCH_NO_PATHS) {
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+struct options
+{
+    std::string library;
+    long iterations;
+    unsigned threads;
+    std::string format;
+    std::string output;
+    const char *filter;
+};
+
+using results = std::map<std::string, double>;
+
+// sem_open results are reported with sem_create as their location, only
+// sem_open is run for SEM_CREATE_MKSTEMP
+bool
+run_parent_pass (const char *self, const std::string& root, options const& opts, bool preloaded,
+                 const char *sem_create, std::vector<std::string>& keys, results& timings)
+{
+    bool mkstemp_pass = strcmp (sem_create, SEM_CREATE_MKSTEMP) == 0;
+    const char *filter = mkstemp_pass ? "sem_open" : opts.filter;
+
+    int fds[2];
+    if (pipe (fds) != 0) {
+        perror ("pipe");
+        return false;
+    }
+
+    pid_t pid = fork ();
+    if (pid == 0) {
+        close (fds[0]);
+        dup2 (fds[1], STDOUT_FILENO);
+        setenv (BENCH_ROOT, root.c_str (), 1);
+        setenv (BENCH_ITERATIONS, std::to_string (opts.iterations).c_str (), 1);
+        setenv (BENCH_THREADS, std::to_string (opts.threads).c_str (), 1);
+        if (filter) {
+            setenv (BENCH_FILTER, filter, 1);
+        }
+        if (preloaded) {
+            setenv (BENCH_PRELOADED, "1", 1);
+            setenv ("SNAPCRAFT_PRELOAD", (root + "/snap").c_str (), 1);
+            setenv ("SNAP_INSTANCE_NAME", "snapcraft-preload-bench", 1);
+            setenv ("LD_PRELOAD", opts.library.c_str (), 1);
+            setenv ("SNAPCRAFT_PRELOAD_SEM_TMPFILE", mkstemp_pass ? "0" : "1", 1);
+        }
+        execl (self, self, (char *) NULL);
+        perror ("execl");
+        _exit (1);
+    }
+
+    close (fds[1]);
+    FILE *output = fdopen (fds[0], "r");
+    char name[64], loc[64], form[64];
+    unsigned threads;
+    double ns;
+    while (fscanf (output, "%63s %63s %63s %u %lf", name, loc, form, &threads, &ns) == 5) {
+        if (strcmp (name, "sem_open") == 0) {
+            snprintf (loc, sizeof (loc), "%s", sem_create);
+        }
+        std::string key = std::string (name) + "," + loc + "," + form + "," + std::to_string (threads);
+        if (!preloaded) {
+            keys.push_back (key);
+        }
+        timings[key] = ns;
+    }
+    fclose (output);
+
+    int status;
+    waitpid (pid, &status, 0);
+    return WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+void
+write_results (FILE *out, const std::string& format, const std::vector<std::string>& keys,
+               results& plain, results& preloaded)
+{
+    if (format == "csv") {
+        fprintf (out, "family,location,form,threads,plain_ns,preload_ns,overhead_ns\n");
+    } else if (format == "json") {
+        fprintf (out, "[\n");
+    } else {
+        fprintf (out, "%-10s %-12s %-9s %7s %12s %12s %12s\n",
+                 "call", "location", "form", "threads", "plain ns", "preload ns", "overhead ns");
+    }
+
+    for (size_t i = 0; i < keys.size (); ++i) {
+        const std::string& key = keys[i];
+        char name[64], loc[64], form[64];
+        unsigned threads;
+        if (sscanf (key.c_str (), "%63[^,],%63[^,],%63[^,],%u", name, loc, form, &threads) != 4) {
+            continue;
+        }
+
+        double a = plain[key];
+        double b = preloaded.count (key) ? preloaded[key] : 0;
+        if (format == "csv") {
+            fprintf (out, "%s,%.1f,%.1f,%.1f\n", key.c_str (), a, b, b - a);
+        } else if (format == "json") {
+            fprintf (out, "  {\"family\": \"%s\", \"location\": \"%s\", \"form\": \"%s\", \"threads\": %u, "
+                          "\"plain_ns\": %.1f, \"preload_ns\": %.1f, \"overhead_ns\": %.1f}%s\n",
+                     name, loc, form, threads, a, b, b - a, i + 1 < keys.size () ? "," : "");
+        } else {
+            fprintf (out, "%-10s %-12s %-9s %7u %12.1f %12.1f %12.1f\n", name, loc, form, threads, a, b, b - a);
+        }
+    }
+
+    if (format == "json") {
+        fprintf (out, "]\n");
+    }
+}
+
+bool
+copy_file (const char *from, const std::string& to, mode_t mode)
+{
+    int in = open (from, O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+
+    int out = open (to.c_str (), O_CREAT | O_WRONLY | O_TRUNC, mode);
+    bool ok = out >= 0;
+    char buffer[65536];
+    ssize_t n;
+    while (ok && (n = read (in, buffer, sizeof (buffer))) > 0) {
+        ok = write (out, buffer, n) == n;
+    }
+    close (in);
+    if (out >= 0) {
+        close (out);
+    }
+    return ok;
+}
+
+// A listening socket for the connect benchmarks, accepting in the background
+pid_t
+start_listener (const std::string& path)
+{
+    struct sockaddr_un addr;
+    socklen_t len = unix_address (path, addr);
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind (fd, (struct sockaddr *) &addr, len) != 0 || listen (fd, 128) != 0) {
+        perror ("listen");
+        return -1;
+    }
+
+    pid_t pid = fork ();
+    if (pid == 0) {
+        for (;;) {
+            int client = accept (fd, NULL, NULL);
+            if (client >= 0) {
+                close (client);
+            }
+        }
+    }
+    close (fd);
+    return pid;
+}
+
+// Synthetic snap and host directories with the same files in each
+bool
+create_tree (const std::string& dir)
+{
+    if (mkdir (dir.c_str (), 0755) != 0) {
+        perror (dir.c_str ());
+        return false;
+    }
+
+    int fd = open ((dir + "/file").c_str (), O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) {
+        perror ("open");
+        return false;
+    }
+    close (fd);
+
+    if (!copy_file ("/bin/true", dir + "/true", 0755)) {
+        perror ("/bin/true");
+        return false;
+    }
+
+    return true;
+}
+
+void
+remove_tree (const std::string& path)
+{
+    DIR *dir = opendir (path.c_str ());
+    if (dir) {
+        while (struct dirent *entry = readdir (dir)) {
+            if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0) {
+                continue;
+            }
+            std::string child = path + "/" + entry->d_name;
+            if (entry->d_type == DT_DIR) {
+                remove_tree (child);
+            } else {
+                unlink (child.c_str ());
+            }
+        }
+        closedir (dir);
+    }
+    rmdir (path.c_str ());
+}
+
+void
+usage (const char *self)
+{
+    fprintf (stderr, "Usage: %s [--library PATH] [--iterations N] [--threads N] [--only FAMILY]\n"
+                     "          [--format table|csv|json] [--output FILE]\n", self);
+}
+
+} // unnamed namespace
+
+int
+main (int argc, char *argv[])
+{
+    options opts;
+    opts.library = SNAPCRAFT_PRELOAD_LIBRARY_DEF;
+    opts.iterations = 200000;
+    opts.threads = 4;
+    opts.format = "table";
+    opts.filter = NULL;
+
+    const char *root = getenv (BENCH_ROOT);
+    if (root) {
+        const char *n = getenv (BENCH_ITERATIONS);
+        const char *t = getenv (BENCH_THREADS);
+        return run_child (root, getenv (BENCH_PRELOADED) != NULL, n ? atol (n) : opts.iterations,
+                          t ? atoi (t) : 1, getenv (BENCH_FILTER));
+    }
+
+    long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    if (cpus > 0 && cpus < opts.threads) {
+        opts.threads = cpus;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp (argv[i], "--library") == 0 && i + 1 < argc) {
+            opts.library = argv[++i];
+        } else if (strcmp (argv[i], "--iterations") == 0 && i + 1 < argc) {
+            opts.iterations = atol (argv[++i]);
+        } else if (strcmp (argv[i], "--threads") == 0 && i + 1 < argc) {
+            opts.threads = atoi (argv[++i]);
+        } else if (strcmp (argv[i], "--only") == 0 && i + 1 < argc) {
+            opts.filter = argv[++i];
+        } else if (strcmp (argv[i], "--format") == 0 && i + 1 < argc) {
+            opts.format = argv[++i];
+        } else if (strcmp (argv[i], "--output") == 0 && i + 1 < argc) {
+            opts.output = argv[++i];
+        } else {
+            usage (argv[0]);
+            return 1;
+        }
+    }
+
+    if (opts.iterations <= 0 || opts.threads == 0 ||
+        (opts.format != "table" && opts.format != "csv" && opts.format != "json")) {
+        usage (argv[0]);
+        return 1;
+    }
+
+    char tmp_template[] = "/tmp/snapcraft-preload-bench.XXXXXX";
+    char *tmp = mkdtemp (tmp_template);
+    if (!tmp) {
+        perror ("mkdtemp");
+        return 1;
+    }
+
+    std::string snap_dir = std::string (tmp) + "/snap" + SNAP_DIR;
+    std::string host_dir = std::string (tmp) + HOST_DIR;
+    mkdir ((std::string (tmp) + "/snap").c_str (), 0755);
+
+    std::vector<std::string> keys;
+    results plain, preloaded;
+    pid_t snap_listener = -1, host_listener = -1;
+    bool ok = create_tree (snap_dir) && create_tree (host_dir) &&
+              (snap_listener = start_listener (snap_dir + "/socket")) > 0 &&
+              (host_listener = start_listener (host_dir + "/socket")) > 0 &&
+              run_parent_pass ("/proc/self/exe", tmp, opts, false, SEM_CREATE_TMPFILE, keys, plain) &&
+              run_parent_pass ("/proc/self/exe", tmp, opts, true, SEM_CREATE_TMPFILE, keys, preloaded);
+    if (ok && (!opts.filter || strcmp (opts.filter, "sem_open") == 0)) {
+        ok = run_parent_pass ("/proc/self/exe", tmp, opts, false, SEM_CREATE_MKSTEMP, keys, plain) &&
+             run_parent_pass ("/proc/self/exe", tmp, opts, true, SEM_CREATE_MKSTEMP, keys, preloaded);
+    }
+
+    for (pid_t listener : { snap_listener, host_listener }) {
+        if (listener > 0) {
+            kill (listener, SIGTERM);
+            waitpid (listener, NULL, 0);
+        }
+    }
+    remove_tree (tmp);
+
+    if (!ok) {
+        fprintf (stderr, "benchmark failed\n");
+        return 1;
+    }
+
+    write_results (stdout, opts.format, keys, plain, preloaded);
+    if (!opts.output.empty ()) {
+        FILE *out = fopen (opts.output.c_str (), "w");
+        if (!out) {
+            perror (opts.output.c_str ());
+            return 1;
+        }
+        write_results (out, opts.format, keys, plain, preloaded);
+        fclose (out);
+    }
+
+    return 0;
+}
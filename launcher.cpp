@@ -0,0 +1,138 @@
+/* -*- Mode: C; indent-tabs-mode: nil; tab-width: 4 -*-
+ *
+ * Copyright (C) 2017 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The snapcraft-preload command apps are started through:
+//
+//   snapcraft-preload COMMAND [ARGS...]
+//
+// It points SNAPCRAFT_PRELOAD at $SNAP, adds the preload library to
+// LD_PRELOAD unless it's already there, and executes the command, searched
+// for in PATH.  It replaces a shell script doing the same, to save starting a
+// shell for every launch.  It is linked statically so starting it doesn't
+// involve the dynamic loader either, and sticks to libc to stay small.  A
+// manifest is left for the snap to opt in to through
+// SNAPCRAFT_PRELOAD_MANIFEST, as a stale one would give wrong answers.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef SNAPCRAFT_LIBPATH_DEF
+#define SNAPCRAFT_LIBPATH_DEF "lib/libsnapcraft-preload.so"
+#endif
+
+namespace
+{
+// Adds entry to the colon separated list unless it's already there
+void
+add_entry (char *list, const char *entry, size_t len)
+{
+    for (const char *p = list; *p;) {
+        size_t other = strcspn (p, ":");
+        if (other == len && memcmp (p, entry, len) == 0) {
+            return;
+        }
+        p += other + (p[other] ? 1 : 0);
+    }
+
+    size_t used = strlen (list);
+    if (used) {
+        list[used++] = ':';
+    }
+    memcpy (list + used, entry, len);
+    list[used + len] = '\0';
+}
+
+// LD_PRELOAD with each library once, the loader splits it on both spaces and
+// colons
+char *
+preload_list (const char *current, const char *library)
+{
+    current = current ? current : "";
+    char *list = (char *) malloc (strlen (current) + strlen (library) + 2);
+    if (!list) {
+        return NULL;
+    }
+    list[0] = '\0';
+
+    for (const char *p = current; *p;) {
+        size_t len = strcspn (p, ": ");
+        if (len) {
+            add_entry (list, p, len);
+        }
+        p += len + (p[len] ? 1 : 0);
+    }
+    add_entry (list, library, strlen (library));
+    return list;
+}
+
+// $SNAP/relative, without any trailing '/' of $SNAP doubled
+char *
+snap_path (const char *snap, size_t snap_len, const char *relative)
+{
+    char *path = (char *) malloc (snap_len + strlen (relative) + 2);
+    if (path) {
+        memcpy (path, snap, snap_len);
+        path[snap_len] = '/';
+        strcpy (path + snap_len + 1, relative);
+    }
+    return path;
+}
+
+} // unnamed namespace
+
+int
+main (int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf (stderr, "Usage: %s COMMAND [ARGS...]\n", argv[0]);
+        return 1;
+    }
+
+    const char *snap = getenv ("SNAP");
+    size_t snap_len = snap ? strlen (snap) : 0;
+    while (snap_len > 1 && snap[snap_len - 1] == '/') {
+        --snap_len;
+    }
+    if (snap_len == 0) {
+        fprintf (stderr, "snapcraft-preload: SNAP is not set, not running in a snap?\n");
+        return 1;
+    }
+
+    char *snapcraft_preload = strndup (snap, snap_len);
+    char *library = snap_path (snap, snap_len, SNAPCRAFT_LIBPATH_DEF);
+    char *preload = library ? preload_list (getenv ("LD_PRELOAD"), library) : NULL;
+    if (!snapcraft_preload || !preload) {
+        perror ("snapcraft-preload");
+        return 1;
+    }
+    setenv ("SNAPCRAFT_PRELOAD", snapcraft_preload, 1);
+    setenv ("LD_PRELOAD", preload, 1);
+
+    execvp (argv[1], argv + 1);
+
+    // Exit like a shell would
+    int error = errno;
+    fprintf (stderr, "snapcraft-preload: cannot run '%s': %s\n", argv[1], strerror (error));
+    return error == ENOENT ? 127 : 126;
+}
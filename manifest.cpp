@@ -0,0 +1,196 @@
+/* -*- Mode: C; indent-tabs-mode: nil; tab-width: 4 -*-
+ *
+ * Copyright (C) 2017 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Writes the manifest of a staged snap tree, see manifest.h.  Run it on the
+// prime directory when packing the snap and point SNAPCRAFT_PRELOAD_MANIFEST
+// at the result so existence checks under $SNAP don't need a syscall.  The
+// snap's version is taken from --snap-version, the tree's meta/snap.yaml or
+// $SNAPCRAFT_PROJECT_VERSION, in that order.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <algorithm>
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "manifest.h"
+
+namespace
+{
+size_t root_length;
+std::vector<manifest_entry> entries;
+
+int
+add_entry (const char *path, const struct stat *st, int flag, struct FTW *)
+{
+    const char *relative = path + root_length;
+    if (relative[0] == '\0') {
+        // The root itself is always a directory
+        return FTW_CONTINUE;
+    }
+
+    if (flag == FTW_NS || flag == FTW_DNR) {
+        fprintf (stderr, "snapcraft-preload-manifest: cannot read '%s'\n", path);
+        return FTW_STOP;
+    }
+
+    manifest_type type;
+    int next = FTW_CONTINUE;
+
+    if (S_ISLNK (st->st_mode)) {
+        type = MANIFEST_OPAQUE;
+    } else if (S_ISDIR (st->st_mode)) {
+        // Whether paths below it exist depends on who's asking
+        if ((st->st_mode & S_IXOTH) == 0) {
+            type = MANIFEST_OPAQUE;
+            next = FTW_SKIP_SUBTREE;
+        } else {
+            type = MANIFEST_DIRECTORY;
+        }
+    } else {
+        type = MANIFEST_FILE;
+    }
+
+    entries.push_back (manifest_make_entry (hash_path (relative, strlen (relative)), type));
+    return next;
+}
+
+// The version: line of snap.yaml, without quotes
+std::string
+snap_yaml_version (const std::string& path)
+{
+    FILE *file = fopen (path.c_str (), "r");
+    if (!file) {
+        return "";
+    }
+
+    std::string version;
+    char line[4096];
+    while (fgets (line, sizeof (line), file)) {
+        if (strncmp (line, "version:", 8) != 0) {
+            continue;
+        }
+        version = line + 8;
+        size_t start = version.find_first_not_of (" \t");
+        size_t end = version.find_last_not_of (" \t\r\n");
+        version = start == std::string::npos ? "" : version.substr (start, end - start + 1);
+        if (version.size () >= 2 && (version[0] == '\'' || version[0] == '"') && version.back () == version[0]) {
+            version = version.substr (1, version.size () - 2);
+        }
+        break;
+    }
+
+    fclose (file);
+    return version;
+}
+
+bool
+write_manifest (const std::string& output, const std::string& version)
+{
+    std::string tmp = output + ".tmp";
+    FILE *file = fopen (tmp.c_str (), "wb");
+    if (!file) {
+        perror (tmp.c_str ());
+        return false;
+    }
+
+    manifest_header header;
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, MANIFEST_MAGIC, sizeof (MANIFEST_MAGIC));
+    header.version = MANIFEST_VERSION;
+    header.entry_size = sizeof (manifest_entry);
+    header.count = entries.size ();
+    header.tree = manifest_tree_id (version.c_str ());
+
+    bool ok = fwrite (&header, sizeof (header), 1, file) == 1 &&
+              fwrite (entries.data (), sizeof (manifest_entry), entries.size (), file) == entries.size ();
+    ok = fclose (file) == 0 && ok;
+
+    if (!ok || rename (tmp.c_str (), output.c_str ()) != 0) {
+        perror (output.c_str ());
+        unlink (tmp.c_str ());
+        return false;
+    }
+
+    return true;
+}
+
+} // unnamed namespace
+
+int
+main (int argc, char *argv[])
+{
+    std::string version;
+    int first = 1;
+    if (argc > 2 && strcmp (argv[1], "--snap-version") == 0) {
+        version = argv[2];
+        first = 3;
+    }
+    if (argc - first != 2) {
+        fprintf (stderr, "Usage: %s [--snap-version VERSION] SNAP-TREE OUTPUT\n", argv[0]);
+        return 1;
+    }
+
+    std::string root = argv[first];
+    while (root.size () > 1 && root.back () == '/') {
+        root.resize (root.size () - 1);
+    }
+    root_length = root == "/" ? 0 : root.size ();
+
+    if (version.empty ()) {
+        version = snap_yaml_version (root + "/meta/snap.yaml");
+    }
+    if (version.empty () && getenv ("SNAPCRAFT_PROJECT_VERSION")) {
+        version = getenv ("SNAPCRAFT_PROJECT_VERSION");
+    }
+    if (version.empty ()) {
+        fprintf (stderr, "snapcraft-preload-manifest: unknown snap version, pass --snap-version\n");
+        return 1;
+    }
+
+    errno = 0;
+    if (nftw (root.c_str (), add_entry, 64, FTW_PHYS | FTW_ACTIONRETVAL) != 0) {
+        if (errno) {
+            perror (root.c_str ());
+        }
+        return 1;
+    }
+
+    std::sort (entries.begin (), entries.end (), manifest_entry_less);
+    for (size_t i = 1; i < entries.size (); ++i) {
+        if (!manifest_entry_less (entries[i - 1], entries[i])) {
+            fprintf (stderr, "snapcraft-preload-manifest: hash collision, cannot index '%s'\n", root.c_str ());
+            return 1;
+        }
+    }
+
+    if (!write_manifest (argv[first + 1], version)) {
+        return 1;
+    }
+
+    printf ("%zu entries\n", entries.size ());
+    return 0;
+}
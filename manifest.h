@@ -0,0 +1,199 @@
+/* -*- Mode: C; indent-tabs-mode: nil; tab-width: 4 -*-
+ *
+ * Copyright (C) 2017 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Path hashing and the on-disk format of a snap manifest, shared by the
+// preload library and the tool generating manifests.
+//
+// A manifest lists every file and directory of a staged snap tree as the 128
+// bit hash of its path relative to the snap root ("/usr/lib/foo").  It is a
+// manifest_header followed by `count` manifest_entry records sorted by
+// manifest_entry_less, so it can be mapped and binary searched in place.  The
+// header identifies the tree by the snap's version, which snapd passes on as
+// $SNAP_VERSION, so a manifest left over from another build is not used.
+// Symbolic links and directories that not everybody may search are recorded
+// as opaque and nothing below them is listed, as what those resolve to can't
+// be answered from the tree alone.
+
+#ifndef SNAPCRAFT_PRELOAD_MANIFEST_H
+#define SNAPCRAFT_PRELOAD_MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MANIFEST_MAGIC "SPMANIF"
+#define MANIFEST_VERSION 2
+
+struct path_key
+{
+    uint64_t lo;
+    uint64_t hi;
+};
+
+enum manifest_type {
+    MANIFEST_FILE = 1,
+    MANIFEST_DIRECTORY = 2,
+    MANIFEST_OPAQUE = 3,
+};
+
+struct manifest_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t count;
+    // manifest_tree_id of the snap's version
+    uint64_t tree;
+};
+
+// The type is kept in the low bits of hi, leaving 126 bits of hash
+struct manifest_entry
+{
+    uint64_t lo;
+    uint64_t hi;
+};
+
+#define MANIFEST_TYPE_MASK 3ULL
+
+inline uint64_t
+rotl64 (uint64_t v, int r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+inline uint64_t
+fmix64 (uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+inline path_key
+hash_path (const char *path, size_t len)
+{
+    uint64_t lo = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t hi = 0xc2b2ae3d27d4eb4fULL + len;
+    size_t i = 0;
+
+    for (; i + sizeof (uint64_t) <= len; i += sizeof (uint64_t)) {
+        uint64_t word;
+        memcpy (&word, path + i, sizeof (word));
+        lo = rotl64 (lo ^ (word * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+        hi = rotl64 (hi + word, 27) * 0x52dce729ULL + 0x38495ab5ULL;
+    }
+
+    uint64_t tail = 0;
+    memcpy (&tail, path + i, len - i);
+    lo ^= tail * 0x87c37b91114253d5ULL;
+    hi += tail;
+
+    path_key key;
+    key.lo = fmix64 (lo + hi);
+    key.hi = fmix64 (hi ^ rotl64 (key.lo, 17));
+    return key;
+}
+
+// Whether path has no empty, '.' or '..' components, so it can be hashed as
+// it is rather than resolved first
+inline bool
+is_plain_path (const char *path, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        if (path[i] != '/') {
+            continue;
+        }
+        const char *next = path + i + 1;
+        size_t left = len - i - 1;
+        if ((left >= 1 && next[0] == '/') ||
+            (left >= 1 && next[0] == '.' && (left == 1 || next[1] == '/')) ||
+            (left >= 2 && next[0] == '.' && next[1] == '.' && (left == 2 || next[2] == '/'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Never 0, which stands for an unknown version
+inline uint64_t
+manifest_tree_id (const char *version)
+{
+    if (version == NULL || version[0] == '\0') {
+        return 0;
+    }
+    return hash_path (version, strlen (version)).lo | 1;
+}
+
+// Whether the size bytes at map are a manifest of the tree identified by tree
+inline bool
+manifest_valid (const void *map, size_t size, uint64_t tree)
+{
+    const manifest_header *header = (const manifest_header *) map;
+    return size >= sizeof (manifest_header) &&
+           memcmp (header->magic, MANIFEST_MAGIC, sizeof (MANIFEST_MAGIC)) == 0 &&
+           header->version == MANIFEST_VERSION &&
+           header->entry_size == sizeof (manifest_entry) &&
+           header->count == (size - sizeof (manifest_header)) / sizeof (manifest_entry) &&
+           tree != 0 && header->tree == tree;
+}
+
+inline manifest_entry
+manifest_make_entry (path_key const& key, manifest_type type)
+{
+    manifest_entry entry;
+    entry.lo = key.lo;
+    entry.hi = (key.hi & ~MANIFEST_TYPE_MASK) | type;
+    return entry;
+}
+
+inline bool
+manifest_entry_less (manifest_entry const& a, manifest_entry const& b)
+{
+    if (a.lo != b.lo) {
+        return a.lo < b.lo;
+    }
+    return (a.hi & ~MANIFEST_TYPE_MASK) < (b.hi & ~MANIFEST_TYPE_MASK);
+}
+
+// Returns the type recorded for key, or 0 if it isn't listed
+inline int
+manifest_find (const manifest_entry *entries, uint64_t count, path_key const& key)
+{
+    manifest_entry wanted = manifest_make_entry (key, MANIFEST_FILE);
+    uint64_t first = 0;
+    uint64_t remaining = count;
+
+    while (remaining > 0) {
+        uint64_t half = remaining / 2;
+        if (manifest_entry_less (entries[first + half], wanted)) {
+            first += half + 1;
+            remaining -= half + 1;
+        } else {
+            remaining = half;
+        }
+    }
+
+    if (first < count && !manifest_entry_less (wanted, entries[first])) {
+        return entries[first].hi & MANIFEST_TYPE_MASK;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,85 @@
+/* -*- Mode: C; indent-tabs-mode: nil; tab-width: 4 -*-
+ *
+ * Copyright (C) 2017 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Layout of the metrics segments published by the preload library when
+// SNAPCRAFT_PRELOAD_METRICS is set, shared with snapcraft-preload-stat.
+//
+// Each process maps its own segment, /dev/shm/snap.<instance>METRICS_INFIX<pid>,
+// which is a metrics_header followed by `function_count` metrics_counters,
+// one cache line per intercepted function so threads busy with different
+// functions don't bounce lines between them.  Counters only ever grow, readers
+// take the difference of two snapshots.  The counters carry on through an
+// exec, so what a process did before it is still there.  A process removes
+// its segment at exit, readers remove those of processes that died without
+// doing so.
+
+#ifndef SNAPCRAFT_PRELOAD_METRICS_H
+#define SNAPCRAFT_PRELOAD_METRICS_H
+
+#include <atomic>
+#include <stdint.h>
+
+#define METRICS_MAGIC "SPMETRC"
+#define METRICS_VERSION 1
+#define METRICS_INFIX ".snapcraft-preload-metrics."
+#define METRICS_FUNCTIONS_MAX 128
+#define METRICS_FUNCTION_NAME_MAX 24
+
+// Where a call's path was sent
+enum metrics_decision {
+    METRICS_UNCHANGED,
+    METRICS_PRELOAD,
+    METRICS_REWRITE,
+    METRICS_WRITABLE,
+    // Passed on by a bypass rule without looking into the snap
+    METRICS_BYPASS,
+    METRICS_DECISIONS
+};
+
+struct alignas (64) metrics_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t counters_size;
+    uint32_t pid;
+    // Parent when the segment was made, to tell process trees apart
+    uint32_t ppid;
+    uint32_t function_count;
+    uint32_t reserved;
+    // CLOCK_REALTIME in ns when the segment was made
+    uint64_t start_realtime;
+    // Start time of the process in clock ticks after boot, which together
+    // with the pid tells it from an earlier one with the same pid
+    uint64_t process_start;
+    char functions[METRICS_FUNCTIONS_MAX][METRICS_FUNCTION_NAME_MAX];
+};
+
+struct alignas (64) metrics_counters
+{
+    // Calls by where their path was sent, together all the calls
+    std::atomic<uint64_t> decisions[METRICS_DECISIONS];
+    // Calls that failed
+    std::atomic<uint64_t> errors;
+    // Existence checks made to decide where paths go, and how many of them
+    // were not answered by a cache and needed a syscall
+    std::atomic<uint64_t> existence_checks;
+    std::atomic<uint64_t> existence_syscalls;
+};
+
+static_assert (sizeof (metrics_counters) == 64, "metrics counters should fill one cache line");
+
+#endif
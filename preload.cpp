@@ -21,28 +21,50 @@
 
 #define __USE_GNU
 
+#include <algorithm>
+#include <alloca.h>
+#include <atomic>
+#include <ctype.h>
 #include <dirent.h>
 #include <dlfcn.h>
+#include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <functional>
-#include <iostream>
+#include <new>
+#include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <signal.h>
+#include <spawn.h>
 #include <sstream>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/statvfs.h>
 #include <sys/un.h>
 #include <sys/vfs.h>
+#include <time.h>
+#include <type_traits>
 #include <vector>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "manifest.h"
+#include "metrics.h"
+#include "trace.h"
+
 #ifndef SNAPCRAFT_LIBNAME_DEF
 #define SNAPCRAFT_LIBNAME_DEF "libsnapcraft-preload.so"
 #endif
@@ -53,20 +75,91 @@
 #define MAX_SEM_NAME_SIZE NAME_MAX - 10
 #define SHM_DIR "/dev/shm"
 
+#ifndef SQUASHFS_MAGIC
+#define SQUASHFS_MAGIC 0x73717368
+#endif
+
+// The existence cache is a 4-way set associative table of 32 byte slots
+#define EXISTENCE_CACHE_SLOTS 4096
+#define EXISTENCE_CACHE_WAYS 4
+#define EXISTENCE_CACHE_MAX_WATCHES 256
+
+// The shared existence cache is an open addressing table of existence slots,
+// probed linearly up to a fixed distance
+#define SHARED_CACHE_VERSION 1
+#define SHARED_CACHE_SLOTS 16384
+#define SHARED_CACHE_PROBES 8
+
+// The warmup profile keeps up to this many results, in up to this many
+// directories with paths up to the given length, found by linear probing
+#define WARMUP_VERSION 1
+#define WARMUP_MAX_ENTRIES 65536
+#define WARMUP_MAX_DIRS 4096
+#define WARMUP_DIR_PATH_MAX 240
+#define WARMUP_DIR_PROBES 16
+// Directory index of results that don't depend on one, and of paths that
+// can't be recorded
+#define WARMUP_NO_DIR 0xffffffffU
+#define WARMUP_SKIP 0xfffffffeU
+
+// Number of programs whose ELF interpreter is remembered
+#define EXEC_KIND_CACHE_SLOTS 64
+
+// Latency histograms have power of two buckets, the last one open ended
+#define LATENCY_BUCKETS 32
+
+// Trace buffers hold this many records unless told otherwise, threads claim
+// them in chunks
+#define TRACE_DEFAULT_RECORDS 65536
+#define TRACE_CHUNK_SIZE 16
+
+// The hot path report keeps this many counters, each remembering up to the
+// given length of its path, and reports the top entries unless told otherwise
+#define HOTPATH_COUNTERS 256
+#define HOTPATH_PATH_MAX 112
+#define HOTPATH_DEFAULT_TOP 20
+
+// Redirected unix socket paths are remembered in this many slots, datagrams
+// of sendmmsg are redirected this many at a time
+#define SOCKET_CACHE_SLOTS 64
+#define SOCKET_SEND_BATCH 16
+
+// Directory descriptors are tracked up to this number, with paths up to the
+// given length
+#define FD_TABLE_SIZE 4096
+#define FD_TABLE_PATH_MAX 252
+
 namespace
 {
 const std::string SNAPCRAFT_LIBNAME = SNAPCRAFT_LIBNAME_DEF;
 const std::string SNAPCRAFT_PRELOAD = "SNAPCRAFT_PRELOAD";
 const std::string SNAPCRAFT_PRELOAD_REDIRECT_ONLY_SHM = "SNAPCRAFT_PRELOAD_REDIRECT_ONLY_SHM";
+const std::string SNAPCRAFT_PRELOAD_CACHE = "SNAPCRAFT_PRELOAD_CACHE";
+const std::string SNAPCRAFT_PRELOAD_STATS = "SNAPCRAFT_PRELOAD_STATS";
+const std::string SNAPCRAFT_PRELOAD_RULES = "SNAPCRAFT_PRELOAD_RULES";
+const std::string SNAPCRAFT_PRELOAD_MANIFEST = "SNAPCRAFT_PRELOAD_MANIFEST";
+const std::string SNAPCRAFT_PRELOAD_SHARED_CACHE = "SNAPCRAFT_PRELOAD_SHARED_CACHE";
+const std::string SNAPCRAFT_PRELOAD_PROFILE = "SNAPCRAFT_PRELOAD_PROFILE";
+const std::string SNAPCRAFT_PRELOAD_TRACE = "SNAPCRAFT_PRELOAD_TRACE";
+const std::string SNAPCRAFT_PRELOAD_TRACE_RECORDS = "SNAPCRAFT_PRELOAD_TRACE_RECORDS";
+const std::string SNAPCRAFT_PRELOAD_HOTPATHS = "SNAPCRAFT_PRELOAD_HOTPATHS";
+const std::string SNAPCRAFT_PRELOAD_HOTPATHS_TOP = "SNAPCRAFT_PRELOAD_HOTPATHS_TOP";
+const std::string SNAPCRAFT_PRELOAD_HOTPATHS_SAMPLE = "SNAPCRAFT_PRELOAD_HOTPATHS_SAMPLE";
+const std::string SNAPCRAFT_PRELOAD_SEM_TMPFILE = "SNAPCRAFT_PRELOAD_SEM_TMPFILE";
+const std::string SNAPCRAFT_PRELOAD_METRICS = "SNAPCRAFT_PRELOAD_METRICS";
+const std::string SNAPCRAFT_PRELOAD_WARMUP = "SNAPCRAFT_PRELOAD_WARMUP";
+const std::string SNAPCRAFT_PRELOAD_SPECULATE = "SNAPCRAFT_PRELOAD_SPECULATE";
 const std::string LD_PRELOAD = "LD_PRELOAD";
 const std::string LD_LINUX = "/lib/ld-linux.so.2";
 const std::string DEFAULT_VARLIB = "/var/lib";
 const std::string DEFAULT_DEVSHM = "/dev/shm/";
 
-static sem_t *(*original_sem_open) (const char *, int, ...);
-static int (*original_sem_unlink) (const char *);
-
 std::string saved_snapcraft_preload;
+std::string saved_snap;
+bool saved_snap_readonly;
+// Whether paths in SNAPCRAFT_PRELOAD are in the read-only $SNAP
+bool saved_snapcraft_preload_permanent;
+std::string saved_stats_path;
 bool saved_snapcraft_preload_redirect_only_shm;
 std::string saved_varlib;
 std::string saved_snap_instance_name;
@@ -74,46 +167,3286 @@ std::string saved_snap_revision;
 std::string saved_snap_devshm;
 std::string saved_snap_sem;
 
-std::vector<std::string> saved_ld_preloads;
+std::vector<std::string> saved_ld_preloads;
+// Named semaphores are confined to sem.snap.<saved_sem_snap_name>.* in
+// SHM_DIR, saved_sem_path_prefix is the path up to the semaphore's own name
+bool saved_sem_debug;
+bool saved_sem_snap_name_set;
+std::string saved_sem_snap_name;
+std::string saved_sem_path_prefix;
+// Set by SNAPCRAFT_PRELOAD_SEM_TMPFILE=1, cleared when O_TMPFILE, /proc or the
+// confinement turn out not to allow it
+std::atomic<bool> sem_tmpfile_supported (false);
+
+// The LD_PRELOAD= and SNAPCRAFT_PRELOAD= entries exec'd programs get
+std::string saved_ld_preload_env;
+std::string saved_snapcraft_preload_env;
+
+// Every libc entry point we interpose or call on our own behalf.  They are all
+// resolved once in Initializer into next_symbols, so wrappers can call through
+// a plain function pointer.
+#define PRELOAD_SYMBOLS(X) \
+    X(fopen) X(unlink) X(unlinkat) X(access) X(eaccess) X(euidaccess) \
+    X(faccessat) X(stat) X(stat64) X(lstat) X(lstat64) X(creat) X(creat64) \
+    X(truncate) X(bindtextdomain) X(xstat) X(__xstat) X(__xstat64) \
+    X(__lxstat) X(__lxstat64) X(__fxstatat) X(__fxstatat64) X(statfs) \
+    X(statfs64) X(statvfs) X(statvfs64) X(pathconf) X(mknod) X(opendir) \
+    X(mkdir) X(rmdir) X(chown) X(lchown) X(chmod) X(lchmod) X(chdir) X(fchdir) \
+    X(readlink) X(realpath) X(link) X(rename) X(open) X(open64) X(openat) \
+    X(openat64) X(inotify_add_watch) X(scandir) X(scandir64) X(scandirat) \
+    X(scandirat64) X(dlopen) X(bind) X(connect) X(execve) X(__execve) \
+    X(sem_open) X(sem_unlink) X(fstatat) X(fstatat64) X(close) X(closedir) \
+    X(dup) X(dup2) X(dup3) X(sendto) X(sendmsg) X(sendmmsg) X(execvp) \
+    X(execvpe) X(posix_spawn) X(posix_spawnp)
+
+enum symbol_id
+{
+#define SYMBOL_ID(NAME) SYMBOL_ ## NAME,
+    PRELOAD_SYMBOLS(SYMBOL_ID)
+#undef SYMBOL_ID
+    SYMBOL_COUNT
+};
+
+const char *const symbol_names[SYMBOL_COUNT] =
+{
+#define SYMBOL_NAME(NAME) #NAME,
+    PRELOAD_SYMBOLS(SYMBOL_NAME)
+#undef SYMBOL_NAME
+};
+
+std::atomic<void *> next_symbols[SYMBOL_COUNT];
+
+void
+resolve_next_symbols ()
+{
+    for (unsigned i = 0; i < SYMBOL_COUNT; ++i) {
+        next_symbols[i].store (dlsym (RTLD_NEXT, symbol_names[i]), std::memory_order_relaxed);
+    }
+}
+
+// Libraries initialized before us may already call into our wrappers, so a
+// symbol can still be unresolved the first time it's used.
+template<typename FN>
+inline FN
+next_symbol (symbol_id id)
+{
+    void *symbol = next_symbols[id].load (std::memory_order_relaxed);
+    if (__builtin_expect (symbol == NULL, 0)) {
+        symbol = dlsym (RTLD_NEXT, symbol_names[id]);
+        next_symbols[id].store (symbol, std::memory_order_relaxed);
+    }
+    return reinterpret_cast<FN> (symbol);
+}
+
+inline int
+_access (const char *path, int mode)
+{
+    return next_symbol<int (*) (const char *, int)> (SYMBOL_access) (path, mode);
+}
+
+template <typename dirent_t>
+using filter_function_t = int (*)(const dirent_t *);
+template <typename dirent_t>
+using compar_function_t = int (*)(const dirent_t **, const dirent_t **);
+
+using socket_action_t = int (*) (int, const struct sockaddr *, socklen_t);
+using execve_t = int (*) (const char *, char *const[], char *const[]);
+using posix_spawn_t = int (*) (pid_t *, const char *, const posix_spawn_file_actions_t *, const posix_spawnattr_t *,
+                               char *const[], char *const[]);
+
+inline std::string
+getenv_string(const std::string& varname)
+{
+    char *envvar = secure_getenv (varname.c_str());
+    return envvar ? envvar : "";
+}
+
+inline bool
+str_starts_with(const std::string& str, std::string const& prefix)
+{
+    return str.compare (0, prefix.size (), prefix) == 0;
+}
+
+inline bool
+str_starts_with(const char *str, std::string const& prefix)
+{
+    return strncmp (str, prefix.data (), prefix.size ()) == 0;
+}
+
+inline bool
+str_ends_with(const std::string& str, std::string const& sufix)
+{
+    if (str.size () < sufix.size ())
+        return false;
+
+    return str.compare (str.size() - sufix.size (), sufix.size (), sufix) == 0;
+}
+
+// Path normalization
+//
+// Spellings of a path with repeated slashes or '.' components are redirected
+// and cached as their plain form.  '..' is left alone, as resolving it
+// lexically is wrong when the component before it is a symbolic link.  Most
+// paths need no change, so they are scanned for a '/' followed by another
+// '/' or a '.' component 16 bytes at a time, finding their length on the
+// way, and only those that do are copied.
+inline bool
+is_dot_component (const char *c)
+{
+    return c[0] == '.' && (c[1] == '/' || c[1] == '\0');
+}
+
+// Returns whether path needs normalizing, along with its length
+bool
+path_needs_normalizing (const char *path, size_t& len)
+{
+    bool needed = is_dot_component (path);
+
+#ifdef __SSE2__
+    // Aligned loads never cross into a page the string doesn't reach
+    const char *block = (const char *) ((uintptr_t) path & ~(uintptr_t) 15);
+    uint32_t start_mask = ~0u << (path - block);
+    uint32_t carry = 0;
+    const __m128i zeros = _mm_setzero_si128 ();
+    const __m128i slashes = _mm_set1_epi8 ('/');
+    const __m128i dots = _mm_set1_epi8 ('.');
+
+    for (;; block += 16) {
+        __m128i v = _mm_load_si128 ((const __m128i *) block);
+        uint32_t nul = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zeros)) & start_mask;
+        uint32_t slash = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, slashes)) & start_mask;
+        uint32_t dot = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, dots)) & start_mask;
+        start_mask = ~0u;
+
+        // Bytes following a '/' that are '/' or '.', before the end
+        uint32_t candidates = ((slash << 1) | carry) & (slash | dot);
+        carry = (slash >> 15) & 1;
+        if (nul) {
+            candidates &= (nul & -nul) - 1;
+        }
+
+        for (; candidates && !needed; candidates &= candidates - 1) {
+            const char *c = block + __builtin_ctz (candidates);
+            needed = c[0] == '/' || is_dot_component (c);
+        }
+
+        if (nul) {
+            len = block + __builtin_ctz (nul) - path;
+            return needed;
+        }
+    }
+#else
+    size_t i = 0;
+    for (; path[i] != '\0'; ++i) {
+        if (path[i] == '/' && (path[i + 1] == '/' || is_dot_component (path + i + 1))) {
+            needed = true;
+        }
+    }
+    len = i;
+    return needed;
+#endif
+}
+
+// Returns path without repeated slashes and '.' components, which is either
+// path itself or a copy in buffer.  A trailing slash is kept, as it only
+// matches directories.
+const char *
+normalize_path (const char *path, char *buffer, size_t size)
+{
+    size_t len;
+    if (!path_needs_normalizing (path, len) || len >= size) {
+        return path;
+    }
+
+    size_t out = 0;
+    if (path[0] == '/') {
+        buffer[out++] = '/';
+    }
+
+    for (size_t i = 0; i < len;) {
+        while (i < len && path[i] == '/') {
+            ++i;
+        }
+        size_t start = i;
+        while (i < len && path[i] != '/') {
+            ++i;
+        }
+
+        size_t component_len = i - start;
+        if (component_len == 0 || (component_len == 1 && path[start] == '.')) {
+            continue;
+        }
+        if (out > 0 && buffer[out - 1] != '/') {
+            buffer[out++] = '/';
+        }
+        memcpy (buffer + out, path + start, component_len);
+        out += component_len;
+    }
+
+    if (out == 0) {
+        buffer[out++] = '.';
+    }
+    bool directory = path[len - 1] == '/' || (path[len - 1] == '.' && (len == 1 || path[len - 2] == '/'));
+    if (directory && buffer[out - 1] != '/') {
+        buffer[out++] = '/';
+    }
+    buffer[out] = '\0';
+    return buffer;
+}
+
+// Existence cache
+//
+// redirect_path_full needs to know whether a redirected path exists before it
+// hands it to the real call, which would otherwise mean an extra access() for
+// every intercepted call.  Results are cached here, keyed on a 128 bit hash of
+// the probed path so slots stay small and can be read without locks.  Paths in
+// a read-only $SNAP never change so they are cached forever.  Anything else is
+// only valid for the writable generation it was probed in, which is bumped by
+// our own mutating wrappers and by an inotify watch on the cached directories.
+enum cache_mode { CACHE_OFF, CACHE_SNAP, CACHE_ALL };
+
+enum {
+    SLOT_RESULT_MASK = 0xff,
+    SLOT_VALID = 1 << 8,
+    SLOT_PERMANENT = 1 << 9,
+};
+
+struct existence_slot
+{
+    // Odd while a writer is updating the slot
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> value;
+    std::atomic<uint32_t> generation;
+    std::atomic<uint32_t> unused;
+    std::atomic<uint64_t> key_lo;
+    std::atomic<uint64_t> key_hi;
+};
+
+struct existence_stats
+{
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> invalidations;
+    std::atomic<uint64_t> manifest_hits;
+    std::atomic<uint64_t> shared_hits;
+    std::atomic<uint64_t> warmup_hits;
+    std::atomic<uint64_t> speculated;
+    std::atomic<uint64_t> speculation_fallbacks;
+};
+
+cache_mode existence_cache_mode = CACHE_SNAP;
+bool stats_enabled = false;
+// Whether the wrappers allowing it may leave existence checks to the real call
+bool speculation_enabled = true;
+existence_slot existence_cache[EXISTENCE_CACHE_SLOTS];
+existence_stats cache_stats;
+// Paths passed on by a bypass rule without looking into the snap
+std::atomic<uint64_t> bypassed_paths;
+std::atomic<uint32_t> writable_generation;
+
+// Directories we have an inotify watch on, protected by watch_mutex
+pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+path_key watched_dirs[EXISTENCE_CACHE_MAX_WATCHES];
+unsigned watched_dirs_count = 0;
+int watch_fd = -1;
+bool watch_failed = false;
+// With SNAPCRAFT_PRELOAD_METRICS set, the existence checks this thread made
+// since its last call was counted, and how many of them needed a syscall
+bool metrics_enabled = false;
+__thread uint32_t thread_existence_checks __attribute__ ((tls_model ("initial-exec")));
+__thread uint32_t thread_existence_syscalls __attribute__ ((tls_model ("initial-exec")));
+
+// Header of the shared existence cache, followed by SHARED_CACHE_SLOTS slots.
+// A zero filled file is an empty table being set up by whoever moves state
+// from SHARED_CACHE_EMPTY to SHARED_CACHE_READY.  While it's being set up,
+// state holds SHARED_CACHE_INITIALIZING along with the pid of the process
+// doing it above SHARED_CACHE_STATE_BITS, so others can take over should it
+// die half way.
+enum { SHARED_CACHE_EMPTY, SHARED_CACHE_INITIALIZING, SHARED_CACHE_READY };
+#define SHARED_CACHE_STATE_BITS 2
+
+struct shared_cache_header
+{
+    std::atomic<uint32_t> state;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    // Hash of $SNAP, so a table isn't shared by snaps mounted elsewhere
+    uint64_t snap_lo;
+    uint64_t snap_hi;
+};
+
+static_assert (sizeof (shared_cache_header) == sizeof (existence_slot),
+               "slots following the shared cache header should stay aligned");
+
+// Shared existence cache, mapped for the process lifetime
+existence_slot *shared_cache = NULL;
+
+// Manifest of SNAPCRAFT_PRELOAD, mapped read-only for the process lifetime
+const manifest_entry *manifest_entries = NULL;
+uint64_t manifest_count = 0;
+
+inline bool
+slot_is_live (uint32_t value, uint32_t slot_generation, uint32_t generation)
+{
+    return (value & SLOT_VALID) && ((value & SLOT_PERMANENT) || slot_generation == generation);
+}
+
+bool
+existence_cache_lookup (path_key const& key, uint32_t generation, int& result)
+{
+    existence_slot *set = &existence_cache[(key.lo % (EXISTENCE_CACHE_SLOTS / EXISTENCE_CACHE_WAYS)) * EXISTENCE_CACHE_WAYS];
+
+    for (unsigned i = 0; i < EXISTENCE_CACHE_WAYS; ++i) {
+        existence_slot& slot = set[i];
+        uint32_t sequence = slot.sequence.load (std::memory_order_acquire);
+        if (sequence & 1) {
+            continue;
+        }
+
+        uint64_t lo = slot.key_lo.load (std::memory_order_relaxed);
+        uint64_t hi = slot.key_hi.load (std::memory_order_relaxed);
+        uint32_t value = slot.value.load (std::memory_order_relaxed);
+        uint32_t slot_generation = slot.generation.load (std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_acquire);
+
+        if (slot.sequence.load (std::memory_order_relaxed) != sequence) {
+            continue;
+        }
+
+        if (lo == key.lo && hi == key.hi && slot_is_live (value, slot_generation, generation)) {
+            result = value & SLOT_RESULT_MASK;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+existence_cache_insert (path_key const& key, uint32_t generation, int result, bool permanent)
+{
+    existence_slot *set = &existence_cache[(key.lo % (EXISTENCE_CACHE_SLOTS / EXISTENCE_CACHE_WAYS)) * EXISTENCE_CACHE_WAYS];
+    existence_slot *victim = &set[key.hi % EXISTENCE_CACHE_WAYS];
+    uint32_t current_generation = writable_generation.load (std::memory_order_relaxed);
+
+    // Prefer the slot already holding this key, then dead slots
+    for (unsigned i = 0; i < EXISTENCE_CACHE_WAYS; ++i) {
+        existence_slot& slot = set[i];
+        if (slot.key_lo.load (std::memory_order_relaxed) == key.lo &&
+            slot.key_hi.load (std::memory_order_relaxed) == key.hi) {
+            victim = &slot;
+            break;
+        }
+        if (!slot_is_live (slot.value.load (std::memory_order_relaxed),
+                           slot.generation.load (std::memory_order_relaxed),
+                           current_generation)) {
+            victim = &slot;
+        }
+    }
+
+    // Another writer owns the slot, just skip caching this result
+    uint32_t sequence = victim->sequence.load (std::memory_order_relaxed);
+    if ((sequence & 1) || !victim->sequence.compare_exchange_strong (sequence, sequence + 1, std::memory_order_relaxed)) {
+        return;
+    }
+    std::atomic_thread_fence (std::memory_order_release);
+
+    victim->key_lo.store (key.lo, std::memory_order_relaxed);
+    victim->key_hi.store (key.hi, std::memory_order_relaxed);
+    victim->generation.store (generation, std::memory_order_relaxed);
+    victim->value.store (SLOT_VALID | (permanent ? SLOT_PERMANENT : 0) | (result & SLOT_RESULT_MASK), std::memory_order_relaxed);
+    victim->sequence.store (sequence + 2, std::memory_order_release);
+}
+
+void
+existence_cache_invalidate ()
+{
+    writable_generation.fetch_add (1, std::memory_order_release);
+    if (stats_enabled) {
+        cache_stats.invalidations.fetch_add (1, std::memory_order_relaxed);
+    }
+}
+
+void *
+existence_cache_watcher (void *)
+{
+    alignas (struct inotify_event) char events[4096];
+
+    for (;;) {
+        ssize_t n = read (watch_fd, events, sizeof (events));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        // Any event in a watched directory may change an existence result, and
+        // if the watch goes away for any reason, we can't trust writable
+        // entries anymore.
+        existence_cache_invalidate ();
+
+        if (n <= 0) {
+            pthread_mutex_lock (&watch_mutex);
+            watch_failed = true;
+            pthread_mutex_unlock (&watch_mutex);
+            return NULL;
+        }
+    }
+}
+
+// Must be called with watch_mutex held
+bool
+existence_cache_start_watcher ()
+{
+    if (watch_fd >= 0) {
+        return true;
+    }
+
+    int fd = inotify_init1 (IN_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    // Keep the descriptor out of the way of apps that expect low fd numbers
+    int high_fd = fcntl (fd, F_DUPFD_CLOEXEC, 512);
+    if (high_fd >= 0) {
+        close (fd);
+        fd = high_fd;
+    }
+    watch_fd = fd;
+
+    // The watcher must never run the application's signal handlers
+    sigset_t all_signals, old_signals;
+    sigfillset (&all_signals);
+    pthread_sigmask (SIG_SETMASK, &all_signals, &old_signals);
+
+    pthread_attr_t attr;
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize (&attr, 64 * 1024);
+
+    pthread_t thread;
+    int ret = pthread_create (&thread, &attr, existence_cache_watcher, NULL);
+
+    pthread_attr_destroy (&attr);
+    pthread_sigmask (SIG_SETMASK, &old_signals, NULL);
+
+    if (ret != 0) {
+        close (watch_fd);
+        watch_fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+// Make sure changes to the existence of path are noticed by the watcher, by
+// watching its closest existing parent directory.
+bool
+existence_cache_watch_parent (const char *path, size_t len)
+{
+    char dir[PATH_MAX];
+    if (len >= sizeof (dir)) {
+        return false;
+    }
+    memcpy (dir, path, len + 1);
+
+    bool watched = false;
+    pthread_mutex_lock (&watch_mutex);
+
+    if (!watch_failed && existence_cache_start_watcher ()) {
+        char *slash;
+        while (!watched && (slash = strrchr (dir, '/')) != NULL) {
+            if (slash == dir) {
+                slash[1] = '\0';
+            } else {
+                slash[0] = '\0';
+            }
+
+            path_key key = hash_path (dir, strlen (dir));
+            for (unsigned i = 0; i < watched_dirs_count && !watched; ++i) {
+                watched = watched_dirs[i].lo == key.lo && watched_dirs[i].hi == key.hi;
+            }
+            if (watched) {
+                break;
+            }
+
+            if (watched_dirs_count >= EXISTENCE_CACHE_MAX_WATCHES) {
+                break;
+            }
+
+            uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                            IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+            if (next_symbol<int (*) (int, const char *, uint32_t)> (SYMBOL_inotify_add_watch) (watch_fd, dir, mask) >= 0) {
+                watched_dirs[watched_dirs_count++] = key;
+                watched = true;
+            } else if ((errno != ENOENT && errno != ENOTDIR) || slash == dir) {
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock (&watch_mutex);
+    return watched;
+}
+
+// Shared existence cache
+//
+// Results for a read-only $SNAP are the same for every process of the snap,
+// so with SNAPCRAFT_PRELOAD_SHARED_CACHE they are also kept in a table in the
+// snap's own /dev/shm namespace that all of its processes map and fill
+// together, and a new process starts out knowing what its siblings and
+// parents already probed.  The table is named after the snap revision, so a
+// refresh starts over with an empty one.  Slots are read under a seqlock like
+// the private cache, but are never evicted since their results can't change.
+// A slot left half written by a process that died stays unused.
+bool
+shared_cache_lookup (path_key const& key, int& result)
+{
+    for (unsigned i = 0; i < SHARED_CACHE_PROBES; ++i) {
+        existence_slot& slot = shared_cache[(key.lo + i) % SHARED_CACHE_SLOTS];
+        uint32_t sequence = slot.sequence.load (std::memory_order_acquire);
+        if (sequence & 1) {
+            continue;
+        }
+
+        uint64_t lo = slot.key_lo.load (std::memory_order_relaxed);
+        uint64_t hi = slot.key_hi.load (std::memory_order_relaxed);
+        uint32_t value = slot.value.load (std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_acquire);
+
+        if (slot.sequence.load (std::memory_order_relaxed) != sequence) {
+            continue;
+        }
+
+        // Nothing is ever removed, so the key can't be further along
+        if (!(value & SLOT_VALID)) {
+            return false;
+        }
+        if (lo == key.lo && hi == key.hi) {
+            result = value & SLOT_RESULT_MASK;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+shared_cache_insert (path_key const& key, int result)
+{
+    for (unsigned i = 0; i < SHARED_CACHE_PROBES; ++i) {
+        existence_slot& slot = shared_cache[(key.lo + i) % SHARED_CACHE_SLOTS];
+        uint32_t value = slot.value.load (std::memory_order_relaxed);
+        if (value & SLOT_VALID) {
+            if (slot.key_lo.load (std::memory_order_relaxed) == key.lo &&
+                slot.key_hi.load (std::memory_order_relaxed) == key.hi) {
+                return;
+            }
+            continue;
+        }
+
+        // Claim the empty slot, another process may be after it too
+        uint32_t sequence = slot.sequence.load (std::memory_order_relaxed);
+        if ((sequence & 1) || !slot.sequence.compare_exchange_strong (sequence, sequence + 1, std::memory_order_relaxed)) {
+            continue;
+        }
+        std::atomic_thread_fence (std::memory_order_release);
+
+        if (slot.value.load (std::memory_order_relaxed) & SLOT_VALID) {
+            // Filled in between, leave it be
+            slot.sequence.store (sequence + 2, std::memory_order_release);
+            continue;
+        }
+
+        slot.key_lo.store (key.lo, std::memory_order_relaxed);
+        slot.key_hi.store (key.hi, std::memory_order_relaxed);
+        slot.value.store (SLOT_VALID | SLOT_PERMANENT | (result & SLOT_RESULT_MASK), std::memory_order_relaxed);
+        slot.sequence.store (sequence + 2, std::memory_order_release);
+        return;
+    }
+}
+
+void
+shared_cache_init ()
+{
+    if (getenv_string (SNAPCRAFT_PRELOAD_SHARED_CACHE) != "1" ||
+        !saved_snap_readonly || saved_snap_instance_name.empty () || saved_snap_revision.empty ()) {
+        return;
+    }
+
+    // Not through our open(), the path is already in the snap's namespace
+    std::string path = saved_snap_devshm + ".snapcraft-preload-cache." + saved_snap_revision;
+    auto _open = next_symbol<int (*) (const char *, int, ...)> (SYMBOL_open);
+    int fd = _open (path.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+
+    // Every process grows it to the same size, which is a no-op once it's done
+    size_t size = sizeof (shared_cache_header) + SHARED_CACHE_SLOTS * sizeof (existence_slot);
+    void *map = MAP_FAILED;
+    if (ftruncate (fd, size) == 0) {
+        map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close (fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    shared_cache_header *header = static_cast<shared_cache_header *> (map);
+    path_key snap_key = hash_path (saved_snap.data (), saved_snap.size ());
+
+    uint32_t claim = SHARED_CACHE_INITIALIZING | ((uint32_t) getpid () << SHARED_CACHE_STATE_BITS);
+    for (int tries = 0; ; ++tries) {
+        uint32_t state = header->state.load (std::memory_order_acquire);
+        if (state == SHARED_CACHE_READY) {
+            break;
+        }
+
+        // Nobody can be setting up the table anymore if they died doing it
+        // (or left no pid, as older versions did).  Slots are only used once
+        // it's ready, so it can just start over.
+        pid_t owner = state >> SHARED_CACHE_STATE_BITS;
+        bool abandoned = state != SHARED_CACHE_EMPTY && (owner == 0 || (kill (owner, 0) != 0 && errno == ESRCH));
+        if ((state == SHARED_CACHE_EMPTY || abandoned) &&
+            header->state.compare_exchange_strong (state, claim, std::memory_order_acquire)) {
+            header->version = SHARED_CACHE_VERSION;
+            header->slot_count = SHARED_CACHE_SLOTS;
+            header->slot_size = sizeof (existence_slot);
+            header->snap_lo = snap_key.lo;
+            header->snap_hi = snap_key.hi;
+            header->state.store (SHARED_CACHE_READY, std::memory_order_release);
+            break;
+        }
+
+        // Someone else is setting it up, give them a moment
+        if (tries == 1000) {
+            break;
+        }
+        sched_yield ();
+    }
+
+    if (header->state.load (std::memory_order_acquire) != SHARED_CACHE_READY ||
+        header->version != SHARED_CACHE_VERSION ||
+        header->slot_count != SHARED_CACHE_SLOTS ||
+        header->slot_size != sizeof (existence_slot) ||
+        header->snap_lo != snap_key.lo || header->snap_hi != snap_key.hi) {
+        munmap (map, size);
+        return;
+    }
+
+    shared_cache = reinterpret_cast<existence_slot *> (header + 1);
+}
+
+inline bool
+is_permanent_path (const char *path, size_t len)
+{
+    const std::string& snap = saved_snap;
+    return saved_snap_readonly && len > snap.size () &&
+           path[snap.size ()] == '/' && snap.compare (0, snap.size (), path, snap.size ()) == 0;
+}
+
+// Answers access (path, F_OK) for a path below SNAPCRAFT_PRELOAD from the
+// manifest.  Returns false when the manifest can't tell, i.e. the path goes
+// through a symbolic link, and the kernel has to be asked.
+bool
+manifest_access (const char *path, size_t len, int& result)
+{
+    const std::string& root = saved_snapcraft_preload;
+    size_t root_len = root.size ();
+    while (root_len > 1 && root[root_len - 1] == '/') {
+        --root_len;
+    }
+
+    if (len <= root_len || path[root_len] != '/' || root.compare (0, root_len, path, root_len) != 0) {
+        return false;
+    }
+
+    const char *relative = path + root_len;
+    size_t relative_len = len - root_len;
+    bool wants_directory = false;
+    while (relative_len > 1 && relative[relative_len - 1] == '/') {
+        --relative_len;
+        wants_directory = true;
+    }
+
+    if (relative_len == 1) {
+        result = 0;
+        return true;
+    }
+
+    if (!is_plain_path (relative, relative_len)) {
+        return false;
+    }
+
+    int type = manifest_find (manifest_entries, manifest_count, hash_path (relative, relative_len));
+    switch (type) {
+    case MANIFEST_FILE:
+        result = wants_directory ? ENOTDIR : 0;
+        return true;
+    case MANIFEST_DIRECTORY:
+        result = 0;
+        return true;
+    case MANIFEST_OPAQUE:
+        return false;
+    }
+
+    // It doesn't exist, but an ancestor may be a file or a symbolic link
+    size_t end = relative_len;
+    while ((end = (size_t) ((const char *) memrchr (relative, '/', end) - relative)) > 0) {
+        switch (manifest_find (manifest_entries, manifest_count, hash_path (relative, end))) {
+        case MANIFEST_FILE:
+            result = ENOTDIR;
+            return true;
+        case MANIFEST_DIRECTORY:
+            result = ENOENT;
+            return true;
+        case MANIFEST_OPAQUE:
+            return false;
+        }
+    }
+
+    result = ENOENT;
+    return true;
+}
+
+// Warmup profile
+//
+// With SNAPCRAFT_PRELOAD_WARMUP=1, the existence results a process had to ask
+// the kernel for are written to $SNAP_USER_DATA at exit, and the next process
+// loads them as a sorted table answering the same checks without a syscall.
+// Results for paths in the read-only $SNAP can't change for the revision the
+// profile is kept in.  Any other result depends on its parent directory, so
+// the directory's identity and times are recorded before the probe and again
+// at exit, and a loaded result is only used once its directory has been found
+// unchanged, checked the first time one of its entries is asked for and again
+// whenever the writable cache entries are invalidated.  Symbolic links, whose
+// result depends on their target instead, aren't recorded.
+struct warmup_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dir_size;
+    uint32_t entry_size;
+    uint32_t dir_count;
+    uint64_t entry_count;
+    // Hash of $SNAP, the profile only holds for the same tree
+    uint64_t snap_lo;
+    uint64_t snap_hi;
+};
+
+struct warmup_dir
+{
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    // errno of looking it up, 0 if it existed
+    int32_t error;
+    uint32_t reserved;
+};
+
+struct warmup_entry
+{
+    uint64_t lo;
+    uint64_t hi;
+    // Index of the parent in the directories, or WARMUP_NO_DIR
+    uint32_t dir;
+    int32_t result;
+};
+
+// Loaded directories are unchecked, stale, or found unchanged at the writable
+// generation encoded by warmup_dir_valid
+enum : uint64_t { WARMUP_DIR_UNCHECKED = 0, WARMUP_DIR_STALE = 1 };
+
+struct warmup_dir_slot
+{
+    // 0 while free, claimed by whoever sets it
+    std::atomic<uint64_t> key_lo;
+    std::atomic<bool> ready;
+    warmup_dir dir;
+    char path[WARMUP_DIR_PATH_MAX];
+};
+
+struct warmup_recorded_entry
+{
+    std::atomic<bool> ready;
+    warmup_entry entry;
+};
+
+const char WARMUP_MAGIC[] = "SPWARM";
+
+std::string saved_warmup_path;
+const warmup_dir *warmup_dirs;
+uint32_t warmup_dir_count;
+const warmup_entry *warmup_entries;
+uint64_t warmup_entry_count;
+std::atomic<uint64_t> *warmup_dir_states;
+
+bool warmup_recording = false;
+warmup_dir_slot *warmup_dir_slots;
+warmup_recorded_entry *warmup_recorded;
+std::atomic<uint32_t> warmup_recorded_count;
+
+inline uint64_t
+warmup_dir_valid (uint32_t generation)
+{
+    return ((uint64_t) generation + 1) << 1;
+}
+
+inline bool
+warmup_entry_less (warmup_entry const& a, warmup_entry const& b)
+{
+    return a.lo != b.lo ? a.lo < b.lo : a.hi < b.hi;
+}
+
+// Length of the parent directory of path, 1 for '/'
+inline size_t
+parent_length (const char *path, size_t len)
+{
+    const char *slash = (const char *) memrchr (path, '/', len);
+    return slash == NULL || slash == path ? 1 : slash - path;
+}
+
+// Not through our stat(), which would redirect it
+void
+warmup_stat_dir (const char *path, warmup_dir& dir)
+{
+    struct statx stx;
+    if (statx (AT_FDCWD, path, 0, STATX_INO | STATX_MTIME | STATX_CTIME, &stx) != 0) {
+        dir.error = errno;
+        dir.dev = dir.ino = 0;
+        dir.mtime_sec = dir.mtime_nsec = dir.ctime_sec = dir.ctime_nsec = 0;
+        return;
+    }
+    dir.error = 0;
+    dir.dev = ((uint64_t) stx.stx_dev_major << 32) | stx.stx_dev_minor;
+    dir.ino = stx.stx_ino;
+    dir.mtime_sec = stx.stx_mtime.tv_sec;
+    dir.mtime_nsec = stx.stx_mtime.tv_nsec;
+    dir.ctime_sec = stx.stx_ctime.tv_sec;
+    dir.ctime_nsec = stx.stx_ctime.tv_nsec;
+}
+
+inline bool
+warmup_dir_same (warmup_dir const& a, warmup_dir const& b)
+{
+    return a.error == b.error && a.dev == b.dev && a.ino == b.ino &&
+           a.mtime_sec == b.mtime_sec && a.mtime_nsec == b.mtime_nsec &&
+           a.ctime_sec == b.ctime_sec && a.ctime_nsec == b.ctime_nsec;
+}
+
+// Whether the loaded directory at index still is what its entries were
+// recorded against, path being one of them
+bool
+warmup_dir_current (uint32_t index, const char *path, size_t len)
+{
+    uint32_t generation = writable_generation.load (std::memory_order_acquire);
+    uint64_t state = warmup_dir_states[index].load (std::memory_order_relaxed);
+    if (state == WARMUP_DIR_STALE) {
+        return false;
+    }
+    if (state == warmup_dir_valid (generation)) {
+        return true;
+    }
+
+    char parent[PATH_MAX];
+    size_t parent_len = parent_length (path, len);
+    memcpy (parent, path, parent_len);
+    parent[parent_len] = '\0';
+
+    int saved_errno = errno;
+    warmup_dir now;
+    warmup_stat_dir (parent, now);
+    errno = saved_errno;
+
+    // Once changed, its entries stay untrusted
+    bool same = warmup_dir_same (now, warmup_dirs[index]);
+    warmup_dir_states[index].store (same ? warmup_dir_valid (generation) : WARMUP_DIR_STALE, std::memory_order_relaxed);
+    return same;
+}
+
+// Answers access (path, F_OK) from the loaded profile, if it holds a result
+// for path that can still be trusted
+bool
+warmup_lookup (const char *path, size_t len, path_key const& key, bool permanent, int& result)
+{
+    const warmup_entry wanted = { key.lo, key.hi, 0, 0 };
+    const warmup_entry *end = warmup_entries + warmup_entry_count;
+    const warmup_entry *entry = std::lower_bound (warmup_entries, end, wanted, warmup_entry_less);
+    if (entry == end || entry->lo != key.lo || entry->hi != key.hi) {
+        return false;
+    }
+
+    if (entry->dir == WARMUP_NO_DIR) {
+        if (!permanent) {
+            return false;
+        }
+    } else if (permanent || existence_cache_mode != CACHE_ALL || entry->dir >= warmup_dir_count ||
+               !warmup_dir_current (entry->dir, path, len)) {
+        return false;
+    }
+
+    result = entry->result;
+    return true;
+}
+
+// Before probing path for the profile: the directory its result depends on,
+// WARMUP_NO_DIR for paths whose result can't change, or WARMUP_SKIP if it
+// can't be recorded.  The directory is looked at before the probe, so any
+// change racing with it shows at exit.
+uint32_t
+warmup_note_dir (const char *path, size_t len, bool permanent)
+{
+    if (permanent) {
+        return WARMUP_NO_DIR;
+    }
+    size_t parent_len = parent_length (path, len);
+    if (existence_cache_mode != CACHE_ALL || parent_len >= WARMUP_DIR_PATH_MAX) {
+        return WARMUP_SKIP;
+    }
+
+    path_key key = hash_path (path, parent_len);
+    if (key.lo == 0) {
+        return WARMUP_SKIP;
+    }
+
+    for (unsigned probe = 0; probe < WARMUP_DIR_PROBES; ++probe) {
+        uint32_t index = (key.lo + probe) % WARMUP_MAX_DIRS;
+        warmup_dir_slot& slot = warmup_dir_slots[index];
+
+        uint64_t lo = slot.key_lo.load (std::memory_order_acquire);
+        if (lo == 0 && slot.key_lo.compare_exchange_strong (lo, key.lo, std::memory_order_acquire)) {
+            memcpy (slot.path, path, parent_len);
+            slot.path[parent_len] = '\0';
+            slot.dir.lo = key.lo;
+            slot.dir.hi = key.hi;
+            int saved_errno = errno;
+            warmup_stat_dir (slot.path, slot.dir);
+            errno = saved_errno;
+            slot.ready.store (true, std::memory_order_release);
+            return index;
+        }
+        if (lo == key.lo) {
+            // Still being filled in by another thread, skip this one
+            return slot.ready.load (std::memory_order_acquire) && slot.dir.hi == key.hi ? index : WARMUP_SKIP;
+        }
+    }
+
+    return WARMUP_SKIP;
+}
+
+void
+warmup_record (const char *path, path_key const& key, int result, uint32_t dir)
+{
+    if (dir == WARMUP_SKIP || (result != 0 && result != ENOENT && result != ENOTDIR)) {
+        return;
+    }
+
+    if (dir != WARMUP_NO_DIR) {
+        // A symbolic link's result depends on its target, not its directory
+        int saved_errno = errno;
+        struct statx stx;
+        bool link = statx (AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) == 0 && S_ISLNK (stx.stx_mode);
+        errno = saved_errno;
+        if (link) {
+            return;
+        }
+    }
+
+    uint32_t n = warmup_recorded_count.fetch_add (1, std::memory_order_relaxed);
+    if (n >= WARMUP_MAX_ENTRIES) {
+        return;
+    }
+    warmup_recorded[n].entry = { key.lo, key.hi, dir, result };
+    warmup_recorded[n].ready.store (true, std::memory_order_release);
+}
+
+inline int
+uncached_access (const char *path)
+{
+    if (metrics_enabled) {
+        ++thread_existence_syscalls;
+    }
+    return _access (path, F_OK);
+}
+
+// Before looking at path for a result that isn't known yet: whether the
+// result can be kept, watching its parent directory if path is writable so
+// that any change from now on invalidates it.  generation is the one the
+// result is to be kept for.  Without may_watch, as in an exec wrapper which
+// may be in a vfork child where no watcher thread may be started, writable
+// results aren't kept.
+bool
+prepare_access (const char *path, size_t len, bool permanent, bool may_watch, uint32_t& generation)
+{
+    bool keep = permanent || (existence_cache_mode == CACHE_ALL && may_watch && existence_cache_watch_parent (path, len));
+    generation = writable_generation.load (std::memory_order_acquire);
+    return keep;
+}
+
+// Keeps a result of access (path, F_OK) for the next checks, when it only
+// depends on the path and nothing changed since prepare_access
+void
+remember_access (path_key const& key, uint32_t generation, bool permanent, bool keep, int result)
+{
+    if (result != 0 && result != ENOENT && result != ENOTDIR) {
+        return;
+    }
+
+    if (keep && (permanent || writable_generation.load (std::memory_order_acquire) == generation)) {
+        existence_cache_insert (key, generation, result, permanent);
+    }
+    if (permanent && shared_cache != NULL) {
+        shared_cache_insert (key, result);
+    }
+}
+
+// What access (path, F_OK) returns, 0 or an errno, as far as it's known
+// without asking the kernel: from the manifest or the existence caches.
+// Returns false if none of them knows.
+bool
+known_access (const char *path, size_t len, path_key const& key, uint32_t generation, bool permanent, int& result)
+{
+    if (manifest_entries != NULL && manifest_access (path, len, result)) {
+        if (stats_enabled) {
+            cache_stats.manifest_hits.fetch_add (1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    if (existence_cache_lookup (key, generation, result)) {
+        if (stats_enabled) {
+            cache_stats.hits.fetch_add (1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    if (stats_enabled) {
+        cache_stats.misses.fetch_add (1, std::memory_order_relaxed);
+    }
+
+    if (permanent && shared_cache != NULL && shared_cache_lookup (key, result)) {
+        if (stats_enabled) {
+            cache_stats.shared_hits.fetch_add (1, std::memory_order_relaxed);
+        }
+        existence_cache_insert (key, generation, result, true);
+        return true;
+    }
+
+    return false;
+}
+
+// The result the warmup profile has for path, to be looked up after
+// prepare_access
+bool
+warmup_access (const char *path, size_t len, path_key const& key, bool permanent, int& result)
+{
+    if (warmup_entries != NULL && warmup_lookup (path, len, key, permanent, result)) {
+        if (stats_enabled) {
+            cache_stats.warmup_hits.fetch_add (1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+    return false;
+}
+
+// Behaves like access (path, F_OK), answering from the manifest or the
+// existence cache when it can.  Only results that depend on the path alone
+// are cached, and writable ones only with may_watch, see prepare_access.
+int
+cached_access (const char *path, bool may_watch)
+{
+    if (metrics_enabled) {
+        ++thread_existence_checks;
+    }
+
+    if (existence_cache_mode == CACHE_OFF || path[0] != '/') {
+        return uncached_access (path);
+    }
+
+    size_t len = strlen (path);
+    path_key key = hash_path (path, len);
+    uint32_t generation = writable_generation.load (std::memory_order_acquire);
+    bool permanent = is_permanent_path (path, len);
+    int result;
+
+    if (!known_access (path, len, key, generation, permanent, result)) {
+        bool keep = prepare_access (path, len, permanent, may_watch, generation);
+        if (!warmup_access (path, len, key, permanent, result)) {
+            uint32_t dir = warmup_recording ? warmup_note_dir (path, len, permanent) : WARMUP_SKIP;
+            result = uncached_access (path) == 0 ? 0 : errno;
+            if (warmup_recording) {
+                warmup_record (path, key, result, dir);
+            }
+        }
+        remember_access (key, generation, permanent, keep, result);
+    }
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+    return 0;
+}
+
+// An existence check on a redirected path left to the real call made on it.
+// Calls following symbolic links like access () does succeed exactly when the
+// path exists, and fail with ENOENT when it doesn't, so their outcome answers
+// the check without a separate syscall.
+struct speculation
+{
+    bool pending;
+    // Whether the outcome can be kept, and where
+    bool cacheable;
+    bool keep;
+    bool permanent;
+    uint32_t generation;
+    size_t len;
+    path_key key;
+};
+
+// Like cached_access, except that when answering would take a syscall, path
+// is taken to exist and spec is marked pending for the caller to settle.
+int
+speculative_access (const char *path, speculation& spec)
+{
+    if (metrics_enabled) {
+        ++thread_existence_checks;
+    }
+
+    spec.cacheable = existence_cache_mode != CACHE_OFF && path[0] == '/';
+    if (spec.cacheable) {
+        spec.len = strlen (path);
+        spec.key = hash_path (path, spec.len);
+        spec.generation = writable_generation.load (std::memory_order_acquire);
+        spec.permanent = is_permanent_path (path, spec.len);
+
+        int result;
+        bool known = known_access (path, spec.len, spec.key, spec.generation, spec.permanent, result);
+        if (!known) {
+            spec.keep = prepare_access (path, spec.len, spec.permanent, /*may_watch*/ true, spec.generation);
+            known = warmup_access (path, spec.len, spec.key, spec.permanent, result);
+            if (known) {
+                remember_access (spec.key, spec.generation, spec.permanent, spec.keep, result);
+            }
+        }
+        if (known) {
+            if (result != 0) {
+                errno = result;
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    if (stats_enabled) {
+        cache_stats.speculated.fetch_add (1, std::memory_order_relaxed);
+    }
+    spec.pending = true;
+    return 0;
+}
+
+// After the call on the speculatively redirected path failed with error, or
+// succeeded if it's 0: whether the call has to be made on the original path
+// instead.  What the call told about the redirected path is kept like
+// cached_access would, errno is left alone.
+bool
+speculation_missed (const char *redirected, speculation const& spec, int error)
+{
+    int saved_errno = errno;
+    bool missed;
+
+    if (error == 0 || error == ENOENT) {
+        if (spec.cacheable) {
+            // Only the profile entries needing no directory check come for free
+            if (warmup_recording && spec.permanent) {
+                warmup_record (redirected, spec.key, error, WARMUP_NO_DIR);
+            }
+            remember_access (spec.key, spec.generation, spec.permanent, spec.keep, error);
+        }
+        missed = error == ENOENT;
+    } else if (error == ENOTDIR) {
+        // Either a component is no directory, which redirects all the same,
+        // or the path itself isn't one, so it exists
+        missed = false;
+    } else {
+        // The error says nothing about whether the path exists
+        missed = cached_access (redirected, /*may_watch*/ true) != 0 && errno != ENOTDIR;
+    }
+
+    if (missed && stats_enabled) {
+        cache_stats.speculation_fallbacks.fetch_add (1, std::memory_order_relaxed);
+    }
+    errno = saved_errno;
+    return missed;
+}
+
+void
+existence_cache_atfork_child ()
+{
+    // The watcher thread does not exist in the child and sharing its inotify
+    // instance with the parent would steal its events, so start over.
+    pthread_mutex_init (&watch_mutex, NULL);
+    if (watch_fd >= 0) {
+        close (watch_fd);
+        watch_fd = -1;
+    }
+    watched_dirs_count = 0;
+    watch_failed = false;
+
+    // A slot left half-written by another thread of the parent would never
+    // become readable again.
+    for (auto& slot : existence_cache) {
+        uint32_t sequence = slot.sequence.load (std::memory_order_relaxed);
+        if (sequence & 1) {
+            slot.value.store (0, std::memory_order_relaxed);
+            slot.sequence.store (sequence + 1, std::memory_order_relaxed);
+        }
+    }
+
+    existence_cache_invalidate ();
+}
+
+void
+existence_cache_init ()
+{
+    speculation_enabled = getenv_string (SNAPCRAFT_PRELOAD_SPECULATE) != "0";
+
+    std::string const& mode = getenv_string (SNAPCRAFT_PRELOAD_CACHE);
+    if (mode == "off" || mode == "0") {
+        existence_cache_mode = CACHE_OFF;
+        return;
+    } else if (mode == "all") {
+        existence_cache_mode = CACHE_ALL;
+    }
+
+    // $SNAP is only immutable when it is the mounted squashfs, not when it's a
+    // directory used by 'snap try'.
+    saved_snap = getenv_string ("SNAP");
+    while (saved_snap.size () > 1 && saved_snap.back () == '/') {
+        saved_snap.resize (saved_snap.size () - 1);
+    }
+
+    auto _statfs = next_symbol<int (*) (const char *, struct statfs *)> (SYMBOL_statfs);
+    struct statfs snap_fs;
+    saved_snap_readonly = !saved_snap.empty () && _statfs &&
+                          _statfs (saved_snap.c_str (), &snap_fs) == 0 &&
+                          snap_fs.f_type == SQUASHFS_MAGIC;
+
+    std::string preload_dir = saved_snapcraft_preload + "/";
+    saved_snapcraft_preload_permanent = is_permanent_path (preload_dir.data (), preload_dir.size ());
+
+    shared_cache_init ();
+    pthread_atfork (NULL, NULL, existence_cache_atfork_child);
+}
+
+void
+manifest_init ()
+{
+    std::string const& path = getenv_string (SNAPCRAFT_PRELOAD_MANIFEST);
+    if (path.empty () || existence_cache_mode == CACHE_OFF) {
+        return;
+    }
+
+    // Only the read-only $SNAP is sure to still be the tree it was built from
+    if (!saved_snapcraft_preload_permanent) {
+        fprintf (stderr, "snapcraft-preload: ignoring manifest '%s' for a writable tree\n", path.c_str ());
+        return;
+    }
+
+    auto _open = next_symbol<int (*) (const char *, int, ...)> (SYMBOL_open);
+    int fd = _open (path.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf (stderr, "snapcraft-preload: cannot open manifest '%s': %s\n", path.c_str (), strerror (errno));
+        return;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && (size_t) st.st_size >= sizeof (manifest_header)) {
+        map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close (fd);
+
+    const manifest_header *header = (const manifest_header *) map;
+    if (map == MAP_FAILED || !manifest_valid (map, st.st_size, manifest_tree_id (getenv ("SNAP_VERSION")))) {
+        fprintf (stderr, "snapcraft-preload: ignoring manifest '%s', invalid or not built for this version of the snap\n",
+                 path.c_str ());
+        if (map != MAP_FAILED) {
+            munmap (map, st.st_size);
+        }
+        return;
+    }
+
+    manifest_count = header->count;
+    manifest_entries = (const manifest_entry *) (header + 1);
+}
+
+void
+warmup_load ()
+{
+    auto _open = next_symbol<int (*) (const char *, int, ...)> (SYMBOL_open);
+    int fd = _open (saved_warmup_path.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // The first run of this revision
+        return;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && (size_t) st.st_size >= sizeof (warmup_header)) {
+        map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close (fd);
+
+    const warmup_header *header = (const warmup_header *) map;
+    path_key snap_key = hash_path (saved_snap.data (), saved_snap.size ());
+    if (map == MAP_FAILED ||
+        memcmp (header->magic, WARMUP_MAGIC, sizeof (WARMUP_MAGIC)) != 0 ||
+        header->version != WARMUP_VERSION ||
+        header->dir_size != sizeof (warmup_dir) ||
+        header->entry_size != sizeof (warmup_entry) ||
+        header->dir_count > WARMUP_MAX_DIRS * 2 ||
+        header->entry_count > WARMUP_MAX_ENTRIES ||
+        (size_t) st.st_size != sizeof (warmup_header) + header->dir_count * sizeof (warmup_dir) +
+                               header->entry_count * sizeof (warmup_entry) ||
+        header->snap_lo != snap_key.lo || header->snap_hi != snap_key.hi) {
+        if (map != MAP_FAILED) {
+            munmap (map, st.st_size);
+        }
+        return;
+    }
+
+    if (header->dir_count > 0) {
+        void *states = mmap (NULL, header->dir_count * sizeof (std::atomic<uint64_t>), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (states == MAP_FAILED) {
+            munmap (map, st.st_size);
+            return;
+        }
+        warmup_dir_states = static_cast<std::atomic<uint64_t> *> (states);
+    }
+
+    warmup_dirs = (const warmup_dir *) (header + 1);
+    warmup_dir_count = header->dir_count;
+    warmup_entry_count = header->entry_count;
+    warmup_entries = (const warmup_entry *) (warmup_dirs + warmup_dir_count);
+}
+
+void
+warmup_init ()
+{
+    std::string const& user_data = getenv_string ("SNAP_USER_DATA");
+    if (getenv_string (SNAPCRAFT_PRELOAD_WARMUP) != "1" || existence_cache_mode == CACHE_OFF ||
+        user_data.empty () || saved_snap.empty ()) {
+        return;
+    }
+
+    // $SNAP_USER_DATA is per revision, like the profile
+    saved_warmup_path = user_data + "/.snapcraft-preload-warmup";
+    warmup_load ();
+
+    // Not through malloc, which may be what we're recording a call from.
+    // Pages are only touched as they fill up.
+    void *slots = mmap (NULL, WARMUP_MAX_DIRS * sizeof (warmup_dir_slot), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *recorded = mmap (NULL, WARMUP_MAX_ENTRIES * sizeof (warmup_recorded_entry), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED || recorded == MAP_FAILED) {
+        return;
+    }
+
+    warmup_dir_slots = static_cast<warmup_dir_slot *> (slots);
+    warmup_recorded = static_cast<warmup_recorded_entry *> (recorded);
+    warmup_recording = true;
+}
+
+// Writes what this process found, along with as many of the loaded results
+// not found stale as fit, replacing the profile.  Nothing is written by
+// processes that didn't have to ask the kernel anything.
+void
+write_warmup ()
+{
+    uint32_t recorded = warmup_recording ? MIN (warmup_recorded_count.load (), (uint32_t) WARMUP_MAX_ENTRIES) : 0;
+    if (recorded == 0) {
+        return;
+    }
+
+    // Directories that changed since their entries were probed take the
+    // entries along
+    std::vector<warmup_dir> dirs;
+    std::vector<uint32_t> slot_dirs (WARMUP_MAX_DIRS, WARMUP_SKIP);
+    for (uint32_t i = 0; i < WARMUP_MAX_DIRS; ++i) {
+        warmup_dir_slot const& slot = warmup_dir_slots[i];
+        if (slot.ready.load (std::memory_order_acquire)) {
+            warmup_dir now;
+            warmup_stat_dir (slot.path, now);
+            if (warmup_dir_same (now, slot.dir)) {
+                slot_dirs[i] = dirs.size ();
+                dirs.push_back (slot.dir);
+            }
+        }
+    }
+
+    // What was found this time comes first, so it wins over loaded results
+    std::vector<warmup_entry> entries;
+    for (uint32_t i = 0; i < recorded; ++i) {
+        if (!warmup_recorded[i].ready.load (std::memory_order_acquire)) {
+            continue;
+        }
+        warmup_entry entry = warmup_recorded[i].entry;
+        if (entry.dir != WARMUP_NO_DIR) {
+            entry.dir = slot_dirs[entry.dir];
+        }
+        if (entry.dir != WARMUP_SKIP) {
+            entries.push_back (entry);
+        }
+    }
+
+    auto same_key = [] (warmup_entry const& a, warmup_entry const& b) { return a.lo == b.lo && a.hi == b.hi; };
+    std::stable_sort (entries.begin (), entries.end (), warmup_entry_less);
+    entries.erase (std::unique (entries.begin (), entries.end (), same_key), entries.end ());
+    size_t found = entries.size ();
+
+    // Loaded results fill the room left, the others are evicted so the
+    // profile stays bounded and keeps being refreshed.  Their directories
+    // are shared with this run's where these are unchanged.
+    std::vector<uint32_t> found_dirs (dirs.size ());
+    for (uint32_t i = 0; i < found_dirs.size (); ++i) {
+        found_dirs[i] = i;
+    }
+    auto dir_less = [&dirs] (uint32_t a, uint32_t b) {
+        return dirs[a].lo != dirs[b].lo ? dirs[a].lo < dirs[b].lo : dirs[a].hi < dirs[b].hi;
+    };
+    std::sort (found_dirs.begin (), found_dirs.end (), dir_less);
+
+    std::vector<uint32_t> loaded_dirs (warmup_dir_count, WARMUP_SKIP);
+    for (uint64_t i = 0; i < warmup_entry_count && entries.size () < WARMUP_MAX_ENTRIES; ++i) {
+        warmup_entry entry = warmup_entries[i];
+        if (std::binary_search (entries.begin (), entries.begin () + found, entry, warmup_entry_less)) {
+            continue;
+        }
+        if (entry.dir != WARMUP_NO_DIR) {
+            if (entry.dir >= warmup_dir_count ||
+                warmup_dir_states[entry.dir].load (std::memory_order_relaxed) == WARMUP_DIR_STALE) {
+                continue;
+            }
+            if (loaded_dirs[entry.dir] == WARMUP_SKIP) {
+                warmup_dir const& dir = warmup_dirs[entry.dir];
+                auto same = std::lower_bound (found_dirs.begin (), found_dirs.end (), dir, [&dirs] (uint32_t a, warmup_dir const& b) {
+                    return dirs[a].lo != b.lo ? dirs[a].lo < b.lo : dirs[a].hi < b.hi;
+                });
+                if (same != found_dirs.end () && dirs[*same].lo == dir.lo && dirs[*same].hi == dir.hi &&
+                    warmup_dir_same (dirs[*same], dir)) {
+                    loaded_dirs[entry.dir] = *same;
+                } else if (dirs.size () < WARMUP_MAX_DIRS * 2) {
+                    loaded_dirs[entry.dir] = dirs.size ();
+                    dirs.push_back (dir);
+                } else {
+                    continue;
+                }
+            }
+            entry.dir = loaded_dirs[entry.dir];
+        }
+        entries.push_back (entry);
+    }
+    std::inplace_merge (entries.begin (), entries.begin () + found, entries.end (), warmup_entry_less);
+
+    warmup_header header;
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, WARMUP_MAGIC, sizeof (WARMUP_MAGIC));
+    header.version = WARMUP_VERSION;
+    header.dir_size = sizeof (warmup_dir);
+    header.entry_size = sizeof (warmup_entry);
+    header.dir_count = dirs.size ();
+    header.entry_count = entries.size ();
+    path_key snap_key = hash_path (saved_snap.data (), saved_snap.size ());
+    header.snap_lo = snap_key.lo;
+    header.snap_hi = snap_key.hi;
+
+    // Written aside and renamed over, processes exiting together each leave
+    // a whole profile
+    std::string tmp = saved_warmup_path + "." + std::to_string (getpid ());
+    auto _open = next_symbol<int (*) (const char *, int, ...)> (SYMBOL_open);
+    int fd = _open (tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+
+    bool ok = write (fd, &header, sizeof (header)) == sizeof (header) &&
+              write (fd, dirs.data (), dirs.size () * sizeof (warmup_dir)) == (ssize_t) (dirs.size () * sizeof (warmup_dir)) &&
+              write (fd, entries.data (), entries.size () * sizeof (warmup_entry)) == (ssize_t) (entries.size () * sizeof (warmup_entry));
+    close (fd);
+
+    if (!ok || next_symbol<int (*) (const char *, const char *)> (SYMBOL_rename) (tmp.c_str (), saved_warmup_path.c_str ()) != 0) {
+        next_symbol<int (*) (const char *)> (SYMBOL_unlink) (tmp.c_str ());
+    }
+}
+
+// Writes value in decimal to out, which has room for 20 digits, returning
+// the number of digits
+size_t
+format_decimal (uint64_t value, char *out)
+{
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = digits[n - 1 - i];
+    }
+    return n;
+}
+
+// Replaces '%p' in pattern with the pid so each process can get its own file,
+// i.e. /tmp/preload.%p.  False if the result doesn't fit in size.
+bool
+expand_pid_pattern (const char *pattern, char *path, size_t size)
+{
+    size_t n = 0;
+    for (const char *p = pattern; *p; ++p) {
+        if (n + 21 > size) {
+            return false;
+        }
+        if (p[0] == '%' && p[1] == 'p') {
+            n += format_decimal (getpid (), path + n);
+            ++p;
+        } else {
+            path[n++] = *p;
+        }
+    }
+    path[n] = '\0';
+    return true;
+}
+
+// Appends a report to the file named by a pid pattern.  The report is built
+// in a fixed buffer rather than on the heap, so it can be written right before
+// an exec, which may be in a vfork child.  Reports that fit the buffer go out
+// in a single write, so concurrent processes appending don't interleave.
+class report_writer
+{
+public:
+    explicit report_writer (std::string const& pattern)
+        : fd_ (-1), used_ (0)
+    {
+        char path[PATH_MAX];
+        if (expand_pid_pattern (pattern.c_str (), path, sizeof (path))) {
+            auto _open = next_symbol<int (*) (const char *, int, ...)> (SYMBOL_open);
+            fd_ = _open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        }
+    }
+
+    ~report_writer ()
+    {
+        if (fd_ >= 0) {
+            flush ();
+            close (fd_);
+        }
+    }
+
+    report_writer&
+    add (const char *str)
+    {
+        for (; *str; ++str) {
+            if (used_ == sizeof (buffer_)) {
+                flush ();
+            }
+            buffer_[used_++] = *str;
+        }
+        return *this;
+    }
+
+    report_writer&
+    add_number (uint64_t value)
+    {
+        char digits[21];
+        digits[format_decimal (value, digits)] = '\0';
+        return add (digits);
+    }
+
+private:
+    void
+    flush ()
+    {
+        if (fd_ >= 0 && used_ > 0 && write (fd_, buffer_, used_) < 0) {
+            // Nothing sensible to do at exit
+        }
+        used_ = 0;
+    }
+
+    int fd_;
+    size_t used_;
+    char buffer_[4096];
+};
+
+void
+write_stats ()
+{
+    if (saved_stats_path.empty ()) {
+        return;
+    }
+
+    report_writer report (saved_stats_path);
+    report.add ("pid ").add_number (getpid ()).add ("\n");
+    report.add ("existence_cache.hits ").add_number (cache_stats.hits.load ()).add ("\n");
+    report.add ("existence_cache.misses ").add_number (cache_stats.misses.load ()).add ("\n");
+    report.add ("existence_cache.invalidations ").add_number (cache_stats.invalidations.load ()).add ("\n");
+    report.add ("existence_cache.manifest_hits ").add_number (cache_stats.manifest_hits.load ()).add ("\n");
+    report.add ("existence_cache.shared_hits ").add_number (cache_stats.shared_hits.load ()).add ("\n");
+    report.add ("existence_cache.warmup_hits ").add_number (cache_stats.warmup_hits.load ()).add ("\n");
+    report.add ("existence_cache.speculated ").add_number (cache_stats.speculated.load ()).add ("\n");
+    report.add ("existence_cache.speculation_fallbacks ").add_number (cache_stats.speculation_fallbacks.load ()).add ("\n");
+    report.add ("redirect.bypassed ").add_number (bypassed_paths.load ()).add ("\n");
+}
+
+// Latency histograms
+//
+// With SNAPCRAFT_PRELOAD_PROFILE set, every wrapper records how long it took
+// to decide where a call goes and how long the real call took, in power of two
+// buckets of cycle counter ticks.  Each thread counts into its own block, so
+// recording is a couple of uncontended stores; blocks of exited threads are
+// handed to new ones and everything is summed up when writing the report.
+enum latency_phase { LATENCY_DECISION, LATENCY_CALL, LATENCY_PHASES };
+
+const char *const latency_phase_names[LATENCY_PHASES] = { "decision", "call" };
+
+struct latency_block
+{
+    // Only written by the owning thread
+    std::atomic<uint64_t> counts[SYMBOL_COUNT][LATENCY_PHASES][LATENCY_BUCKETS];
+    std::atomic<bool> in_use;
+    latency_block *next;
+};
+
+bool profile_enabled = false;
+std::string saved_profile_path;
+std::atomic<latency_block *> latency_blocks;
+pthread_key_t latency_key;
+__thread latency_block *thread_latency_block __attribute__ ((tls_model ("initial-exec")));
+
+#if defined(__x86_64__) || defined(__i386__)
+const char *const LATENCY_UNIT = "cycles";
+
+inline uint64_t
+latency_now ()
+{
+    return __rdtsc ();
+}
+#elif defined(__aarch64__)
+const char *const LATENCY_UNIT = "ticks";
+
+inline uint64_t
+latency_now ()
+{
+    uint64_t ticks;
+    asm volatile ("mrs %0, cntvct_el0" : "=r" (ticks));
+    return ticks;
+}
+#else
+const char *const LATENCY_UNIT = "ns";
+
+inline uint64_t
+latency_now ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+latency_block *
+latency_block_acquire ()
+{
+    for (latency_block *block = latency_blocks.load (std::memory_order_acquire); block; block = block->next) {
+        bool in_use = false;
+        if (block->in_use.compare_exchange_strong (in_use, true, std::memory_order_acquire)) {
+            return block;
+        }
+    }
+
+    // Not through malloc, which may be what we're timing a call from
+    void *map = mmap (NULL, sizeof (latency_block), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    latency_block *block = new (map) latency_block ();
+    block->in_use.store (true, std::memory_order_relaxed);
+    block->next = latency_blocks.load (std::memory_order_relaxed);
+    while (!latency_blocks.compare_exchange_weak (block->next, block, std::memory_order_release)) {
+    }
+    return block;
+}
+
+void
+latency_block_release (void *block)
+{
+    static_cast<latency_block *> (block)->in_use.store (false, std::memory_order_release);
+}
+
+void
+latency_record (symbol_id id, latency_phase phase, uint64_t ticks)
+{
+    latency_block *block = thread_latency_block;
+    if (__builtin_expect (block == NULL, 0)) {
+        block = thread_latency_block = latency_block_acquire ();
+        if (block == NULL) {
+            return;
+        }
+        pthread_setspecific (latency_key, block);
+    }
+
+    unsigned bucket = ticks ? 64 - __builtin_clzll (ticks) : 0;
+    std::atomic<uint64_t>& count = block->counts[id][phase][MIN (bucket, LATENCY_BUCKETS - 1u)];
+    count.store (count.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// Times one intercepted call: construct it on entry, call decided() once the
+// redirected arguments are ready and let it go out of scope after the call.
+class latency_timer
+{
+public:
+    explicit latency_timer (symbol_id id)
+        : id_ (id), start_ (profile_enabled ? latency_now () : 0)
+    {
+    }
+
+    ~latency_timer ()
+    {
+        if (__builtin_expect (start_ != 0, 0)) {
+            latency_record (id_, LATENCY_CALL, latency_now () - start_);
+        }
+    }
+
+    void
+    decided ()
+    {
+        if (__builtin_expect (start_ != 0, 0)) {
+            uint64_t now = latency_now ();
+            latency_record (id_, LATENCY_DECISION, now - start_);
+            start_ = now;
+        }
+    }
+
+private:
+    symbol_id id_;
+    uint64_t start_;
+};
+
+// Lines of '<function>.<phase> <calls> <bucket bound>:<calls>...', where a
+// bucket holds the calls that took less than its bound.
+void
+write_profile ()
+{
+    if (!profile_enabled) {
+        return;
+    }
+
+    report_writer report (saved_profile_path);
+    report.add ("pid ").add_number (getpid ()).add ("\n");
+    report.add ("latency.unit ").add (LATENCY_UNIT).add ("\n");
+
+    for (unsigned id = 0; id < SYMBOL_COUNT; ++id) {
+        for (unsigned phase = 0; phase < LATENCY_PHASES; ++phase) {
+            uint64_t buckets[LATENCY_BUCKETS] = { 0 };
+            uint64_t total = 0;
+            for (latency_block *block = latency_blocks.load (std::memory_order_acquire); block; block = block->next) {
+                for (unsigned b = 0; b < LATENCY_BUCKETS; ++b) {
+                    uint64_t count = block->counts[id][phase][b].load (std::memory_order_relaxed);
+                    buckets[b] += count;
+                    total += count;
+                }
+            }
+
+            if (total == 0) {
+                continue;
+            }
+
+            report.add ("latency.").add (symbol_names[id]).add (".").add (latency_phase_names[phase]).add (" ").add_number (total);
+            for (unsigned b = 0; b < LATENCY_BUCKETS; ++b) {
+                if (buckets[b] != 0) {
+                    report.add (" ");
+                    if (b + 1 < LATENCY_BUCKETS) {
+                        report.add_number (1ULL << b);
+                    } else {
+                        report.add ("inf");
+                    }
+                    report.add (":").add_number (buckets[b]);
+                }
+            }
+            report.add ("\n");
+        }
+    }
+}
+
+void
+latency_atfork_child ()
+{
+    // The child starts counting from scratch with only the forking thread
+    for (latency_block *block = latency_blocks.load (std::memory_order_relaxed); block; block = block->next) {
+        for (auto& symbol : block->counts) {
+            for (auto& phase : symbol) {
+                for (auto& count : phase) {
+                    count.store (0, std::memory_order_relaxed);
+                }
+            }
+        }
+        block->in_use.store (block == thread_latency_block, std::memory_order_relaxed);
+    }
+}
+
+void
+latency_init ()
+{
+    saved_profile_path = getenv_string (SNAPCRAFT_PRELOAD_PROFILE);
+    if (saved_profile_path.empty () || pthread_key_create (&latency_key, latency_block_release) != 0) {
+        return;
+    }
+
+    profile_enabled = true;
+    pthread_atfork (NULL, NULL, latency_atfork_child);
+}
+
+// Working directory cache
+//
+// Relative paths are redirected against the working directory, which only
+// changes through chdir()/fchdir().  Those wrappers refresh this copy, so
+// redirecting a relative path doesn't need a getcwd() syscall.  Readers copy
+// it out under a sequence lock, writers are serialized by cwd_mutex which is
+// also held across the chdir itself so updates can't be published out of
+// order.  Working directory changes made behind our back (i.e. raw syscalls)
+// are not noticed.  A vfork child shares the copy with its parent but not the
+// working directory, so it only ever clears the copy, and the parent fills it
+// again when it next needs it.
+struct cwd_cache
+{
+    // Odd while the path is being updated
+    std::atomic<uint32_t> sequence;
+    // 0 when there is no valid copy
+    std::atomic<size_t> length;
+    char path[PATH_MAX];
+};
+
+cwd_cache saved_cwd;
+pthread_mutex_t cwd_mutex = PTHREAD_MUTEX_INITIALIZER;
+// The process whose working directory saved_cwd holds
+pid_t cwd_owner;
+
+// Must be called with cwd_mutex held
+void
+cwd_cache_publish (const char *cwd, size_t length)
+{
+    uint32_t sequence = saved_cwd.sequence.load (std::memory_order_relaxed);
+    saved_cwd.sequence.store (sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence (std::memory_order_release);
+
+    if (length > 0 && length < sizeof (saved_cwd.path)) {
+        memcpy (saved_cwd.path, cwd, length);
+        saved_cwd.length.store (length, std::memory_order_relaxed);
+    } else {
+        saved_cwd.length.store (0, std::memory_order_relaxed);
+    }
+
+    saved_cwd.sequence.store (sequence + 2, std::memory_order_release);
+}
+
+// Must be called with cwd_mutex held
+void
+cwd_cache_refresh ()
+{
+    char cwd[PATH_MAX];
+    if (getpid () == cwd_owner && getcwd (cwd, sizeof (cwd)) != NULL && cwd[0] == '/') {
+        cwd_cache_publish (cwd, strlen (cwd));
+    } else {
+        cwd_cache_publish (NULL, 0);
+    }
+}
+
+// Copies the working directory into buffer, returning its length or 0 if
+// there's no cached copy (or it doesn't fit in size).
+size_t
+cwd_cache_copy (char *buffer, size_t size)
+{
+    for (int tries = 0; tries < 3; ++tries) {
+        uint32_t sequence = saved_cwd.sequence.load (std::memory_order_acquire);
+        if (sequence & 1) {
+            continue;
+        }
+
+        size_t length = saved_cwd.length.load (std::memory_order_relaxed);
+        if (length == 0 || length >= size) {
+            return 0;
+        }
+
+        memcpy (buffer, saved_cwd.path, length);
+        std::atomic_thread_fence (std::memory_order_acquire);
+
+        if (saved_cwd.sequence.load (std::memory_order_relaxed) == sequence) {
+            buffer[length] = '\0';
+            return length;
+        }
+    }
+
+    return 0;
+}
+
+// Behaves like getcwd (buffer, size), filling the cache if it's empty
+char *
+cached_getcwd (char *buffer, size_t size)
+{
+    if (cwd_cache_copy (buffer, size) > 0) {
+        return buffer;
+    }
+
+    if (getcwd (buffer, size) == NULL) {
+        return NULL;
+    }
+
+    // Don't wait for a concurrent chdir, it will publish a fresh copy anyway
+    if (buffer[0] == '/' && pthread_mutex_trylock (&cwd_mutex) == 0) {
+        if (saved_cwd.length.load (std::memory_order_relaxed) == 0 && getpid () == cwd_owner) {
+            cwd_cache_publish (buffer, strlen (buffer));
+        }
+        pthread_mutex_unlock (&cwd_mutex);
+    }
+
+    return buffer;
+}
+
+void
+cwd_cache_atfork_child ()
+{
+    // The child has the same working directory, but another thread of the
+    // parent might have been updating the copy.
+    pthread_mutex_init (&cwd_mutex, NULL);
+    cwd_owner = getpid ();
+    if (saved_cwd.sequence.load (std::memory_order_relaxed) & 1) {
+        saved_cwd.length.store (0, std::memory_order_relaxed);
+        saved_cwd.sequence.fetch_add (1, std::memory_order_relaxed);
+    }
+}
+
+void
+cwd_cache_init ()
+{
+    cwd_owner = getpid ();
+    pthread_mutex_lock (&cwd_mutex);
+    cwd_cache_refresh ();
+    pthread_mutex_unlock (&cwd_mutex);
+
+    pthread_atfork (NULL, NULL, cwd_cache_atfork_child);
+}
+
+// Directory descriptor table
+//
+// *at() calls with a relative path and a directory descriptor can only be
+// redirected if we know which path the descriptor was opened for.  Our
+// open/openat/opendir wrappers record that here, indexed by descriptor, for
+// every open that may have given a directory (O_DIRECTORY, O_PATH or
+// read-only), which costs an fstat on read-only opens of files, and
+// close/closedir/dup* keep it current.  Entries are fixed size and read under
+// a per entry sequence lock, so lookups neither allocate nor take locks.
+// Paths that don't fit and descriptors above FD_TABLE_SIZE are not tracked.
+// Descriptors can also be closed where we don't see it (close_range, raw
+// syscalls, inside libc) and their number reused, so entries keep the device
+// and inode of the directory and are checked against the descriptor before a
+// path joined to them is redirected.
+struct fd_identity
+{
+    uint64_t dev;
+    uint64_t ino;
+    bool directory;
+};
+
+struct fd_entry
+{
+    // Odd while the entry is being updated
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> length;
+    std::atomic<uint64_t> dev;
+    std::atomic<uint64_t> ino;
+    char path[FD_TABLE_PATH_MAX];
+};
+
+fd_entry fd_table[FD_TABLE_SIZE];
+
+inline bool
+fd_table_tracks (int fd)
+{
+    return fd >= 0 && fd < FD_TABLE_SIZE;
+}
+
+// What fd refers to now, errno is left alone
+bool
+fd_identify (int fd, fd_identity& identity)
+{
+    int saved_errno = errno;
+    struct stat st;
+    bool ok = fstat (fd, &st) == 0;
+    errno = saved_errno;
+
+    if (ok) {
+        identity.dev = st.st_dev;
+        identity.ino = st.st_ino;
+        identity.directory = S_ISDIR (st.st_mode);
+    }
+    return ok;
+}
+
+// Whether fd still refers to the directory identity was recorded for
+bool
+fd_table_current (int fd, fd_identity const& identity)
+{
+    fd_identity now;
+    return fd_identify (fd, now) && now.dev == identity.dev && now.ino == identity.ino;
+}
+
+void
+fd_table_store (int fd, const char *path, size_t length, fd_identity const& identity)
+{
+    fd_entry& entry = fd_table[fd];
+    uint32_t sequence = entry.sequence.load (std::memory_order_relaxed);
+
+    // Descriptors are only updated concurrently by racy applications, so just
+    // wait for the other writer.
+    while ((sequence & 1) || !entry.sequence.compare_exchange_weak (sequence, sequence + 1, std::memory_order_relaxed)) {
+        sequence = entry.sequence.load (std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence (std::memory_order_release);
+
+    if (length < sizeof (entry.path)) {
+        memcpy (entry.path, path, length);
+        entry.length.store (length, std::memory_order_relaxed);
+        entry.dev.store (identity.dev, std::memory_order_relaxed);
+        entry.ino.store (identity.ino, std::memory_order_relaxed);
+    } else {
+        entry.length.store (0, std::memory_order_relaxed);
+    }
+
+    entry.sequence.store (sequence + 2, std::memory_order_release);
+}
+
+inline void
+fd_table_forget (int fd)
+{
+    if (fd_table_tracks (fd) && fd_table[fd].length.load (std::memory_order_relaxed) != 0) {
+        fd_table_store (fd, NULL, 0, fd_identity ());
+    }
+}
+
+// Copies the path fd was opened for into buffer and the directory's identity
+// into identity, returning its length or 0 if it's unknown.
+size_t
+fd_table_copy (int fd, char *buffer, size_t size, fd_identity& identity)
+{
+    if (!fd_table_tracks (fd)) {
+        return 0;
+    }
+
+    fd_entry& entry = fd_table[fd];
+    for (int tries = 0; tries < 3; ++tries) {
+        uint32_t sequence = entry.sequence.load (std::memory_order_acquire);
+        if (sequence & 1) {
+            continue;
+        }
+
+        size_t length = entry.length.load (std::memory_order_relaxed);
+        if (length == 0 || length >= size) {
+            return 0;
+        }
+
+        memcpy (buffer, entry.path, length);
+        identity.dev = entry.dev.load (std::memory_order_relaxed);
+        identity.ino = entry.ino.load (std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_acquire);
+
+        if (entry.sequence.load (std::memory_order_relaxed) == sequence) {
+            buffer[length] = '\0';
+            return length;
+        }
+    }
+
+    return 0;
+}
+
+void
+fd_table_duplicate (int oldfd, int newfd)
+{
+    if (!fd_table_tracks (newfd) || oldfd == newfd) {
+        return;
+    }
+
+    char path[FD_TABLE_PATH_MAX];
+    fd_identity identity;
+    size_t length = fd_table_copy (oldfd, path, sizeof (path), identity);
+    if (length > 0) {
+        fd_table_store (newfd, path, length, identity);
+    } else {
+        fd_table_forget (newfd);
+    }
+}
+
+// Records fd as opened for path (relative to dirfd) if it is a directory, or
+// drops whatever a previous user of that descriptor number left.
+void
+fd_table_opened (int fd, int dirfd, const char *path, bool maybe_directory)
+{
+    if (!fd_table_tracks (fd)) {
+        return;
+    }
+
+    if (!maybe_directory || path == NULL || path[0] == '\0') {
+        fd_table_forget (fd);
+        return;
+    }
+
+    char absolute[FD_TABLE_PATH_MAX];
+    size_t length = 0;
+
+    if (path[0] != '/') {
+        if (dirfd == AT_FDCWD) {
+            int saved_errno = errno;
+            if (cached_getcwd (absolute, sizeof (absolute)) != NULL) {
+                length = strlen (absolute);
+            }
+            errno = saved_errno;
+        } else {
+            fd_identity parent;
+            length = fd_table_copy (dirfd, absolute, sizeof (absolute), parent);
+            if (length > 0 && !fd_table_current (dirfd, parent)) {
+                length = 0;
+            }
+        }
+
+        if (length == 0) {
+            fd_table_forget (fd);
+            return;
+        }
+
+        if (absolute[length - 1] != '/') {
+            absolute[length++] = '/';
+        }
+    }
+
+    size_t path_length = strlen (path);
+    if (length + path_length >= sizeof (absolute)) {
+        fd_table_forget (fd);
+        return;
+    }
+
+    fd_identity identity;
+    if (!fd_identify (fd, identity) || !identity.directory) {
+        fd_table_forget (fd);
+        return;
+    }
+
+    memcpy (absolute + length, path, path_length);
+    fd_table_store (fd, absolute, length + path_length, identity);
+}
+
+void
+fd_table_atfork_child ()
+{
+    // Entries another thread was updating would stay locked
+    for (auto& entry : fd_table) {
+        uint32_t sequence = entry.sequence.load (std::memory_order_relaxed);
+        if (sequence & 1) {
+            entry.length.store (0, std::memory_order_relaxed);
+            entry.sequence.store (sequence + 1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void
+fd_table_init ()
+{
+    pthread_atfork (NULL, NULL, fd_table_atfork_child);
+}
+
+// Redirect rules
+//
+// Each rule applies an action to every path under its prefix, the longest
+// matching prefix wins and paths matching no rule (including relative ones)
+// get the default action.  A prefix ending in '*' matches any path starting
+// with the text before it, otherwise it only matches whole path components.
+// The rules are compiled into a trie so a path is classified in a single left
+// to right scan, no matter how many rules there are.
+enum redirect_action : uint8_t
+{
+    ACTION_PASSTHROUGH, // leave the path alone
+    ACTION_PRELOAD,     // use SNAPCRAFT_PRELOAD/path if it exists
+    ACTION_REWRITE,     // replace the prefix with target
+    ACTION_WRITABLE,    // use the path if it exists, else replace the prefix with target
+    ACTION_BYPASS,      // like passthrough, for paths that can't be in SNAPCRAFT_PRELOAD
+};
+
+struct redirect_rule
+{
+    redirect_action action;
+    std::string prefix;
+    std::string target;
+};
+
+class redirect_rules
+{
+public:
+    redirect_rules ()
+    {
+        default_rule_.action = ACTION_PRELOAD;
+    }
+
+    void
+    add (redirect_action action, std::string prefix, std::string const& target)
+    {
+        bool raw = !prefix.empty () && prefix.back () == '*';
+        if (raw) {
+            prefix.resize (prefix.size () - 1);
+        } else {
+            while (!prefix.empty () && prefix.back () == '/') {
+                prefix.resize (prefix.size () - 1);
+            }
+        }
+
+        rules_.push_back ({action, prefix, target});
+        raw_.push_back (raw);
+    }
+
+    void
+    set_default (redirect_action action)
+    {
+        default_rule_.action = action;
+    }
+
+    void
+    clear ()
+    {
+        rules_.clear ();
+        raw_.clear ();
+    }
+
+    void compile ();
+
+    // Returns the rule for path, along with how many characters of path its
+    // prefix covers.
+    const redirect_rule&
+    match (const char *path, size_t& prefix_len) const
+    {
+        int best = -1;
+        size_t best_len = 0;
+        uint32_t node = 0;
+
+        for (size_t i = 0; node < nodes_.size (); ++i) {
+            const trie_node& n = nodes_[node];
+            if (n.raw_rule >= 0) {
+                best = n.raw_rule;
+                best_len = i;
+            }
+            if (n.component_rule >= 0 && (path[i] == '\0' || path[i] == '/')) {
+                best = n.component_rule;
+                best_len = i;
+            }
+            if (path[i] == '\0') {
+                break;
+            }
+
+            uint32_t next = nodes_.size ();
+            for (uint32_t e = n.first_edge; e < n.first_edge + n.edge_count; ++e) {
+                if (edge_bytes_[e] == path[i]) {
+                    next = edge_targets_[e];
+                    break;
+                }
+            }
+            node = next;
+        }
+
+        if (best < 0) {
+            prefix_len = 0;
+            return default_rule_;
+        }
+
+        prefix_len = best_len;
+        return rules_[best];
+    }
+
+private:
+    struct trie_node
+    {
+        uint32_t first_edge;
+        uint32_t edge_count;
+        int32_t raw_rule;
+        int32_t component_rule;
+    };
+
+    std::vector<redirect_rule> rules_;
+    std::vector<bool> raw_;
+    redirect_rule default_rule_;
+
+    // Nodes are laid out breadth first, with the edges of each node stored
+    // contiguously in edge_bytes_/edge_targets_.
+    std::vector<trie_node> nodes_;
+    std::vector<char> edge_bytes_;
+    std::vector<uint32_t> edge_targets_;
+};
+
+void
+redirect_rules::compile ()
+{
+    struct build_node
+    {
+        std::vector<std::pair<char, uint32_t>> children;
+        int32_t raw_rule = -1;
+        int32_t component_rule = -1;
+    };
+
+    std::vector<build_node> build (1);
+    for (size_t r = 0; r < rules_.size (); ++r) {
+        uint32_t node = 0;
+        for (char c : rules_[r].prefix) {
+            uint32_t next = 0;
+            for (auto const& child : build[node].children) {
+                if (child.first == c) {
+                    next = child.second;
+                    break;
+                }
+            }
+            if (next == 0) {
+                next = build.size ();
+                build[node].children.emplace_back (c, next);
+                build.emplace_back ();
+            }
+            node = next;
+        }
+
+        // Later rules override earlier ones for the same prefix
+        (raw_[r] ? build[node].raw_rule : build[node].component_rule) = r;
+    }
+
+    nodes_.clear ();
+    edge_bytes_.clear ();
+    edge_targets_.clear ();
+
+    std::vector<uint32_t> order (1, 0);
+    std::vector<uint32_t> flat_index (build.size (), 0);
+    for (size_t i = 0; i < order.size (); ++i) {
+        build_node const& b = build[order[i]];
+        trie_node n;
+        n.first_edge = edge_bytes_.size ();
+        n.edge_count = b.children.size ();
+        n.raw_rule = b.raw_rule;
+        n.component_rule = b.component_rule;
+        nodes_.push_back (n);
+
+        for (auto const& child : b.children) {
+            flat_index[child.second] = order.size ();
+            order.push_back (child.second);
+            edge_bytes_.push_back (child.first);
+            edge_targets_.push_back (0);
+        }
+    }
+
+    for (size_t i = 0; i < order.size (); ++i) {
+        build_node const& b = build[order[i]];
+        for (size_t c = 0; c < b.children.size (); ++c) {
+            edge_targets_[nodes_[i].first_edge + c] = flat_index[b.children[c].second];
+        }
+    }
+}
+
+redirect_rules saved_redirect_rules;
+
+// Expands $VAR and ${VAR} from the environment
+std::string
+expand_variables (std::string const& value)
+{
+    std::string expanded;
+
+    for (size_t i = 0; i < value.size (); ++i) {
+        if (value[i] != '$' || i + 1 >= value.size ()) {
+            expanded += value[i];
+            continue;
+        }
+
+        size_t start = i + 1, end;
+        if (value[start] == '{') {
+            end = value.find ('}', start);
+            if (end == std::string::npos) {
+                expanded += value.substr (i);
+                break;
+            }
+            expanded += getenv_string (value.substr (start + 1, end - start - 1));
+            i = end;
+        } else {
+            end = start;
+            while (end < value.size () && (isalnum (value[end]) || value[end] == '_')) {
+                ++end;
+            }
+            expanded += getenv_string (value.substr (start, end - start));
+            i = end - 1;
+        }
+    }
+
+    return expanded;
+}
+
+bool
+parse_redirect_action (std::string const& name, redirect_action& action)
+{
+    static const struct { const char *name; redirect_action action; } actions[] = {
+        { "passthrough", ACTION_PASSTHROUGH },
+        { "preload", ACTION_PRELOAD },
+        { "rewrite", ACTION_REWRITE },
+        { "writable", ACTION_WRITABLE },
+        { "bypass", ACTION_BYPASS },
+    };
+
+    for (auto const& a : actions) {
+        if (name == a.name) {
+            action = a.action;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Rules files have one rule per line, in the form:
+//
+//   # comment
+//   default <action>
+//   passthrough|preload|bypass <prefix>
+//   rewrite|writable <prefix> <target>
+//
+// where prefixes and targets may use environment variables.
+void
+load_redirect_rules (std::string const& rules_path)
+{
+    int fd = next_symbol<int (*) (const char *, int, ...)> (SYMBOL_open) (rules_path.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf (stderr, "snapcraft-preload: can't open rules file '%s': %s\n", rules_path.c_str (), strerror (errno));
+        return;
+    }
+
+    std::string contents;
+    char chunk[4096];
+    ssize_t n;
+    while ((n = read (fd, chunk, sizeof (chunk))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) {
+            contents.append (chunk, n);
+        }
+    }
+    close (fd);
+
+    std::istringstream lines (contents);
+    std::string line;
+    for (unsigned lineno = 1; std::getline (lines, line); ++lineno) {
+        std::istringstream fields (line);
+        std::string name, prefix, target, extra;
+        fields >> name >> prefix >> target >> extra;
+
+        if (name.empty () || name[0] == '#') {
+            continue;
+        }
+
+        redirect_action action;
+        bool needs_target;
+        if (!parse_redirect_action (name == "default" ? prefix : name, action)) {
+            fprintf (stderr, "snapcraft-preload: %s:%u: unknown action\n", rules_path.c_str (), lineno);
+            continue;
+        }
+
+        if (name == "default") {
+            if (!target.empty ()) {
+                fprintf (stderr, "snapcraft-preload: %s:%u: default takes only an action\n", rules_path.c_str (), lineno);
+                continue;
+            }
+            saved_redirect_rules.set_default (action);
+            continue;
+        }
+
+        needs_target = action == ACTION_REWRITE || action == ACTION_WRITABLE;
+        if (prefix.empty () || needs_target == target.empty () || !extra.empty ()) {
+            fprintf (stderr, "snapcraft-preload: %s:%u: invalid rule\n", rules_path.c_str (), lineno);
+            continue;
+        }
+
+        saved_redirect_rules.add (action, expand_variables (prefix), expand_variables (target));
+    }
+}
+
+void
+redirect_rules_init ()
+{
+    // The historical behaviour: shared memory is confined to the snap's
+    // namespace, /var/lib is writable in SNAP_DATA and everything else is
+    // looked up in SNAPCRAFT_PRELOAD, unless SNAPCRAFT_PRELOAD_REDIRECT_ONLY_SHM
+    // is set.
+    redirect_action fallback = saved_snapcraft_preload_redirect_only_shm ? ACTION_PASSTHROUGH : ACTION_PRELOAD;
+
+    saved_redirect_rules.set_default (fallback);
+    // Pseudo filesystems and runtime state never come from the snap, and
+    // are polled constantly by some runtimes
+    for (const char *prefix : { "/proc", "/sys", "/dev", "/run" }) {
+        saved_redirect_rules.add (ACTION_BYPASS, prefix, "");
+    }
+    saved_redirect_rules.add (ACTION_REWRITE, DEFAULT_DEVSHM + "*", saved_snap_devshm + '.');
+    saved_redirect_rules.add (fallback, saved_snap_devshm + "*", "");
+    saved_redirect_rules.add (fallback, saved_snap_sem + "*", "");
+    if (!saved_snapcraft_preload_redirect_only_shm) {
+        if (saved_varlib.empty ()) {
+            saved_redirect_rules.add (ACTION_PASSTHROUGH, DEFAULT_VARLIB, "");
+        } else {
+            saved_redirect_rules.add (ACTION_WRITABLE, DEFAULT_VARLIB, saved_varlib);
+        }
+    }
+
+    std::string const& rules_path = getenv_string (SNAPCRAFT_PRELOAD_RULES);
+    if (!rules_path.empty ()) {
+        load_redirect_rules (rules_path);
+    }
+
+    saved_redirect_rules.compile ();
+}
+
+// Tracing
+//
+// With SNAPCRAFT_PRELOAD_TRACE set, every intercepted call appends a record
+// of the function, the path it was given, where it went and the resulting
+// errno to a ring buffer in a per process file, see trace.h.  Threads claim
+// TRACE_CHUNK_SIZE records at a time with a single atomic add and fill them
+// without further synchronization.  The file is shared memory, so the trace
+// survives the process crashing.
+struct trace_chunk
+{
+    uint32_t generation;
+    uint64_t next;
+    uint64_t end;
+};
+
+std::string saved_trace_path;
+trace_header *trace_buffer = NULL;
+size_t trace_buffer_size = 0;
+// Bumped whenever a new buffer is mapped, so threads drop their chunks
+std::atomic<uint32_t> trace_generation (1);
+__thread trace_chunk thread_trace_chunk __attribute__ ((tls_model ("initial-exec")));
+
+inline trace_record *
+trace_records ()
+{
+    return reinterpret_cast<trace_record *> (trace_buffer + 1);
+}
+
+// Keeps the end of src, which tells most about a path, if it doesn't fit
+void
+trace_copy_path (char *dest, const char *src, uint8_t& flags, uint8_t truncated)
+{
+    if (src == NULL) {
+        dest[0] = '\0';
+        return;
+    }
+
+    size_t length = strlen (src);
+    if (length >= TRACE_PATH_MAX) {
+        src += length - (TRACE_PATH_MAX - 1);
+        length = TRACE_PATH_MAX - 1;
+        flags |= truncated;
+    }
+    memcpy (dest, src, length);
+    dest[length] = '\0';
+}
+
+void
+trace_call (symbol_id id, const char *path, const char *redirected, trace_decision decision, int error, uint8_t flags)
+{
+    trace_header *header = trace_buffer;
+    if (header == NULL) {
+        return;
+    }
+
+    trace_chunk& chunk = thread_trace_chunk;
+    uint32_t generation = trace_generation.load (std::memory_order_acquire);
+    if (chunk.generation != generation || chunk.next == chunk.end) {
+        chunk.next = header->head.fetch_add (TRACE_CHUNK_SIZE, std::memory_order_relaxed);
+        chunk.end = chunk.next + TRACE_CHUNK_SIZE;
+        chunk.generation = generation;
+    }
+
+    uint64_t position = chunk.next++;
+    trace_record& record = trace_records ()[position & (header->capacity - 1)];
+    record.sequence.store (0, std::memory_order_relaxed);
+    std::atomic_thread_fence (std::memory_order_release);
+
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    record.timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    record.tid = syscall (SYS_gettid);
+    record.function = id;
+    record.decision = decision;
+    record.error = error;
+    trace_copy_path (record.path, path, flags, TRACE_PATH_TRUNCATED);
+    trace_copy_path (record.redirected, redirected, flags, TRACE_REDIRECTED_TRUNCATED);
+    record.flags = flags;
+
+    record.sequence.store (position + 1, std::memory_order_release);
+}
+
+// Works out which rule sent path to redirected
+trace_decision
+trace_decide (const char *path, const char *redirected)
+{
+    if (path == NULL || redirected == NULL || redirected == path || strcmp (path, redirected) == 0) {
+        return TRACE_UNCHANGED;
+    }
+
+    if (str_starts_with (redirected, saved_snapcraft_preload)) {
+        return TRACE_PRELOAD;
+    }
+
+    size_t prefix_len;
+    switch (saved_redirect_rules.match (path, prefix_len).action) {
+    case ACTION_REWRITE:
+        return TRACE_REWRITE;
+    case ACTION_WRITABLE:
+        return TRACE_WRITABLE;
+    default:
+        return TRACE_UNCHANGED;
+    }
+}
+
+inline void
+trace_redirect (symbol_id id, const char *path, const char *redirected, bool failed)
+{
+    if (__builtin_expect (trace_buffer != NULL, 0)) {
+        int saved_errno = errno;
+        trace_call (id, path, redirected, trace_decide (path, redirected), failed ? saved_errno : 0, 0);
+        errno = saved_errno;
+    }
+}
+
+void
+trace_open ()
+{
+    const char *records = secure_getenv (SNAPCRAFT_PRELOAD_TRACE_RECORDS.c_str ());
+    uint64_t capacity = TRACE_DEFAULT_RECORDS;
+    if (records != NULL && atoll (records) > 0) {
+        // A power of two number of whole chunks
+        capacity = TRACE_CHUNK_SIZE;
+        while (capacity < (uint64_t) atoll (records)) {
+            capacity *= 2;
+        }
+    }
+
+    // Never clobber an earlier trace, like the one of the process image that
+    // exec'd us with the same pid.
+    char base[PATH_MAX];
+    if (!expand_pid_pattern (saved_trace_path.c_str (), base, sizeof (base))) {
+        fprintf (stderr, "snapcraft-preload: trace path '%s' is too long\n", saved_trace_path.c_str ());
+        return;
+    }
+    std::string path = base;
+    auto _open = next_symbol<int (*) (const char *, int, ...)> (SYMBOL_open);
+    int fd = -1;
+    for (unsigned n = 1; n < 1000; ++n) {
+        fd = _open (path.c_str (), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd >= 0 || errno != EEXIST) {
+            break;
+        }
+        path = std::string (base) + "." + std::to_string (n);
+    }
+
+    if (fd < 0) {
+        fprintf (stderr, "snapcraft-preload: cannot create trace '%s': %s\n", path.c_str (), strerror (errno));
+        return;
+    }
+
+    size_t size = sizeof (trace_header) + capacity * sizeof (trace_record);
+    void *map = MAP_FAILED;
+    if (ftruncate (fd, size) == 0) {
+        map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close (fd);
+
+    if (map == MAP_FAILED) {
+        fprintf (stderr, "snapcraft-preload: cannot map trace '%s': %s\n", path.c_str (), strerror (errno));
+        return;
+    }
+
+    trace_header *header = new (map) trace_header ();
+    header->version = TRACE_VERSION;
+    header->record_size = sizeof (trace_record);
+    header->capacity = capacity;
+    header->pid = getpid ();
+    header->chunk_size = TRACE_CHUNK_SIZE;
+    header->function_count = MIN ((unsigned) SYMBOL_COUNT, (unsigned) TRACE_FUNCTIONS_MAX);
+    for (unsigned i = 0; i < header->function_count; ++i) {
+        strncpy (header->functions[i], symbol_names[i], TRACE_FUNCTION_NAME_MAX - 1);
+    }
+
+    struct timespec ts;
+    clock_gettime (CLOCK_REALTIME, &ts);
+    header->start_realtime = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    header->start_monotonic = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    // Written last, so readers never see a header that isn't filled in
+    memcpy (header->magic, TRACE_MAGIC, sizeof (TRACE_MAGIC));
+
+    trace_buffer_size = size;
+    trace_generation.fetch_add (1, std::memory_order_release);
+    trace_buffer = header;
+}
+
+void
+trace_atfork_child ()
+{
+    // The mapping is shared with the parent, the child gets its own file
+    if (trace_buffer != NULL) {
+        munmap (trace_buffer, trace_buffer_size);
+        trace_buffer = NULL;
+    }
+    trace_open ();
+}
+
+void
+trace_init ()
+{
+    saved_trace_path = getenv_string (SNAPCRAFT_PRELOAD_TRACE);
+    if (saved_trace_path.empty ()) {
+        return;
+    }
+
+    trace_open ();
+    pthread_atfork (NULL, NULL, trace_atfork_child);
+}
+
+// Hot paths
+//
+// With SNAPCRAFT_PRELOAD_HOTPATHS set, the paths going through redirect_call
+// and the socket wrappers are counted along with where they were sent and the
+// time the real call took, so the most used ones can be reported at exit.
+// The counts come from a space-saving sketch of HOTPATH_COUNTERS counters:
+// a path without a counter takes over the smallest one, inheriting its count
+// as the possible overestimate.  Memory use doesn't grow with the number of
+// distinct paths, and any path seen more than calls / HOTPATH_COUNTERS times
+// is guaranteed to be listed.  Each thread counts into its own sketch like
+// the latency blocks, so counting takes no lock others wait on, and the
+// sketches are merged when writing the report.  Only one in
+// SNAPCRAFT_PRELOAD_HOTPATHS_SAMPLE calls of each thread is counted.
+struct hotpath_counter
+{
+    path_key key;
+    uint64_t count;
+    // How much of count may belong to paths this counter held before
+    uint64_t error;
+    // Calls counted since this path took the counter, and their total time
+    uint64_t calls;
+    uint64_t ticks;
+    uint8_t decision;
+    bool truncated;
+    char path[HOTPATH_PATH_MAX];
+};
+
+struct hotpath_sketch
+{
+    // Held by the owning thread while counting and by the report while
+    // reading, so practically never contended
+    std::atomic<bool> busy;
+    std::atomic<bool> in_use;
+    unsigned used;
+    hotpath_counter counters[HOTPATH_COUNTERS];
+    hotpath_sketch *next;
+};
+
+const char *const hotpath_decision_names[] = { "passthrough", "preload", "rewrite", "writable" };
+
+bool hotpaths_enabled = false;
+std::string saved_hotpaths_path;
+unsigned hotpaths_top = HOTPATH_DEFAULT_TOP;
+unsigned hotpaths_sample = 1;
+std::atomic<hotpath_sketch *> hotpath_sketches;
+pthread_key_t hotpath_key;
+__thread hotpath_sketch *thread_hotpath_sketch __attribute__ ((tls_model ("initial-exec")));
+__thread unsigned hotpath_countdown __attribute__ ((tls_model ("initial-exec")));
+
+// Returns when a call to time for the report started, or 0 if it isn't
+inline uint64_t
+hotpath_start ()
+{
+    if (__builtin_expect (!hotpaths_enabled, 1)) {
+        return 0;
+    }
+    if (hotpath_countdown > 0) {
+        --hotpath_countdown;
+        return 0;
+    }
+    hotpath_countdown = hotpaths_sample - 1;
+    return latency_now ();
+}
+
+hotpath_sketch *
+hotpath_sketch_acquire ()
+{
+    for (hotpath_sketch *sketch = hotpath_sketches.load (std::memory_order_acquire); sketch; sketch = sketch->next) {
+        bool in_use = false;
+        if (sketch->in_use.compare_exchange_strong (in_use, true, std::memory_order_acquire)) {
+            return sketch;
+        }
+    }
+
+    // Not through malloc, which may be what we're counting a call from
+    void *map = mmap (NULL, sizeof (hotpath_sketch), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    hotpath_sketch *sketch = new (map) hotpath_sketch ();
+    sketch->in_use.store (true, std::memory_order_relaxed);
+    sketch->next = hotpath_sketches.load (std::memory_order_relaxed);
+    while (!hotpath_sketches.compare_exchange_weak (sketch->next, sketch, std::memory_order_release)) {
+    }
+    return sketch;
+}
+
+void
+hotpath_sketch_release (void *sketch)
+{
+    static_cast<hotpath_sketch *> (sketch)->in_use.store (false, std::memory_order_release);
+}
+
+void
+hotpath_record (const char *path, const char *redirected, uint64_t start)
+{
+    uint64_t ticks = latency_now () - start;
+    hotpath_sketch *sketch = thread_hotpath_sketch;
+    if (__builtin_expect (sketch == NULL, 0)) {
+        sketch = thread_hotpath_sketch = hotpath_sketch_acquire ();
+        if (sketch == NULL) {
+            return;
+        }
+        pthread_setspecific (hotpath_key, sketch);
+    }
+
+    trace_decision decision = trace_decide (path, redirected);
+    size_t len = strlen (path);
+    path_key key = hash_path (path, len);
+    key.hi ^= decision;
+
+    // Only the report may have it, and only for a moment
+    while (sketch->busy.exchange (true, std::memory_order_acquire)) {
+        sched_yield ();
+    }
+
+    hotpath_counter *counter = NULL;
+    hotpath_counter *smallest = sketch->counters;
+    for (unsigned i = 0; i < sketch->used; ++i) {
+        hotpath_counter& c = sketch->counters[i];
+        if (c.key.lo == key.lo && c.key.hi == key.hi) {
+            counter = &c;
+            break;
+        }
+        if (c.count < smallest->count) {
+            smallest = &c;
+        }
+    }
+
+    if (counter == NULL) {
+        if (sketch->used < HOTPATH_COUNTERS) {
+            counter = &sketch->counters[sketch->used++];
+            counter->count = 0;
+        } else {
+            counter = smallest;
+        }
+
+        counter->key = key;
+        counter->error = counter->count;
+        counter->calls = 0;
+        counter->ticks = 0;
+        counter->decision = decision;
+        // Keep the end of long paths, it tells them apart
+        counter->truncated = len >= HOTPATH_PATH_MAX;
+        const char *tail = counter->truncated ? path + len - (HOTPATH_PATH_MAX - 1) : path;
+        memcpy (counter->path, tail, MIN (len, (size_t) HOTPATH_PATH_MAX - 1) + 1);
+    }
+
+    counter->count++;
+    counter->calls++;
+    counter->ticks += ticks;
+
+    sketch->busy.store (false, std::memory_order_release);
+}
+
+// A path's counts summed over the sketches
+struct hotpath_merged
+{
+    const hotpath_counter *counter;
+    uint64_t count;
+    uint64_t error;
+    uint64_t calls;
+    uint64_t ticks;
+    // Sum of the smallest counts of the full sketches holding the path
+    uint64_t present_minimum;
+};
+
+// Lines of '<count> <overestimate> <mean call time> <decision> <path>' for the
+// most counted paths, counts being of sampled calls.  A path that a full
+// sketch doesn't hold may have been counted there up to its smallest count,
+// which is added to its count and overestimate.  Before an exec, which may be
+// from a signal handler that interrupted a thread counting, sketches being
+// counted into are left out rather than waited for.
+void
+write_hotpaths (bool before_exec)
+{
+    if (!hotpaths_enabled) {
+        return;
+    }
+
+    // Holds every sketch for the time of the report
+    size_t sketches = 0;
+    for (hotpath_sketch *sketch = hotpath_sketches.load (std::memory_order_acquire); sketch; sketch = sketch->next) {
+        ++sketches;
+    }
+    size_t capacity = sketches * HOTPATH_COUNTERS;
+    size_t buckets = 1;
+    while (buckets < capacity * 2) {
+        buckets *= 2;
+    }
+
+    // Not through malloc, this may run in a vfork child or a signal handler
+    size_t map_size = capacity * sizeof (hotpath_merged) + buckets * sizeof (uint32_t);
+    void *map = capacity ? mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : NULL;
+    if (map == MAP_FAILED) {
+        return;
+    }
+    hotpath_merged *merged = static_cast<hotpath_merged *> (map);
+    // Index + 1 into merged, 0 when empty
+    uint32_t *index = reinterpret_cast<uint32_t *> (merged + capacity);
+    size_t merged_count = 0;
+    uint64_t total_minimum = 0;
+
+    for (hotpath_sketch *sketch = hotpath_sketches.load (std::memory_order_acquire); sketch; sketch = sketch->next) {
+        if (sketch->busy.exchange (true, std::memory_order_acquire)) {
+            if (before_exec) {
+                continue;
+            }
+            while (sketch->busy.exchange (true, std::memory_order_acquire)) {
+                sched_yield ();
+            }
+        }
+
+        uint64_t minimum = 0;
+        if (sketch->used == HOTPATH_COUNTERS) {
+            minimum = sketch->counters[0].count;
+            for (unsigned i = 1; i < sketch->used; ++i) {
+                minimum = MIN (minimum, sketch->counters[i].count);
+            }
+            total_minimum += minimum;
+        }
+
+        for (unsigned i = 0; i < sketch->used; ++i) {
+            hotpath_counter const& c = sketch->counters[i];
+            size_t slot = c.key.lo & (buckets - 1);
+            while (index[slot] != 0 && (merged[index[slot] - 1].counter->key.lo != c.key.lo ||
+                                        merged[index[slot] - 1].counter->key.hi != c.key.hi)) {
+                slot = (slot + 1) & (buckets - 1);
+            }
+            if (index[slot] == 0) {
+                merged[merged_count].counter = &c;
+                index[slot] = ++merged_count;
+            }
+
+            hotpath_merged& m = merged[index[slot] - 1];
+            m.count += c.count;
+            m.error += c.error;
+            m.calls += c.calls;
+            m.ticks += c.ticks;
+            m.present_minimum += minimum;
+        }
+        // Counters are read again when writing, the sketch stays held
+    }
+
+    report_writer report (saved_hotpaths_path);
+    report.add ("pid ").add_number (getpid ()).add ("\n");
+    report.add ("hotpaths.sample ").add_number (hotpaths_sample).add ("\n");
+    report.add ("hotpaths.unit ").add (LATENCY_UNIT).add ("\n");
+
+    // Picks the largest count left each time, the top is short enough
+    for (size_t n = 0; n < merged_count && n < hotpaths_top; ++n) {
+        hotpath_merged *top = NULL;
+        for (size_t i = 0; i < merged_count; ++i) {
+            if (merged[i].counter != NULL && (top == NULL || merged[i].count - merged[i].present_minimum > top->count - top->present_minimum)) {
+                top = &merged[i];
+            }
+        }
+
+        uint64_t missing = total_minimum - top->present_minimum;
+        hotpath_counter const& c = *top->counter;
+        report.add_number (top->count + missing).add (" ").add_number (top->error + missing).add (" ");
+        report.add_number (top->calls ? top->ticks / top->calls : 0).add (" ");
+        report.add (hotpath_decision_names[c.decision]).add (" ").add (c.truncated ? "..." : "").add (c.path).add ("\n");
+        top->counter = NULL;
+    }
+
+    for (hotpath_sketch *sketch = hotpath_sketches.load (std::memory_order_acquire); sketch; sketch = sketch->next) {
+        sketch->busy.store (false, std::memory_order_release);
+    }
+    if (map != NULL) {
+        munmap (map, map_size);
+    }
+}
+
+void
+hotpath_atfork_child ()
+{
+    // The child counts its own calls with only the forking thread
+    for (hotpath_sketch *sketch = hotpath_sketches.load (std::memory_order_relaxed); sketch; sketch = sketch->next) {
+        sketch->used = 0;
+        sketch->busy.store (false, std::memory_order_relaxed);
+        sketch->in_use.store (sketch == thread_hotpath_sketch, std::memory_order_relaxed);
+    }
+}
+
+void
+hotpath_init ()
+{
+    saved_hotpaths_path = getenv_string (SNAPCRAFT_PRELOAD_HOTPATHS);
+    if (saved_hotpaths_path.empty () || pthread_key_create (&hotpath_key, hotpath_sketch_release) != 0) {
+        return;
+    }
+
+    const char *top = secure_getenv (SNAPCRAFT_PRELOAD_HOTPATHS_TOP.c_str ());
+    if (top != NULL && atoi (top) > 0) {
+        hotpaths_top = MIN (atoi (top), HOTPATH_COUNTERS);
+    }
+    const char *sample = secure_getenv (SNAPCRAFT_PRELOAD_HOTPATHS_SAMPLE.c_str ());
+    if (sample != NULL && atoi (sample) > 0) {
+        hotpaths_sample = atoi (sample);
+    }
+
+    pthread_atfork (NULL, NULL, hotpath_atfork_child);
+    hotpaths_enabled = true;
+}
+
+// Metrics segment
+//
+// With SNAPCRAFT_PRELOAD_METRICS=1, every redirected call is counted by
+// function and by where its path went, along with the existence checks it
+// took, in a segment under the snap's /dev/shm prefix (see metrics.h) that
+// snapcraft-preload-stat reads while the snap runs.  Counters are relaxed
+// atomics on a cache line per function, nothing is locked.
+metrics_counters *metrics_table;
+char metrics_path[PATH_MAX];
+
+metrics_decision
+metrics_decide (const char *path, const char *redirected)
+{
+    switch (trace_decide (path, redirected)) {
+    case TRACE_PRELOAD:
+        return METRICS_PRELOAD;
+    case TRACE_REWRITE:
+        return METRICS_REWRITE;
+    case TRACE_WRITABLE:
+        return METRICS_WRITABLE;
+    default:
+        break;
+    }
+
+    size_t prefix_len;
+    if (path != NULL && saved_redirect_rules.match (path, prefix_len).action == ACTION_BYPASS) {
+        return METRICS_BYPASS;
+    }
+    return METRICS_UNCHANGED;
+}
+
+inline void
+metrics_record (symbol_id id, const char *path, const char *redirected, bool failed)
+{
+    if (__builtin_expect (!metrics_enabled, 1)) {
+        return;
+    }
+
+    metrics_counters& counters = metrics_table[id];
+    counters.decisions[metrics_decide (path, redirected)].fetch_add (1, std::memory_order_relaxed);
+    if (failed) {
+        counters.errors.fetch_add (1, std::memory_order_relaxed);
+    }
+    if (thread_existence_checks != 0) {
+        counters.existence_checks.fetch_add (thread_existence_checks, std::memory_order_relaxed);
+        counters.existence_syscalls.fetch_add (thread_existence_syscalls, std::memory_order_relaxed);
+        thread_existence_checks = 0;
+        thread_existence_syscalls = 0;
+    }
+}
+
+// For calls counted before they were made, i.e. exec
+inline void
+metrics_failed (symbol_id id)
+{
+    if (__builtin_expect (metrics_enabled, 0)) {
+        metrics_table[id].errors.fetch_add (1, std::memory_order_relaxed);
+    }
+}
+
+// Field 22 of /proc/self/stat, when the process started in clock ticks after
+// boot, 0 if it can't be read
+uint64_t
+process_start_time ()
+{
+    auto _open = next_symbol<int (*) (const char *, int, ...)> (SYMBOL_open);
+    int fd = _open ("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    char line[1024];
+    ssize_t n = read (fd, line, sizeof (line) - 1);
+    close (fd);
+    if (n <= 0) {
+        return 0;
+    }
+    line[n] = '\0';
+
+    // The command may hold spaces, the fields after its closing ')' don't
+    const char *p = strrchr (line, ')');
+    for (unsigned field = 2; p != NULL && field < 22; ++field) {
+        p = strchr (p + 1, ' ');
+    }
+    return p ? strtoull (p + 1, NULL, 10) : 0;
+}
+
+// Maps the segment of this process.  A program exec'd by this process before
+// finds its counters and carries on with them, anything else in the file is
+// left over from an earlier process with the same pid and starts over.
+bool
+metrics_open ()
+{
+    int n = snprintf (metrics_path, sizeof (metrics_path), "%s" METRICS_INFIX "%d",
+                      saved_snap_devshm.c_str (), getpid ());
+    if (n < 0 || (size_t) n >= sizeof (metrics_path)) {
+        return false;
+    }
 
-int (*_access) (const char *, int) = NULL;
+    // Not through our open(), the path is already in the snap's namespace
+    auto _open = next_symbol<int (*) (const char *, int, ...)> (SYMBOL_open);
+    int fd = _open (metrics_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
 
-template <typename dirent_t>
-using filter_function_t = int (*)(const dirent_t *);
-template <typename dirent_t>
-using compar_function_t = int (*)(const dirent_t **, const dirent_t **);
+    size_t size = sizeof (metrics_header) + SYMBOL_COUNT * sizeof (metrics_counters);
+    void *map = MAP_FAILED;
+    if (ftruncate (fd, size) == 0) {
+        map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close (fd);
+    if (map == MAP_FAILED) {
+        next_symbol<int (*) (const char *)> (SYMBOL_unlink) (metrics_path);
+        return false;
+    }
 
-using socket_action_t = int (*) (int, const struct sockaddr *, socklen_t);
-using execve_t = int (*) (const char *, char *const[], char *const[]);
+    metrics_header *header = static_cast<metrics_header *> (map);
+    uint64_t process_start = process_start_time ();
+    bool ours = memcmp (header->magic, METRICS_MAGIC, sizeof (METRICS_MAGIC)) == 0 &&
+                header->version == METRICS_VERSION &&
+                header->counters_size == sizeof (metrics_counters) &&
+                header->function_count == MIN ((unsigned) SYMBOL_COUNT, (unsigned) METRICS_FUNCTIONS_MAX) &&
+                header->pid == (uint32_t) getpid () &&
+                process_start != 0 && header->process_start == process_start;
+
+    if (!ours) {
+        memset (map, 0, size);
+        header->version = METRICS_VERSION;
+        header->counters_size = sizeof (metrics_counters);
+        header->pid = getpid ();
+        header->ppid = getppid ();
+        header->function_count = MIN ((unsigned) SYMBOL_COUNT, (unsigned) METRICS_FUNCTIONS_MAX);
+        struct timespec ts;
+        clock_gettime (CLOCK_REALTIME, &ts);
+        header->start_realtime = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        header->process_start = process_start;
+        for (unsigned i = 0; i < header->function_count; ++i) {
+            strncpy (header->functions[i], symbol_names[i], METRICS_FUNCTION_NAME_MAX - 1);
+        }
+        // Readers skip segments without the magic, so it goes in last
+        std::atomic_thread_fence (std::memory_order_release);
+        memcpy (header->magic, METRICS_MAGIC, sizeof (METRICS_MAGIC));
+    }
 
-inline std::string
-getenv_string(const std::string& varname)
+    metrics_table = reinterpret_cast<metrics_counters *> (header + 1);
+    return true;
+}
+
+void
+metrics_atfork_child ()
 {
-    char *envvar = secure_getenv (varname.c_str());
-    return envvar ? envvar : "";
+    // The inherited mapping is the parent's segment
+    if (metrics_enabled) {
+        munmap ((char *) metrics_table - sizeof (metrics_header),
+                sizeof (metrics_header) + SYMBOL_COUNT * sizeof (metrics_counters));
+        metrics_enabled = metrics_open ();
+    }
 }
 
-inline bool
-str_starts_with(const std::string& str, std::string const& prefix)
+void
+metrics_close ()
 {
-    return str.compare (0, prefix.size (), prefix) == 0;
+    // Other threads may still be counting, so the mapping stays
+    if (metrics_enabled) {
+        next_symbol<int (*) (const char *)> (SYMBOL_unlink) (metrics_path);
+    }
 }
 
-inline bool
-str_ends_with(const std::string& str, std::string const& sufix)
+void
+metrics_init ()
 {
-    if (str.size () < sufix.size ())
-        return false;
+    if (getenv_string (SNAPCRAFT_PRELOAD_METRICS) != "1" || saved_snap_instance_name.empty ()) {
+        return;
+    }
 
-    return str.compare (str.size() - sufix.size (), sufix.size (), sufix) == 0;
+    if (!metrics_open ()) {
+        fprintf (stderr, "snapcraft-preload: cannot create metrics segment '%s': %s\n", metrics_path, strerror (errno));
+        return;
+    }
+
+    pthread_atfork (NULL, NULL, metrics_atfork_child);
+    metrics_enabled = true;
+}
+
+void
+sem_identity_init ()
+{
+    saved_sem_debug = secure_getenv ("SEMWRAP_DEBUG") != NULL;
+
+    const char *snapname = getenv ("SNAP_INSTANCE_NAME");
+    if (!snapname) {
+        snapname = getenv ("SNAP_NAME");
+    }
+    if (snapname) {
+        saved_sem_snap_name_set = true;
+        saved_sem_snap_name = snapname;
+        saved_sem_path_prefix = std::string (SHM_DIR) + "/sem.snap." + snapname + ".";
+    }
+
+    const char *tmpfile = secure_getenv (SNAPCRAFT_PRELOAD_SEM_TMPFILE.c_str ());
+    sem_tmpfile_supported.store (tmpfile && strcmp (tmpfile, "1") == 0, std::memory_order_relaxed);
 }
 
-struct Initializer { Initializer (); };
+struct Initializer { Initializer (); ~Initializer (); };
 static Initializer initalizer;
 
 Initializer::Initializer()
 {
-    _access = (decltype(_access)) dlsym (RTLD_NEXT, "access");
+    resolve_next_symbols ();
+
+    saved_stats_path = getenv_string (SNAPCRAFT_PRELOAD_STATS);
+    stats_enabled = !saved_stats_path.empty ();
+    latency_init ();
+    sem_identity_init ();
 
     // We need to save LD_PRELOAD and SNAPCRAFT_PRELOAD in case we need to
     // propagate the values to an exec'd program.
@@ -135,6 +3468,16 @@ Initializer::Initializer()
     saved_snap_devshm = DEFAULT_DEVSHM + "snap." + saved_snap_instance_name;
     saved_snap_sem = DEFAULT_DEVSHM + "sem.snap." + saved_snap_instance_name;
 
+    redirect_rules_init ();
+    trace_init ();
+    hotpath_init ();
+    metrics_init ();
+    existence_cache_init ();
+    manifest_init ();
+    warmup_init ();
+    cwd_cache_init ();
+    fd_table_init ();
+
     // Pull out each absolute-pathed libsnapcraft-preload.so we find.  Better to
     // accidentally include some other libsnapcraft-preload than not propagate
     // ourselves.
@@ -145,202 +3488,436 @@ Initializer::Initializer()
             saved_ld_preloads.push_back (p);
         }
     }
+
+    for (const std::string& lib : saved_ld_preloads) {
+        saved_ld_preload_env += (saved_ld_preload_env.empty () ? LD_PRELOAD + '=' : ":") + lib;
+    }
+    saved_snapcraft_preload_env = SNAPCRAFT_PRELOAD + '=' + saved_snapcraft_preload;
 }
 
-inline void
-string_length_sanitize(std::string& path)
+Initializer::~Initializer()
 {
-    if (path.size () >= PATH_MAX) {
-        std::cerr << "snapcraft-preload: path '" << path << "' exceeds PATH_MAX size (" << PATH_MAX << ") and it will be cut.\n"
-                  << "Expect undefined behavior";
-        path.resize (PATH_MAX);
-    }
+    write_stats ();
+    write_profile ();
+    write_hotpaths (false);
+    write_warmup ();
+    metrics_close ();
 }
 
-std::string
-redirect_writable_path (std::string const& pathname, std::string const& basepath)
+// Redirected paths are built in caller provided stack space, so intercepted
+// calls never hit the allocator (which might itself be interposed).
+struct redirect_buffer
+{
+    char data[PATH_MAX + 1];
+};
+
+class path_builder
+{
+public:
+    explicit path_builder (redirect_buffer& buffer)
+        : data_ (buffer.data), size_ (0), truncated_ (false)
+    {
+        data_[0] = '\0';
+    }
+
+    void
+    append (const char *str, size_t len)
+    {
+        size_t available = PATH_MAX - size_;
+        if (len > available) {
+            if (!truncated_) {
+                fprintf (stderr, "snapcraft-preload: path '%s%s' exceeds PATH_MAX size (%d) and it will be cut.\n"
+                                 "Expect undefined behavior", data_, str, PATH_MAX);
+            }
+            truncated_ = true;
+            len = available;
+        }
+        memcpy (data_ + size_, str, len);
+        size_ += len;
+        data_[size_] = '\0';
+    }
+
+    void append (const char *str) { append (str, strlen (str)); }
+    void append (std::string const& str) { append (str.data (), str.size ()); }
+    void append (char c) { append (&c, 1); }
+
+    void
+    resize (size_t size)
+    {
+        size_ = MIN (size, (size_t) PATH_MAX);
+        data_[size_] = '\0';
+    }
+
+    char back () const { return size_ ? data_[size_ - 1] : '\0'; }
+    size_t size () const { return size_; }
+    char *data () { return data_; }
+    size_t capacity () const { return PATH_MAX + 1; }
+
+private:
+    char *data_;
+    size_t size_;
+    bool truncated_;
+};
+
+const char *
+redirect_writable_path (const char *pathname, std::string const& basepath, redirect_buffer& buffer)
 {
-    if (pathname.empty ()) {
+    if (pathname[0] == '\0') {
         return pathname;
     }
 
-    std::string redirected_pathname (basepath);
+    path_builder redirected_pathname (buffer);
+    redirected_pathname.append (basepath);
 
-    if (redirected_pathname.back () == '/' && pathname.back () == '/') {
+    if (redirected_pathname.back () == '/' && pathname[strlen (pathname) - 1] == '/') {
         redirected_pathname.resize (redirected_pathname.size () - 1);
     }
 
-    redirected_pathname += pathname;
-    string_length_sanitize (redirected_pathname);
+    redirected_pathname.append (pathname);
 
-    return redirected_pathname;
+    return redirected_pathname.data ();
 }
 
-std::string
-redirect_path_full (std::string const& pathname, bool check_parent, bool only_if_absolute)
+const char *
+redirect_path_full (const char *original, redirect_buffer& buffer, bool check_parent, bool only_if_absolute,
+                    bool may_watch, speculation *spec)
 {
-    if (pathname.empty ()) {
-        return pathname;
+    if (original == NULL || original[0] == '\0') {
+        return original;
     }
 
     const std::string& preload_dir = saved_snapcraft_preload;
     if (preload_dir.empty()) {
-        return pathname;
+        return original;
     }
 
-    if (only_if_absolute && pathname[0] != '/') {
-        return pathname;
+    if (only_if_absolute && original[0] != '/') {
+        return original;
     }
 
-    // Some apps want to open shared memory in random locations. Here we will confine it to the
-    // snaps allowed path.
-    std::string redirected_pathname;
-
-    if (str_starts_with (pathname, DEFAULT_DEVSHM) && !str_starts_with (pathname, saved_snap_devshm) && !str_starts_with(pathname, saved_snap_sem)) {
-        std::string new_pathname = pathname.substr(DEFAULT_DEVSHM.size());
-        redirected_pathname = saved_snap_devshm + '.' + new_pathname;
-        string_length_sanitize (redirected_pathname);
-        return redirected_pathname;
+    size_t prefix_len;
+    const redirect_rule *matched = &saved_redirect_rules.match (original, prefix_len);
+    if (matched->action == ACTION_BYPASS) {
+        if (stats_enabled) {
+            bypassed_paths.fetch_add (1, std::memory_order_relaxed);
+        }
+        return original;
     }
 
-    if (saved_snapcraft_preload_redirect_only_shm) {
-      return pathname;
+    // Decide on the plain spelling, but hand out the original when it stays
+    redirect_buffer normalized;
+    const char *pathname = normalize_path (original, normalized.data, sizeof (normalized.data));
+    if (pathname != original) {
+        matched = &saved_redirect_rules.match (pathname, prefix_len);
     }
 
-    // And each app should have its own /var/lib writable tree.  Here, we want
-    // to support reading the base system's files if they exist, else let the app
-    // play in /var/lib themselves.  So we reverse the normal check: first see if
-    // it exists in root, else do our redirection.
-    if (pathname == DEFAULT_VARLIB || str_starts_with (pathname, DEFAULT_VARLIB + '/')) {
-        if (!saved_varlib.empty () && !str_starts_with (pathname, saved_varlib) && _access (pathname.c_str(), F_OK) != 0) {
-            return redirect_writable_path (pathname.data () + DEFAULT_VARLIB.size (), saved_varlib);
-        } else {
-            return pathname;
+    path_builder redirected_pathname (buffer);
+    const redirect_rule& rule = *matched;
+
+    switch (rule.action) {
+    case ACTION_PASSTHROUGH:
+        return original;
+
+    case ACTION_BYPASS:
+        if (stats_enabled) {
+            bypassed_paths.fetch_add (1, std::memory_order_relaxed);
+        }
+        return original;
+
+    case ACTION_REWRITE:
+        // Some apps want to open shared memory in random locations. Here we will confine it to the
+        // snaps allowed path.
+        redirected_pathname.append (rule.target);
+        redirected_pathname.append (pathname + prefix_len);
+        return redirected_pathname.data ();
+
+    case ACTION_WRITABLE:
+        // And each app should have its own /var/lib writable tree.  Here, we want
+        // to support reading the base system's files if they exist, else let the app
+        // play in /var/lib themselves.  So we reverse the normal check: first see if
+        // it exists in root, else do our redirection.
+        if (!str_starts_with (pathname, rule.target) && cached_access (pathname, may_watch) != 0) {
+            // The remainder may point into normalized, which goes away
+            const char *remainder = pathname + prefix_len;
+            return redirect_writable_path (remainder[0] != '\0' ? remainder : "", rule.target, buffer);
         }
+        return original;
+
+    case ACTION_PRELOAD:
+        break;
     }
 
-    redirected_pathname = preload_dir;
+    redirected_pathname.append (preload_dir);
     if (redirected_pathname.back () == '/') {
         redirected_pathname.resize(redirected_pathname.size ()-1);
     }
 
     if (pathname[0] != '/') {
-        std::string cwd;
-        cwd.reserve(PATH_MAX);
-        if (getcwd (const_cast<char*>(cwd.data ()), PATH_MAX) == NULL) {
-            return pathname;
+        size_t cwd_pos = redirected_pathname.size ();
+        if (cached_getcwd (redirected_pathname.data () + cwd_pos, redirected_pathname.capacity () - cwd_pos) == NULL) {
+            return original;
         }
 
-        redirected_pathname += cwd + '/';
+        redirected_pathname.resize (cwd_pos + strlen (redirected_pathname.data () + cwd_pos));
+        redirected_pathname.append ('/');
     }
 
-    redirected_pathname += pathname;
-    size_t slash_pos = std::string::npos;
+    redirected_pathname.append (pathname);
+    char *slash = NULL;
 
     if (check_parent) {
-        slash_pos = redirected_pathname.find_last_of ('/');
-        if (slash_pos != std::string::npos) { // should always be true
-            redirected_pathname[slash_pos] = 0;
+        slash = strrchr (redirected_pathname.data (), '/');
+        if (slash != NULL) { // should always be true
+            *slash = '\0';
         }
     }
 
-    int ret = _access (redirected_pathname.c_str (), F_OK);
+    int ret = spec != NULL ? speculative_access (redirected_pathname.data (), *spec)
+                           : cached_access (redirected_pathname.data (), may_watch);
 
-    if (check_parent && slash_pos != std::string::npos) {
-        redirected_pathname[slash_pos] = '/';
+    if (slash != NULL) {
+        *slash = '/';
     }
 
     if (ret == 0 || errno == ENOTDIR) { // ENOTDIR is OK because it exists at least
-        string_length_sanitize (redirected_pathname);
-        return redirected_pathname;
+        return redirected_pathname.data ();
     } else {
-        return pathname;
+        return original;
     }
 }
 
-inline std::string
-redirect_path (std::string const& pathname)
+inline const char *
+redirect_path (const char *pathname, redirect_buffer& buffer)
 {
-    return redirect_path_full (pathname, /*check_parent*/ false, /*only_if_absolute*/ false);
+    return redirect_path_full (pathname, buffer, /*check_parent*/ false, /*only_if_absolute*/ false, /*may_watch*/ true,
+                               /*spec*/ NULL);
 }
 
-inline std::string
-redirect_path_target (std::string const& pathname)
+// For the exec wrappers, which may run in a vfork child, see prepare_access
+inline const char *
+redirect_path_exec (const char *pathname, redirect_buffer& buffer)
 {
-    return redirect_path_full (pathname, /*check_parent*/ true, /*only_if_absolute*/ false);
+    return redirect_path_full (pathname, buffer, /*check_parent*/ false, /*only_if_absolute*/ false, /*may_watch*/ false,
+                               /*spec*/ NULL);
 }
 
-inline std::string
-redirect_path_if_absolute (std::string const& pathname)
+// Leaves the existence check to the call made on the result when it would
+// take a syscall, see speculative_access
+inline const char *
+redirect_path_speculative (const char *pathname, redirect_buffer& buffer, speculation *spec)
+{
+    return redirect_path_full (pathname, buffer, /*check_parent*/ false, /*only_if_absolute*/ false, /*may_watch*/ true,
+                               spec);
+}
+
+inline const char *
+redirect_path_target (const char *pathname, redirect_buffer& buffer)
+{
+    return redirect_path_full (pathname, buffer, /*check_parent*/ true, /*only_if_absolute*/ false, /*may_watch*/ true,
+                               /*spec*/ NULL);
+}
+
+inline const char *
+redirect_path_if_absolute (const char *pathname, redirect_buffer& buffer)
+{
+    return redirect_path_full (pathname, buffer, /*check_parent*/ false, /*only_if_absolute*/ true, /*may_watch*/ true,
+                               /*spec*/ NULL);
+}
+
+// Redirects a path given to an *at() call.  Relative paths are joined to the
+// path dirfd was opened for and handled as that absolute path, and passed on
+// unchanged when that isn't redirected or the descriptor isn't known.  spec is as for
+// redirect_path_speculative, or NULL.
+const char *
+redirect_path_at (int dirfd, const char *pathname, redirect_buffer& buffer, speculation *spec)
 {
-    return redirect_path_full (pathname, /*check_parent*/ false, /*only_if_absolute*/ true);
+    if (pathname == NULL || pathname[0] == '/' || dirfd == AT_FDCWD) {
+        return redirect_path_speculative (pathname, buffer, spec);
+    }
+
+    if (pathname[0] == '\0') {
+        return pathname;
+    }
+
+    redirect_buffer joined;
+    fd_identity identity;
+    size_t length = fd_table_copy (dirfd, joined.data, sizeof (joined.data), identity);
+    if (length == 0) {
+        return pathname;
+    }
+
+    if (joined.data[length - 1] != '/') {
+        joined.data[length++] = '/';
+    }
+
+    size_t pathname_length = strlen (pathname);
+    if (length + pathname_length > PATH_MAX) {
+        return pathname;
+    }
+    memcpy (joined.data + length, pathname, pathname_length + 1);
+
+    // The descriptor itself may point into the snap, so resolve the path the
+    // same way as its absolute form would be.  A path that stays is passed on
+    // relative to the descriptor, which keeps following the directory wherever
+    // it's moved.
+    const char *redirected = redirect_path_speculative (joined.data, buffer, spec);
+    if (redirected == joined.data) {
+        return pathname;
+    }
+
+    // Only trust the recorded path once it matters
+    if (!fd_table_current (dirfd, identity)) {
+        if (spec != NULL) {
+            spec->pending = false;
+        }
+        return pathname;
+    }
+    return redirected;
 }
 
-// helper class
-template<typename R, template<typename...> class Params, typename... Args, std::size_t... I>
-inline R call_helper(std::function<R(Args...)> const&func, Params<Args...> const&params, std::index_sequence<I...>)
+// Value returned by a wrapper when the next symbol doesn't exist
+template<typename R>
+inline typename std::enable_if<std::is_pointer<R>::value, R>::type
+failed_result ()
 {
-    return func (std::get<I>(params)...);
+    return nullptr;
 }
 
-template<typename R, template<typename...> class Params, typename... Args>
-inline R call_with_tuple_args(std::function<R(Args...)> const&func, Params<Args...> const&params)
+template<typename R>
+inline typename std::enable_if<!std::is_pointer<R>::value, R>::type
+failed_result ()
 {
-    return call_helper (func, params, std::index_sequence_for<Args...>{});
+    return -1;
 }
 
+// spec is only passed for SPECULATIVE types, and ignored by those which can't
+// speculate
 struct NORMAL_REDIRECT {
-    static inline std::string redirect (const std::string& path) { return redirect_path (path); }
+    static constexpr bool mutates = false;
+    static constexpr bool speculates = false;
+    static inline const char *redirect (int, const char *path, redirect_buffer& buffer, speculation *spec) { return redirect_path_speculative (path, buffer, spec); }
 };
 
 struct ABSOLUTE_REDIRECT {
-    static inline std::string redirect (const std::string& path) { return redirect_path_if_absolute (path); }
+    static constexpr bool mutates = false;
+    static constexpr bool speculates = false;
+    static inline const char *redirect (int, const char *path, redirect_buffer& buffer, speculation *) { return redirect_path_if_absolute (path, buffer); }
 };
 
 struct TARGET_REDIRECT {
-    static inline std::string redirect (const std::string& path) { return redirect_path_target (path); }
+    static constexpr bool mutates = false;
+    static constexpr bool speculates = false;
+    static inline const char *redirect (int, const char *path, redirect_buffer& buffer, speculation *) { return redirect_path_target (path, buffer); }
 };
 
-template<typename R, const char *FUNC_NAME, typename REDIRECT_PATH_TYPE, size_t PATH_IDX, typename... Ts>
-inline R
-redirect_n(Ts... as)
+// Relative paths are looked up against the directory descriptor's path
+struct AT_REDIRECT {
+    static constexpr bool mutates = false;
+    static constexpr bool speculates = false;
+    static inline const char *redirect (int dirfd, const char *path, redirect_buffer& buffer, speculation *spec) { return redirect_path_at (dirfd, path, buffer, spec); }
+};
+
+// Calls that may create or remove the path, making cached existence stale
+template<typename REDIRECT_PATH_TYPE>
+struct MUTATING : REDIRECT_PATH_TYPE {
+    static constexpr bool mutates = true;
+};
+
+// Calls following symbolic links that succeed exactly when the path exists,
+// so the redirected path is tried straight away and the original one only if
+// it fails with ENOENT, see speculative_access.  Not for calls that create
+// the path, or look at a symbolic link itself.
+template<typename REDIRECT_PATH_TYPE>
+struct SPECULATIVE : REDIRECT_PATH_TYPE {
+    static constexpr bool speculates = true;
+};
+
+// Redirects path and hands it to call along with the next FN symbol.  call is
+// the wrapper's lambda forwarding the remaining arguments, so everything is
+// inlined into the wrapper.
+template<typename FN, symbol_id ID, typename REDIRECT_PATH_TYPE, typename CALL>
+inline auto
+redirect_call (int dirfd, const char *path, CALL call) -> decltype (call (FN (), path))
 {
-    std::tuple<Ts...> tpl(as...);
-    const char *path = std::get<PATH_IDX>(tpl);
-    static std::function<R(Ts...)> func (reinterpret_cast<R(*)(Ts...)> (dlsym (RTLD_NEXT, FUNC_NAME)));
+    using R = decltype (call (FN (), path));
+    FN next = next_symbol<FN> (ID);
+
+    if (next == NULL) {
+        errno = ENOSYS;
+        return failed_result<R> ();
+    }
 
-    if (path != NULL) {
-        std::string const& new_path = REDIRECT_PATH_TYPE::redirect (path);
-        std::get<PATH_IDX>(tpl) = new_path.c_str ();
-        R result = call_with_tuple_args (func, tpl);
-        std::get<PATH_IDX>(tpl) = path;
-        return result;
+    latency_timer timer (ID);
+    if (path == NULL) {
+        timer.decided ();
+        return call (next, path);
     }
 
-    return func (std::forward<Ts>(as)...);
+    redirect_buffer buffer;
+    speculation spec;
+    spec.pending = false;
+    const char *redirected = REDIRECT_PATH_TYPE::redirect (dirfd, path, buffer,
+        REDIRECT_PATH_TYPE::speculates && speculation_enabled ? &spec : NULL);
+    timer.decided ();
+    uint64_t hotpath = hotpath_start ();
+    R result = call (next, redirected);
+    if (spec.pending && speculation_missed (redirected, spec, result == failed_result<R> () ? errno : 0)) {
+        redirected = path;
+        result = call (next, redirected);
+    }
+    trace_redirect (ID, path, redirected, result == failed_result<R> ());
+    metrics_record (ID, path, redirected, result == failed_result<R> ());
+    if (__builtin_expect (hotpath != 0, 0)) {
+        hotpath_record (path, redirected, hotpath);
+    }
+    if (REDIRECT_PATH_TYPE::mutates) {
+        existence_cache_invalidate ();
+    }
+    return result;
 }
 
-template<typename R, const char *FUNC_NAME, typename REDIRECT_PATH_TYPE, typename REDIRECT_TARGET_TYPE, typename... Ts>
+template<typename R, symbol_id ID, typename REDIRECT_PATH_TYPE, typename REDIRECT_TARGET_TYPE>
 inline R
-redirect_target(const char *path, const char *target, Ts... as)
+redirect_target(const char *path, const char *target)
 {
-    std::string const& new_target = REDIRECT_PATH_TYPE::redirect (target ? target : "");
-    return redirect_n<R, FUNC_NAME, REDIRECT_PATH_TYPE, 0, const char*, const char*, Ts...> (path, new_target.c_str ());
+    using next_t = R (*) (const char *, const char *);
+    redirect_buffer buffer;
+    const char *new_target = REDIRECT_PATH_TYPE::redirect (AT_FDCWD, target ? target : "", buffer, NULL);
+    return redirect_call<next_t, ID, MUTATING<REDIRECT_PATH_TYPE>> (AT_FDCWD, path,
+        [new_target] (next_t next, const char *p) { return next (p, new_target); });
 }
 
-struct va_separator {};
-template<typename R, const char *FUNC_NAME, typename REDIRECT_PATH_TYPE, size_t PATH_IDX, typename... Ts>
-inline R
-redirect_open(Ts... as, va_separator, va_list va)
+inline mode_t
+open_mode (int flags, va_list va)
 {
-    mode_t mode = 0;
-    int flags = std::get<PATH_IDX+1>(std::tuple<Ts...>(as...));
+#ifdef __OPEN_NEEDS_MODE
+    return __OPEN_NEEDS_MODE (flags) ? va_arg (va, mode_t) : 0;
+#else
+    return (flags & (O_CREAT|O_TMPFILE)) ? va_arg (va, mode_t) : 0;
+#endif
+}
 
-    if (flags & (O_CREAT|O_TMPFILE)) {
-        mode = va_arg (va, mode_t);
+template<typename FN, symbol_id ID, typename REDIRECT_PATH_TYPE, typename CALL>
+inline int
+redirect_open(int dirfd, const char *path, int flags, CALL call)
+{
+    int fd;
+    if (flags & O_CREAT) {
+        fd = redirect_call<FN, ID, MUTATING<REDIRECT_PATH_TYPE>> (dirfd, path, call);
+    } else if (!(flags & O_NOFOLLOW)) {
+        fd = redirect_call<FN, ID, SPECULATIVE<REDIRECT_PATH_TYPE>> (dirfd, path, call);
+    } else {
+        fd = redirect_call<FN, ID, REDIRECT_PATH_TYPE> (dirfd, path, call);
     }
 
-    return redirect_n<R, FUNC_NAME, REDIRECT_PATH_TYPE, PATH_IDX, Ts..., mode_t>(as..., mode);
+    if (fd >= 0) {
+        // Writing or creating fails on directories, O_TMPFILE includes
+        // O_DIRECTORY but never opens one
+        bool maybe_directory = (flags & O_PATH) ||
+                               ((flags & O_ACCMODE) == O_RDONLY && !(flags & O_CREAT) && (flags & O_TMPFILE) != O_TMPFILE);
+        fd_table_opened (fd, dirfd, path, maybe_directory);
+    }
+    return fd;
 }
 
 } // unnamed namespace
@@ -348,21 +3925,24 @@ redirect_open(Ts... as, va_separator, va_list va)
 extern "C"
 {
 #define ARG(A) , A
-#define REDIRECT_NAME(NAME) _ ## NAME ## _preload
-#define DECLARE_REDIRECT(NAME) \
-constexpr const char REDIRECT_NAME(NAME)[] = #NAME;
 
 #define REDIRECT_1(RET, NAME, REDIR_TYPE, SIG, ARGS) \
-DECLARE_REDIRECT(NAME) \
-RET NAME (const char *path SIG) { return redirect_n<RET, REDIRECT_NAME(NAME), REDIR_TYPE, 0>(path ARGS); }
+RET NAME (const char *path SIG) { \
+    using next_t = RET (*) (const char * SIG); \
+    return redirect_call<next_t, SYMBOL_ ## NAME, REDIR_TYPE> (AT_FDCWD, path, [&] (next_t next, const char *p) { return next (p ARGS); }); \
+}
 
-#define REDIRECT_2(RET, NAME, REDIR_TYPE, T1, SIG, ARGS) \
-DECLARE_REDIRECT(NAME) \
-RET NAME (T1 a1, const char *path SIG) { return redirect_n<RET, REDIRECT_NAME(NAME), REDIR_TYPE, 1>(a1, path ARGS); }
+#define REDIRECT_2(RET, NAME, REDIR_TYPE, DIRFD, T1, SIG, ARGS) \
+RET NAME (T1 a1, const char *path SIG) { \
+    using next_t = RET (*) (T1, const char * SIG); \
+    return redirect_call<next_t, SYMBOL_ ## NAME, REDIR_TYPE> (DIRFD, path, [&] (next_t next, const char *p) { return next (a1, p ARGS); }); \
+}
 
-#define REDIRECT_3(RET, NAME, REDIR_TYPE, T1, T2, SIG, ARGS) \
-DECLARE_REDIRECT(NAME) \
-RET NAME (T1 a1, T2 a2, const char *path SIG) { return redirect_n<RET, REDIRECT_NAME(NAME), REDIR_TYPE, 2>(a1, a2, path ARGS); }
+#define REDIRECT_3(RET, NAME, REDIR_TYPE, DIRFD, T1, T2, SIG, ARGS) \
+RET NAME (T1 a1, T2 a2, const char *path SIG) { \
+    using next_t = RET (*) (T1, T2, const char * SIG); \
+    return redirect_call<next_t, SYMBOL_ ## NAME, REDIR_TYPE> (DIRFD, path, [&] (next_t next, const char *p) { return next (a1, a2, p ARGS); }); \
+}
 
 #define REDIRECT_1_1(RET, NAME) \
 REDIRECT_1(RET, NAME, NORMAL_REDIRECT, ,)
@@ -370,7 +3950,19 @@ REDIRECT_1(RET, NAME, NORMAL_REDIRECT, ,)
 #define REDIRECT_1_2(RET, NAME, T2) \
 REDIRECT_1(RET, NAME, NORMAL_REDIRECT, ARG(T2 a2), ARG(a2))
 
-#define REDIRECT_1_2_AT(RET, NAME, T2) \
+#define REDIRECT_1_1_MUTATING(RET, NAME) \
+REDIRECT_1(RET, NAME, MUTATING<NORMAL_REDIRECT>, ,)
+
+#define REDIRECT_1_2_MUTATING(RET, NAME, T2) \
+REDIRECT_1(RET, NAME, MUTATING<NORMAL_REDIRECT>, ARG(T2 a2), ARG(a2))
+
+#define REDIRECT_1_3_MUTATING(RET, NAME, T2, T3) \
+REDIRECT_1(RET, NAME, MUTATING<NORMAL_REDIRECT>, ARG(T2 a2) ARG(T3 a3), ARG(a2) ARG(a3))
+
+#define REDIRECT_1_2_SPECULATIVE(RET, NAME, T2) \
+REDIRECT_1(RET, NAME, SPECULATIVE<NORMAL_REDIRECT>, ARG(T2 a2), ARG(a2))
+
+#define REDIRECT_1_2_ABSOLUTE(RET, NAME, T2) \
 REDIRECT_1(RET, NAME, ABSOLUTE_REDIRECT, ARG(T2 a2), ARG(a2))
 
 #define REDIRECT_1_3(RET, NAME, T2, T3) \
@@ -380,71 +3972,85 @@ REDIRECT_1(RET, NAME, NORMAL_REDIRECT, ARG(T2 a2) ARG(T3 a3), ARG(a2) ARG(a3))
 REDIRECT_1(RET, NAME, NORMAL_REDIRECT, ARG(T2 a2) ARG(T3 a3) ARG(T4 a4), ARG(a2) ARG(a3) ARG(a4))
 
 #define REDIRECT_2_2(RET, NAME, T1) \
-REDIRECT_2(RET, NAME, NORMAL_REDIRECT, T1, ,)
+REDIRECT_2(RET, NAME, NORMAL_REDIRECT, AT_FDCWD, T1, ,)
 
 #define REDIRECT_2_3(RET, NAME, T1, T3) \
-REDIRECT_2(RET, NAME, NORMAL_REDIRECT, T1, ARG(T3 a3), ARG(a3))
+REDIRECT_2(RET, NAME, NORMAL_REDIRECT, AT_FDCWD, T1, ARG(T3 a3), ARG(a3))
+
+#define REDIRECT_2_3_SPECULATIVE(RET, NAME, T1, T3) \
+REDIRECT_2(RET, NAME, SPECULATIVE<NORMAL_REDIRECT>, AT_FDCWD, T1, ARG(T3 a3), ARG(a3))
 
 #define REDIRECT_2_3_AT(RET, NAME, T1, T3) \
-REDIRECT_2(RET, NAME, ABSOLUTE_REDIRECT, T1, ARG(T3 a3), ARG(a3))
+REDIRECT_2(RET, NAME, AT_REDIRECT, a1, T1, ARG(T3 a3), ARG(a3))
+
+#define REDIRECT_2_3_AT_MUTATING(RET, NAME, T1, T3) \
+REDIRECT_2(RET, NAME, MUTATING<AT_REDIRECT>, a1, T1, ARG(T3 a3), ARG(a3))
 
 #define REDIRECT_2_4_AT(RET, NAME, T1, T3, T4) \
-REDIRECT_2(RET, NAME, ABSOLUTE_REDIRECT, T1, ARG(T3 a3) ARG(T4 a4), ARG(a3) ARG(a4))
+REDIRECT_2(RET, NAME, AT_REDIRECT, a1, T1, ARG(T3 a3) ARG(T4 a4), ARG(a3) ARG(a4))
 
 #define REDIRECT_2_5_AT(RET, NAME, T1, T3, T4, T5) \
-REDIRECT_2(RET, NAME, ABSOLUTE_REDIRECT, T1, ARG(T3 a3) ARG(T4 a4) ARG(T5 a5), ARG(a3) ARG(a4) ARG(a5))
+REDIRECT_2(RET, NAME, AT_REDIRECT, a1, T1, ARG(T3 a3) ARG(T4 a4) ARG(T5 a5), ARG(a3) ARG(a4) ARG(a5))
+
+#define REDIRECT_2_4_AT_STAT(RET, NAME, T3, T4) \
+REDIRECT_2(RET, NAME, AT_REDIRECT, a1, int, ARG(T3 a3) ARG(T4 a4), ARG(a3) ARG(a4))
 
-#define REDIRECT_3_5(RET, NAME, T1, T2, T4, T5) \
-REDIRECT_3(RET, NAME, NORMAL_REDIRECT, T1, T2, ARG(T4 a4) ARG(T5 a5), ARG(a4) ARG(a5))
+#define REDIRECT_3_5_AT(RET, NAME, T1, T2, T4, T5) \
+REDIRECT_3(RET, NAME, AT_REDIRECT, a2, T1, T2, ARG(T4 a4) ARG(T5 a5), ARG(a4) ARG(a5))
 
 #define REDIRECT_TARGET(RET, NAME) \
-DECLARE_REDIRECT(NAME) \
-RET NAME (const char *path, const char *target) { return redirect_target<RET, REDIRECT_NAME(NAME), NORMAL_REDIRECT, TARGET_REDIRECT>(path, target); }
+RET NAME (const char *path, const char *target) { return redirect_target<RET, SYMBOL_ ## NAME, NORMAL_REDIRECT, TARGET_REDIRECT>(path, target); }
 
 #define REDIRECT_OPEN(NAME) \
-DECLARE_REDIRECT(NAME) \
-int NAME (const char *path, int flags, ...) { va_list va; va_start(va, flags); int ret = redirect_open<int, REDIRECT_NAME(NAME), NORMAL_REDIRECT, 0, const char *, int>(path, flags, va_separator(), va); va_end(va); return ret; }
+int NAME (const char *path, int flags, ...) { \
+    using next_t = int (*) (const char *, int, ...); \
+    va_list va; va_start (va, flags); mode_t mode = open_mode (flags, va); va_end (va); \
+    return redirect_open<next_t, SYMBOL_ ## NAME, NORMAL_REDIRECT> (AT_FDCWD, path, flags, [&] (next_t next, const char *p) { return next (p, flags, mode); }); \
+}
 
 #define REDIRECT_OPEN_AT(NAME) \
-DECLARE_REDIRECT(NAME) \
-int NAME (int dirfp, const char *path, int flags, ...) { va_list va; va_start(va, flags); int ret = redirect_open<int, REDIRECT_NAME(NAME), ABSOLUTE_REDIRECT, 1, int, const char *, int>(dirfp, path, flags, va_separator(), va); va_end(va); return ret; }
+int NAME (int dirfp, const char *path, int flags, ...) { \
+    using next_t = int (*) (int, const char *, int, ...); \
+    va_list va; va_start (va, flags); mode_t mode = open_mode (flags, va); va_end (va); \
+    return redirect_open<next_t, SYMBOL_ ## NAME, AT_REDIRECT> (dirfp, path, flags, [&] (next_t next, const char *p) { return next (dirfp, p, flags, mode); }); \
+}
 
 REDIRECT_1_2(FILE *, fopen, const char *)
-REDIRECT_1_1(int, unlink)
-REDIRECT_2_3_AT(int, unlinkat, int, int)
-REDIRECT_1_2(int, access, int)
-REDIRECT_1_2(int, eaccess, int)
-REDIRECT_1_2(int, euidaccess, int)
+REDIRECT_1_1_MUTATING(int, unlink)
+REDIRECT_2_3_AT_MUTATING(int, unlinkat, int, int)
+REDIRECT_1_2_SPECULATIVE(int, access, int)
+REDIRECT_1_2_SPECULATIVE(int, eaccess, int)
+REDIRECT_1_2_SPECULATIVE(int, euidaccess, int)
 REDIRECT_2_4_AT(int, faccessat, int, int, int)
-REDIRECT_1_2(int, stat, struct stat *)
-REDIRECT_1_2(int, stat64, struct stat64 *)
+REDIRECT_1_2_SPECULATIVE(int, stat, struct stat *)
+REDIRECT_1_2_SPECULATIVE(int, stat64, struct stat64 *)
 REDIRECT_1_2(int, lstat, struct stat *)
 REDIRECT_1_2(int, lstat64, struct stat64 *)
-REDIRECT_1_2(int, creat, mode_t)
-REDIRECT_1_2(int, creat64, mode_t)
+REDIRECT_1_2_MUTATING(int, creat, mode_t)
+REDIRECT_1_2_MUTATING(int, creat64, mode_t)
 REDIRECT_1_2(int, truncate, off_t)
 REDIRECT_2_2(char *, bindtextdomain, const char *)
-REDIRECT_2_3(int, xstat, int, struct stat *)
-REDIRECT_2_3(int, __xstat, int, struct stat *)
-REDIRECT_2_3(int, __xstat64, int, struct stat64 *)
+REDIRECT_2_3_SPECULATIVE(int, xstat, int, struct stat *)
+REDIRECT_2_3_SPECULATIVE(int, __xstat, int, struct stat *)
+REDIRECT_2_3_SPECULATIVE(int, __xstat64, int, struct stat64 *)
 REDIRECT_2_3(int, __lxstat, int, struct stat *)
 REDIRECT_2_3(int, __lxstat64, int, struct stat64 *)
-REDIRECT_3_5(int, __fxstatat, int, int, struct stat *, int)
-REDIRECT_3_5(int, __fxstatat64, int, int, struct stat64 *, int)
-REDIRECT_1_2(int, statfs, struct statfs *)
-REDIRECT_1_2(int, statfs64, struct statfs64 *)
-REDIRECT_1_2(int, statvfs, struct statvfs *)
-REDIRECT_1_2(int, statvfs64, struct statvfs64 *)
+REDIRECT_3_5_AT(int, __fxstatat, int, int, struct stat *, int)
+REDIRECT_3_5_AT(int, __fxstatat64, int, int, struct stat64 *, int)
+REDIRECT_2_4_AT_STAT(int, fstatat, struct stat *, int)
+REDIRECT_2_4_AT_STAT(int, fstatat64, struct stat64 *, int)
+REDIRECT_1_2_SPECULATIVE(int, statfs, struct statfs *)
+REDIRECT_1_2_SPECULATIVE(int, statfs64, struct statfs64 *)
+REDIRECT_1_2_SPECULATIVE(int, statvfs, struct statvfs *)
+REDIRECT_1_2_SPECULATIVE(int, statvfs64, struct statvfs64 *)
 REDIRECT_1_2(long, pathconf, int)
-REDIRECT_1_3(int, mknod, mode_t, dev_t)
-REDIRECT_1_1(DIR *, opendir)
-REDIRECT_1_2(int, mkdir, mode_t)
-REDIRECT_1_1(int, rmdir)
+REDIRECT_1_3_MUTATING(int, mknod, mode_t, dev_t)
+REDIRECT_1_2_MUTATING(int, mkdir, mode_t)
+REDIRECT_1_1_MUTATING(int, rmdir)
 REDIRECT_1_3(int, chown, uid_t, gid_t)
 REDIRECT_1_3(int, lchown, uid_t, gid_t)
 REDIRECT_1_2(int, chmod, mode_t)
 REDIRECT_1_2(int, lchmod, mode_t)
-REDIRECT_1_1(int, chdir)
 REDIRECT_1_3(ssize_t, readlink, char *, size_t)
 REDIRECT_1_2(char *, realpath, char *)
 REDIRECT_TARGET(int, link)
@@ -459,168 +4065,771 @@ REDIRECT_1_4(int, scandir64, struct dirent64 ***, filter_function_t<struct diren
 REDIRECT_2_5_AT(int, scandirat, int, struct dirent ***, filter_function_t<struct dirent>, compar_function_t<struct dirent>);
 REDIRECT_2_5_AT(int, scandirat64, int, struct dirent64 ***, filter_function_t<struct dirent64>, compar_function_t<struct dirent64>);
 
-// non-absolute library paths aren't simply relative paths, they need
-// a whole lookup algorithm
-REDIRECT_1_2_AT(void *, dlopen, int);
+// non-absolute library paths aren't simply relative paths, they need
+// a whole lookup algorithm
+REDIRECT_1_2_ABSOLUTE(void *, dlopen, int);
+}
+
+// chdir and fchdir keep the working directory cache up to date
+extern "C" int
+chdir (const char *path)
+{
+    using next_t = int (*) (const char *);
+
+    pthread_mutex_lock (&cwd_mutex);
+    int result = redirect_call<next_t, SYMBOL_chdir, NORMAL_REDIRECT> (AT_FDCWD, path,
+        [] (next_t next, const char *p) { return next (p); });
+    int saved_errno = errno;
+    if (result == 0) {
+        cwd_cache_refresh ();
+    }
+    pthread_mutex_unlock (&cwd_mutex);
+
+    errno = saved_errno;
+    return result;
+}
+
+extern "C" int
+fchdir (int fd)
+{
+    auto _fchdir = next_symbol<int (*) (int)> (SYMBOL_fchdir);
+
+    pthread_mutex_lock (&cwd_mutex);
+    int result = _fchdir (fd);
+    int saved_errno = errno;
+    if (result == 0) {
+        cwd_cache_refresh ();
+    }
+    pthread_mutex_unlock (&cwd_mutex);
+
+    errno = saved_errno;
+    return result;
+}
+
+// closedir is declared nonnull, so the check for apps passing NULL anyway
+// is kept out of its sight.  NULL goes on to glibc, which fails with EINVAL.
+static __attribute__ ((noinline)) void
+closedir_forget (void *dir)
+{
+    if (dir != NULL) {
+        fd_table_forget (dirfd (static_cast<DIR *> (dir)));
+    }
+}
+
+// Directory descriptors are tracked for the *at() calls
+extern "C" DIR *
+opendir (const char *path)
+{
+    using next_t = DIR *(*) (const char *);
+
+    DIR *dir = redirect_call<next_t, SYMBOL_opendir, SPECULATIVE<NORMAL_REDIRECT>> (AT_FDCWD, path,
+        [] (next_t next, const char *p) { return next (p); });
+    if (dir != NULL) {
+        int saved_errno = errno;
+        fd_table_opened (dirfd (dir), AT_FDCWD, path, true);
+        errno = saved_errno;
+    }
+
+    return dir;
+}
+
+extern "C" int
+closedir (DIR *dir)
+{
+    closedir_forget (dir);
+    return next_symbol<int (*) (DIR *)> (SYMBOL_closedir) (dir);
+}
+
+extern "C" int
+close (int fd)
+{
+    fd_table_forget (fd);
+    return next_symbol<int (*) (int)> (SYMBOL_close) (fd);
+}
+
+extern "C" int
+dup (int oldfd)
+{
+    int newfd = next_symbol<int (*) (int)> (SYMBOL_dup) (oldfd);
+    if (newfd >= 0) {
+        fd_table_duplicate (oldfd, newfd);
+    }
+
+    return newfd;
+}
+
+extern "C" int
+dup2 (int oldfd, int newfd)
+{
+    int result = next_symbol<int (*) (int, int)> (SYMBOL_dup2) (oldfd, newfd);
+    if (result >= 0) {
+        fd_table_duplicate (oldfd, result);
+    }
+
+    return result;
+}
+
+extern "C" int
+dup3 (int oldfd, int newfd, int flags)
+{
+    int result = next_symbol<int (*) (int, int, int)> (SYMBOL_dup3) (oldfd, newfd, flags);
+    if (result >= 0) {
+        fd_table_duplicate (oldfd, result);
+    }
+
+    return result;
+}
+
+// Unix socket addresses
+//
+// bind, connect and the send calls redirect the path of unix socket addresses.
+// Datagram senders may name their destination on every message, so the
+// redirected path of absolute addresses whose redirection depends on nothing
+// but the path is remembered in a small direct mapped cache, read under a
+// seqlock.  Redirected addresses are built on the stack.
+#define SOCKET_PATH_UNCHANGED UINT32_MAX
+
+struct socket_cache_slot
+{
+    // Odd while a writer is updating the slot
+    std::atomic<uint32_t> sequence;
+    // Of the redirected path, SOCKET_PATH_UNCHANGED if it isn't redirected
+    std::atomic<uint32_t> length;
+    std::atomic<uint64_t> key_lo;
+    std::atomic<uint64_t> key_hi;
+    char path[sizeof (((struct sockaddr_un *) 0)->sun_path)];
+};
+
+socket_cache_slot socket_cache[SOCKET_CACHE_SLOTS];
+
+// A unix socket address and where it goes
+struct socket_address
+{
+    // The address' path, empty for other addresses and abstract sockets
+    char path[sizeof (((struct sockaddr_un *) 0)->sun_path) + 1];
+    struct sockaddr_un redirected;
+};
+
+bool
+socket_cache_lookup (path_key const& key, char *path, uint32_t& length)
+{
+    socket_cache_slot& slot = socket_cache[key.lo % SOCKET_CACHE_SLOTS];
+    uint32_t sequence = slot.sequence.load (std::memory_order_acquire);
+    if ((sequence & 1) || sequence == 0) {
+        return false;
+    }
+
+    uint64_t lo = slot.key_lo.load (std::memory_order_relaxed);
+    uint64_t hi = slot.key_hi.load (std::memory_order_relaxed);
+    length = slot.length.load (std::memory_order_relaxed);
+    if (lo != key.lo || hi != key.hi) {
+        return false;
+    }
+    if (length != SOCKET_PATH_UNCHANGED) {
+        memcpy (path, slot.path, MIN ((size_t) length + 1, sizeof (slot.path)));
+    }
+    std::atomic_thread_fence (std::memory_order_acquire);
+
+    return slot.sequence.load (std::memory_order_relaxed) == sequence;
+}
+
+void
+socket_cache_insert (path_key const& key, const char *path, uint32_t length)
+{
+    socket_cache_slot& slot = socket_cache[key.lo % SOCKET_CACHE_SLOTS];
+
+    // Another writer owns the slot, just skip caching this path
+    uint32_t sequence = slot.sequence.load (std::memory_order_relaxed);
+    if ((sequence & 1) || !slot.sequence.compare_exchange_strong (sequence, sequence + 1, std::memory_order_relaxed)) {
+        return;
+    }
+    std::atomic_thread_fence (std::memory_order_release);
+
+    slot.key_lo.store (key.lo, std::memory_order_relaxed);
+    slot.key_hi.store (key.hi, std::memory_order_relaxed);
+    slot.length.store (length, std::memory_order_relaxed);
+    if (length != SOCKET_PATH_UNCHANGED) {
+        memcpy (slot.path, path, length + 1);
+    }
+    slot.sequence.store (sequence + 2, std::memory_order_release);
+}
+
+// Whether the redirection of an absolute path never changes, i.e. doesn't
+// depend on files that may come and go
+bool
+redirect_is_permanent (const char *path)
+{
+    char normalized[sizeof (((struct sockaddr_un *) 0)->sun_path) + 1];
+    const char *pathname = normalize_path (path, normalized, sizeof (normalized));
+    size_t prefix_len;
+
+    switch (saved_redirect_rules.match (pathname, prefix_len).action) {
+    case ACTION_PASSTHROUGH:
+    case ACTION_BYPASS:
+    case ACTION_REWRITE:
+        return true;
+    case ACTION_PRELOAD:
+        return saved_snapcraft_preload_permanent;
+    case ACTION_WRITABLE:
+        break;
+    }
+    return false;
+}
+
+// Returns addr when it isn't redirected, else the redirected copy in
+// address, updating addrlen to match, or NULL with errno set when the
+// redirected path doesn't fit.
+const struct sockaddr *
+redirect_socket_address (const struct sockaddr *addr, socklen_t& addrlen, socket_address& address)
+{
+    address.path[0] = '\0';
+    if (addr == NULL || addrlen <= offsetof (struct sockaddr_un, sun_path) || addr->sa_family != AF_UNIX) {
+        return addr;
+    }
+
+    // sun_path doesn't need to be null terminated
+    const struct sockaddr_un *un_addr = (const struct sockaddr_un *) addr;
+    size_t sun_path_len = MIN (addrlen - offsetof (struct sockaddr_un, sun_path), sizeof (un_addr->sun_path));
+    memcpy (address.path, un_addr->sun_path, sun_path_len);
+    address.path[sun_path_len] = '\0';
+    if (address.path[0] == '\0') {
+        // Abstract sockets
+        return addr;
+    }
+
+    bool cacheable = address.path[0] == '/';
+    path_key key = cacheable ? hash_path (address.path, strlen (address.path)) : path_key ();
+    uint32_t length;
+
+    if (!cacheable || !socket_cache_lookup (key, address.redirected.sun_path, length)) {
+        redirect_buffer buffer;
+        const char *new_path = redirect_path (address.path, buffer);
+        length = new_path == address.path ? SOCKET_PATH_UNCHANGED : strlen (new_path);
+
+        if (length != SOCKET_PATH_UNCHANGED) {
+            if (length >= sizeof (address.redirected.sun_path)) {
+                errno = ENAMETOOLONG;
+                return NULL;
+            }
+            memcpy (address.redirected.sun_path, new_path, length + 1);
+        }
+
+        if (cacheable && redirect_is_permanent (address.path)) {
+            socket_cache_insert (key, address.redirected.sun_path, length);
+        }
+    }
+
+    if (length == SOCKET_PATH_UNCHANGED) {
+        return addr;
+    }
+
+    address.redirected.sun_family = AF_UNIX;
+    addrlen = offsetof (struct sockaddr_un, sun_path) + length + 1;
+    return (const struct sockaddr *) &address.redirected;
+}
+
+inline void
+socket_address_done (symbol_id id, socket_address const& address, bool redirected, bool failed, uint64_t hotpath)
+{
+    if (address.path[0] == '\0') {
+        return;
+    }
+
+    const char *new_path = redirected ? address.redirected.sun_path : address.path;
+    trace_redirect (id, address.path, new_path, failed);
+    metrics_record (id, address.path, new_path, failed);
+    if (__builtin_expect (hotpath != 0, 0)) {
+        hotpath_record (address.path, new_path, hotpath);
+    }
 }
 
 static int
-socket_action (socket_action_t action, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+socket_action (symbol_id id, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 {
-    const struct sockaddr_un *un_addr = (const struct sockaddr_un *)addr;
+    socket_action_t action = next_symbol<socket_action_t> (id);
+    latency_timer timer (id);
 
-    if (addr->sa_family != AF_UNIX) {
-        // Non-unix sockets
-        return action (sockfd, addr, addrlen);
+    socket_address address;
+    const struct sockaddr *new_addr = redirect_socket_address (addr, addrlen, address);
+    if (new_addr == NULL) {
+        return -1;
     }
 
-    if (!un_addr->sun_path || un_addr->sun_path[0] == '\0') {
-        // Abstract sockets
-        return action (sockfd, addr, addrlen);
-    }
+    timer.decided ();
+    uint64_t hotpath = address.path[0] ? hotpath_start () : 0;
+    int result = action (sockfd, new_addr, addrlen);
+    socket_address_done (id, address, new_addr != addr, result != 0, hotpath);
+    return result;
+}
 
-    int result = 0;
-    std::string const& new_path = redirect_path (un_addr->sun_path);
+extern "C" int
+bind (int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    return socket_action (SYMBOL_bind, sockfd, addr, addrlen);
+}
 
-    if (new_path.compare (0, PATH_MAX, un_addr->sun_path) == 0) {
-        result = action (sockfd, addr, addrlen);
-    } else {
-        struct sockaddr_un new_addr = {0};
-        strncpy (new_addr.sun_path, new_path.c_str (), new_path.size ());
-        new_addr.sun_path[new_path.size ()] = '\0';
-        result = action (sockfd, (const struct sockaddr *) &new_addr, sizeof (new_addr));
+extern "C" int
+connect (int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    return socket_action (SYMBOL_connect, sockfd, addr, addrlen);
+}
+
+extern "C" ssize_t
+sendto (int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addrlen)
+{
+    using sendto_t = ssize_t (*) (int, const void *, size_t, int, const struct sockaddr *, socklen_t);
+    sendto_t next = next_symbol<sendto_t> (SYMBOL_sendto);
+    latency_timer timer (SYMBOL_sendto);
+
+    socket_address address;
+    const struct sockaddr *new_addr = redirect_socket_address (addr, addrlen, address);
+    if (new_addr == NULL) {
+        return -1;
     }
 
+    timer.decided ();
+    uint64_t hotpath = address.path[0] ? hotpath_start () : 0;
+    ssize_t result = next (sockfd, buf, len, flags, new_addr, addrlen);
+    socket_address_done (SYMBOL_sendto, address, new_addr != addr, result < 0, hotpath);
     return result;
 }
 
-extern "C" int
-bind (int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+extern "C" ssize_t
+sendmsg (int sockfd, const struct msghdr *msg, int flags)
 {
-    static socket_action_t _bind =
-        (decltype(_bind)) dlsym (RTLD_NEXT, "bind");
+    using sendmsg_t = ssize_t (*) (int, const struct msghdr *, int);
+    sendmsg_t next = next_symbol<sendmsg_t> (SYMBOL_sendmsg);
+    latency_timer timer (SYMBOL_sendmsg);
+
+    if (msg == NULL || msg->msg_name == NULL) {
+        timer.decided ();
+        return next (sockfd, msg, flags);
+    }
+
+    socket_address address;
+    socklen_t namelen = msg->msg_namelen;
+    const struct sockaddr *name = redirect_socket_address ((const struct sockaddr *) msg->msg_name, namelen, address);
+    if (name == NULL) {
+        return -1;
+    }
 
-    return socket_action (_bind, sockfd, addr, addrlen);
+    struct msghdr new_msg = *msg;
+    new_msg.msg_name = (void *) name;
+    new_msg.msg_namelen = namelen;
+
+    timer.decided ();
+    uint64_t hotpath = address.path[0] ? hotpath_start () : 0;
+    ssize_t result = next (sockfd, &new_msg, flags);
+    socket_address_done (SYMBOL_sendmsg, address, name != msg->msg_name, result < 0, hotpath);
+    return result;
 }
 
 extern "C" int
-connect (int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+sendmmsg (int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
 {
-    static socket_action_t _connect =
-        (decltype(_connect)) dlsym (RTLD_NEXT, "connect");
+    using sendmmsg_t = int (*) (int, struct mmsghdr *, unsigned int, int);
+    sendmmsg_t next = next_symbol<sendmmsg_t> (SYMBOL_sendmmsg);
+    latency_timer timer (SYMBOL_sendmmsg);
+
+    // Connected sockets don't name the destination at all
+    unsigned unnamed = 0;
+    while (unnamed < vlen && msgvec[unnamed].msg_hdr.msg_name == NULL) {
+        ++unnamed;
+    }
+    if (unnamed == vlen) {
+        timer.decided ();
+        return next (sockfd, msgvec, vlen, flags);
+    }
+
+    // Send copies of the messages with their addresses redirected, a batch at
+    // a time, stopping at the first message that couldn't be sent
+    int sent = 0;
+    while ((unsigned) sent < vlen) {
+        struct mmsghdr batch[SOCKET_SEND_BATCH];
+        socket_address addresses[SOCKET_SEND_BATCH];
+        unsigned count = MIN (vlen - sent, (unsigned) SOCKET_SEND_BATCH);
+
+        for (unsigned i = 0; i < count; ++i) {
+            batch[i] = msgvec[sent + i];
+            socklen_t namelen = batch[i].msg_hdr.msg_namelen;
+            const struct sockaddr *name = redirect_socket_address ((const struct sockaddr *) batch[i].msg_hdr.msg_name,
+                                                                   namelen, addresses[i]);
+            if (name == NULL) {
+                count = i;
+                break;
+            }
+            batch[i].msg_hdr.msg_name = (void *) name;
+            batch[i].msg_hdr.msg_namelen = namelen;
+        }
 
-    return socket_action (_connect, sockfd, addr, addrlen);
+        if (count == 0) {
+            return sent > 0 ? sent : -1;
+        }
+
+        if (sent == 0) {
+            timer.decided ();
+        }
+        int result = next (sockfd, batch, count, flags);
+        for (unsigned i = 0; i < count; ++i) {
+            socket_address_done (SYMBOL_sendmmsg, addresses[i], batch[i].msg_hdr.msg_name != msgvec[sent + i].msg_hdr.msg_name,
+                                 (int) i >= result, 0);
+        }
+        if (result < 0) {
+            return sent > 0 ? sent : -1;
+        }
+
+        for (int i = 0; i < result; ++i) {
+            msgvec[sent + i].msg_len = batch[i].msg_len;
+        }
+        sent += result;
+        if ((unsigned) result < count) {
+            break;
+        }
+    }
+
+    return sent;
 }
 
 namespace
 {
-void
-ensure_in_ld_preload (std::string& ld_preload, const std::string& to_be_added)
+// Whether lib is one of the ':' separated entries of the LD_PRELOAD=... entry
+bool
+ld_preload_contains (const char *ld_preload, std::string const& lib)
+{
+    const char *p = ld_preload + LD_PRELOAD.size () + 1;
+    while (*p) {
+        const char *end = strchrnul (p, ':');
+        if ((size_t) (end - p) == lib.size () && memcmp (p, lib.data (), lib.size ()) == 0) {
+            return true;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return false;
+}
+
+inline bool
+is_env_entry (const char *entry, std::string const& name)
+{
+    return strncmp (entry, name.data (), name.size ()) == 0 && entry[name.size ()] == '=';
+}
+
+// The environment for an exec'd program: the caller's entries, with our
+// libraries kept in LD_PRELOAD and SNAPCRAFT_PRELOAD pointing at the same
+// tree.  Only pointers are copied in a single pass over envp, the strings are
+// the caller's or the ones precomputed by the Initializer.  Only an LD_PRELOAD
+// the program changed to drop our libraries needs a new string.
+//
+// The exec may be in a vfork child or a signal handler, so nothing is
+// allocated: callers size the storage with measure() and put it on their
+// stack.
+class exec_environment
 {
-    if (!ld_preload.empty ()) {
-        bool found = false;
+public:
+    // Number of entries and bytes of merged LD_PRELOAD the environment for
+    // envp may need
+    static void
+    measure (char *const envp[], size_t& entries, size_t& merged_size)
+    {
+        // Our LD_PRELOAD and SNAPCRAFT_PRELOAD, then the terminating NULL
+        entries = 3;
+        merged_size = 0;
+        for (unsigned i = 0; envp && envp[i]; ++i) {
+            if (is_env_entry (envp[i], LD_PRELOAD)) {
+                merged_size = MAX (merged_size, strlen (envp[i]));
+            }
+            ++entries;
+        }
+        // Each of our libraries and its ':' fit in our own LD_PRELOAD=...
+        merged_size += saved_ld_preload_env.size () + 1;
+    }
 
-        std::string p;
-        std::istringstream ss (ld_preload.substr (LD_PRELOAD.size () + 1, std::string::npos));
-        while (std::getline (ss, p, ':') && !found) {
-            if (p == to_be_added) {
-                found = true;
+    exec_environment (char *const envp[], const char **entries, char *merged)
+        : entries_ (entries), size_ (0), merged_ (merged)
+    {
+        bool replace_ld_preload = !saved_ld_preload_env.empty ();
+        bool replace_snapcraft_preload = !saved_snapcraft_preload_env.empty ();
+        const char *ld_preload = NULL;
+
+        for (unsigned i = 0; envp && envp[i]; ++i) {
+            if (replace_ld_preload && is_env_entry (envp[i], LD_PRELOAD)) {
+                ld_preload = envp[i]; // the last one wins
+            } else if (!replace_snapcraft_preload || !is_env_entry (envp[i], SNAPCRAFT_PRELOAD)) {
+                entries_[size_++] = envp[i];
             }
         }
 
-        if (!found) {
-            ld_preload += ':' + to_be_added;
+        if (replace_ld_preload) {
+            entries_[size_++] = ld_preload ? merge_ld_preload (ld_preload) : saved_ld_preload_env.c_str ();
         }
-    } else {
-        ld_preload = LD_PRELOAD + '=' + to_be_added;
+        if (replace_snapcraft_preload) {
+            entries_[size_++] = saved_snapcraft_preload_env.c_str ();
+        }
+        entries_[size_++] = NULL;
+    }
+
+    char *const *data () const { return (char *const *) entries_; }
+
+private:
+    const char *
+    merge_ld_preload (const char *ld_preload)
+    {
+        const char *merged = ld_preload;
+        char *end = NULL;
+        for (const std::string& lib : saved_ld_preloads) {
+            if (!ld_preload_contains (merged, lib)) {
+                if (end == NULL) {
+                    size_t len = strlen (ld_preload);
+                    memcpy (merged_, ld_preload, len + 1);
+                    end = merged_ + len;
+                    merged = merged_;
+                }
+                *end++ = ':';
+                memcpy (end, lib.data (), lib.size ());
+                end += lib.size ();
+                *end = '\0';
+            }
+        }
+        return merged;
+    }
+
+    const char **entries_;
+    size_t size_;
+    char *merged_;
+};
+
+// Declares an exec_environment for envp with its storage on the stack of the
+// calling function, which must stay around until the exec
+#define EXEC_ENVIRONMENT(NAME, ENVP) \
+    size_t NAME ## _entries, NAME ## _merged_size; \
+    exec_environment::measure (ENVP, NAME ## _entries, NAME ## _merged_size); \
+    const char **NAME ## _entry_storage = (const char **) alloca (NAME ## _entries * sizeof (char *)); \
+    char *NAME ## _merged_storage = (char *) alloca (NAME ## _merged_size); \
+    exec_environment NAME (ENVP, NAME ## _entry_storage, NAME ## _merged_storage)
+
+size_t
+argv_count (char *const argv[])
+{
+    size_t argc = 0;
+    while (argv && argv[argc]) {
+        ++argc;
     }
+    return argc;
 }
 
-std::vector<std::string>
-execve_copy_envp (char *const envp[])
+// How a program has to be exec'd, worked out from its ELF headers.  That only
+// matters when the snap ships a /lib/ld-linux.so.2 the host lacks, otherwise
+// every program is exec'd as it is.  Programs in a read-only $SNAP never
+// change, so the kind is cached per path in slots packing the path hash with
+// the kind, which are read and written without locks.
+enum exec_kind : uint64_t {
+    // Not an ELF executable we could read, exec it and see
+    EXEC_UNKNOWN = 0,
+    EXEC_NATIVE = 1,
+    // 32-bit program whose /lib/ld-linux.so.2 loader only exists in the snap
+    EXEC_SNAP_LOADER = 2,
+};
+
+struct exec_kind_slot
 {
-    std::string ld_preload;
-    std::vector<std::string> new_envp;
+    std::atomic<uint64_t> key_lo;
+    // Hash bits above the kind, 0 when empty
+    std::atomic<uint64_t> key_hi;
+};
 
-    for (unsigned i = 0; envp && envp[i]; ++i) {
-        std::string env(envp[i]);
-        new_envp.push_back (env);
+exec_kind_slot exec_kind_cache[EXEC_KIND_CACHE_SLOTS];
+std::atomic<unsigned> exec_kind_cache_next;
 
-        if (str_starts_with (env, LD_PRELOAD + '=')) {
-            ld_preload = env; // point at last defined LD_PRELOAD index
-        }
+// Whether 32-bit programs may need the snap's /lib/ld-linux.so.2 because the
+// host has none, -1 until checked
+std::atomic<int> snap_loader_needed (-1);
+
+bool
+needs_snap_loader ()
+{
+    int needed = snap_loader_needed.load (std::memory_order_relaxed);
+    if (needed < 0) {
+        redirect_buffer buffer;
+        needed = _access (LD_LINUX.c_str (), F_OK) != 0 &&
+                 redirect_path_exec (LD_LINUX.c_str (), buffer) != LD_LINUX.c_str ();
+        snap_loader_needed.store (needed, std::memory_order_relaxed);
+    }
+    return needed;
+}
+
+// Whether the 32-bit program open as fd, whose first size bytes are in
+// header, is run by /lib/ld-linux.so.2.  The program headers and the
+// interpreter name usually are in there, otherwise they take a pread each.
+bool
+runs_on_ld_linux (int fd, const char *header, size_t size)
+{
+    Elf32_Ehdr ehdr;
+    if (size < sizeof (ehdr)) {
+        return false;
+    }
+    memcpy (&ehdr, header, sizeof (ehdr));
+
+    Elf32_Phdr phdrs[64];
+    size_t table = (size_t) ehdr.e_phnum * sizeof (Elf32_Phdr);
+    if (ehdr.e_phentsize != sizeof (Elf32_Phdr) || table > sizeof (phdrs)) {
+        return false;
+    }
+    if (ehdr.e_phoff <= size && table <= size - ehdr.e_phoff) {
+        memcpy (phdrs, header + ehdr.e_phoff, table);
+    } else if (pread (fd, phdrs, table, ehdr.e_phoff) != (ssize_t) table) {
+        return false;
     }
 
-    for (const std::string& saved_preload : saved_ld_preloads)
-        ensure_in_ld_preload (ld_preload, saved_preload);
+    for (unsigned i = 0; i < ehdr.e_phnum; ++i) {
+        if (phdrs[i].p_type != PT_INTERP) {
+            continue;
+        }
 
-    if (!saved_ld_preloads.empty ())
-        new_envp.push_back (ld_preload);
+        // The name and its terminating NUL
+        size_t length = LD_LINUX.size () + 1;
+        if (phdrs[i].p_filesz != length) {
+            return false;
+        }
 
-    if (!saved_snapcraft_preload.empty ()) {
-        auto snapcraft_preload = SNAPCRAFT_PRELOAD + '=' + saved_snapcraft_preload;
-        new_envp.push_back (snapcraft_preload);
+        char interp[PATH_MAX];
+        const char *name = interp;
+        if (phdrs[i].p_offset <= size && length <= size - phdrs[i].p_offset) {
+            name = header + phdrs[i].p_offset;
+        } else if (pread (fd, interp, length, phdrs[i].p_offset) != (ssize_t) length) {
+            return false;
+        }
+        return memcmp (name, LD_LINUX.c_str (), length) == 0;
     }
 
-    return new_envp;
+    return false;
 }
 
-struct c_vector_holder
+exec_kind
+exec_kind_of (const char *path)
 {
-    c_vector_holder(const std::vector<std::string>& str_vector) {
-        for (auto const& str : str_vector) {
-            holder_.push_back (str.c_str ());
+    // Only worth a look when the snap has the loader the host lacks
+    int saved_errno = errno;
+    bool needed = needs_snap_loader ();
+    errno = saved_errno;
+    if (!needed) {
+        return EXEC_NATIVE;
+    }
+
+    size_t len = strlen (path);
+    bool cacheable = is_permanent_path (path, len);
+    path_key key = hash_path (path, len);
+    uint64_t hi = key.hi & ~(uint64_t) 3;
+    hi = hi ? hi : 4;
+
+    if (cacheable) {
+        for (auto& slot : exec_kind_cache) {
+            uint64_t slot_hi = slot.key_hi.load (std::memory_order_acquire);
+            if ((slot_hi & ~(uint64_t) 3) == hi && slot.key_lo.load (std::memory_order_relaxed) == key.lo &&
+                slot.key_hi.load (std::memory_order_relaxed) == slot_hi) {
+                return (exec_kind) (slot_hi & 3);
+            }
         }
-        holder_.push_back (nullptr);
     }
 
-    operator const char **() { return holder_.data (); }
-    operator char* const*() { return (char* const*) holder_.data (); }
+    saved_errno = errno;
+    exec_kind kind = EXEC_UNKNOWN;
+    auto _open = next_symbol<int (*) (const char *, int, ...)> (SYMBOL_open);
+    int fd = _open (path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        char header[1024];
+        ssize_t size = pread (fd, header, sizeof (header), 0);
+        if (size >= EI_NIDENT && memcmp (header, ELFMAG, SELFMAG) == 0) {
+            bool loader = header[EI_CLASS] == ELFCLASS32 && runs_on_ld_linux (fd, header, size);
+            kind = loader ? EXEC_SNAP_LOADER : EXEC_NATIVE;
+        }
+        close (fd);
+    }
+    errno = saved_errno;
+
+    if (cacheable && kind != EXEC_UNKNOWN) {
+        exec_kind_slot& slot = exec_kind_cache[exec_kind_cache_next.fetch_add (1, std::memory_order_relaxed) % EXEC_KIND_CACHE_SLOTS];
+        slot.key_hi.store (0, std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_release);
+        slot.key_lo.store (key.lo, std::memory_order_relaxed);
+        slot.key_hi.store (hi | kind, std::memory_order_release);
+    }
 
-    private:
-    std::vector<const char*> holder_;
-};
+    return kind;
+}
 
-int
-execve32_wrapper (execve_t _execve, const std::string& path, char *const argv[], char *const envp[])
+// Makes the argv running path through its 32-bit loader.  new_argv has room
+// for argc + 2 entries.
+void
+fill_loader_argv (const char **new_argv, const char *path, char *const argv[], size_t argc)
 {
-    std::string const& custom_loader = redirect_path (LD_LINUX);
-    if (custom_loader == LD_LINUX) {
-        return 0;
+    new_argv[0] = path;
+    for (size_t i = 0; i < argc; ++i) {
+        new_argv[i + 1] = argv[i];
     }
+    new_argv[argc + 1] = NULL;
+}
 
-    std::vector<std::string> new_argv;
-    new_argv.push_back (path);
+int
+execve32_wrapper (execve_t _execve, const char *path, char *const argv[], char *const envp[])
+{
+    redirect_buffer buffer;
+    const char *custom_loader = redirect_path_exec (LD_LINUX.c_str (), buffer);
+    if (custom_loader == LD_LINUX.c_str ()) {
+        errno = ENOENT;
+        return -1;
+    }
 
     // envp is already adjusted for our needs.  But we need to shift argv
-    for (unsigned i = 0; argv && argv[i]; ++i) {
-        new_argv.push_back (argv[i]);
-    }
+    size_t argc = argv_count (argv);
+    const char **new_argv = (const char **) alloca ((argc + 2) * sizeof (char *));
+    fill_loader_argv (new_argv, path, argv, argc);
 
     // Now actually run execve with our loader and adjusted argv
-    return _execve (custom_loader.c_str (), c_vector_holder (new_argv), envp);
+    return _execve (custom_loader, (char *const *) new_argv, envp);
 }
 
+// Runs path with the real function real, accounting for it as func.  Like
+// everything it calls, it neither allocates nor takes locks it might wait
+// for, so it works in vfork children and signal handlers.
 int
-execve_wrapper (const char *func, const char *path, char *const argv[], char *const envp[])
+execve_wrapper (symbol_id func, symbol_id real, const char *path, char *const argv[], char *const envp[])
 {
-    int i, result;
+    int result;
 
-    static execve_t _execve = (decltype(_execve)) dlsym (RTLD_NEXT, func);
+    execve_t _execve = next_symbol<execve_t> (real);
+    latency_timer timer (func);
 
     if (path == NULL) {
+        timer.decided ();
         return _execve (path, argv, envp);
     }
 
-    std::string const& new_path = redirect_path (path);
+    redirect_buffer buffer;
+    const char *new_path = redirect_path_exec (path, buffer);
 
     // Make sure we inject our original preload values, can't trust this
     // program to pass them along in envp for us.
-    auto env_copy = execve_copy_envp (envp);
-    c_vector_holder new_envp (env_copy);
-    result = _execve (new_path.c_str (), argv, new_envp);
+    EXEC_ENVIRONMENT (environment, envp);
+    char *const *new_envp = environment.data ();
+    timer.decided ();
+
+    // Nothing is written at exit once this process image is replaced.  Should
+    // the exec fail, the reports at exit supersede these.
+    write_profile ();
+    write_hotpaths (true);
+    if (__builtin_expect (trace_buffer != NULL, 0)) {
+        trace_call (func, path, new_path, trace_decide (path, new_path), 0, TRACE_BEFORE_CALL);
+    }
+    metrics_record (func, path, new_path, false);
+    // 32-bit programs need the snap's loader when the host has none, which
+    // we can tell from their headers rather than from a failed exec.
+    exec_kind kind = exec_kind_of (new_path);
+    if (kind == EXEC_SNAP_LOADER) {
+        result = execve32_wrapper (_execve, new_path, argv, new_envp);
+    } else {
+        result = _execve (new_path, argv, new_envp);
+    }
 
-    if (result == -1 && errno == ENOENT) {
+    if (result == -1 && errno == ENOENT && kind == EXEC_UNKNOWN) {
         // OK, get prepared for gross hacks here.  In order to run 32-bit ELF
         // executables -- which will hardcode /lib/ld-linux.so.2 as their ld.so
         // loader, we must redirect that check to our own version of ld-linux.so.2.
@@ -629,7 +4838,7 @@ execve_wrapper (const char *func, const char *path, char *const argv[], char *co
         // ld.so loader which will only work if the architecture matches.  So if
         // we failed to run it normally above because the loader couldn't find
         // something, try with our own 32-bit loader.
-        if (_access (new_path.c_str (), F_OK) == 0) {
+        if (_access (new_path, F_OK) == 0) {
             // Only actually try this if the path actually did exist.  That
             // means the ENOENT must have been a missing linked library or the
             // wrong ld.so loader.  Lets assume the latter and try to run as
@@ -638,9 +4847,211 @@ execve_wrapper (const char *func, const char *path, char *const argv[], char *co
         }
     }
 
+    trace_redirect (func, path, new_path, true);
+    metrics_failed (func);
+    return result;
+}
+
+// Runs a file the kernel didn't recognize as a shell script, like glibc's
+// execvp does
+void
+execve_script (symbol_id func, const char *path, char *const argv[], char *const envp[])
+{
+    size_t argc = argv_count (argv);
+    const char **new_argv = (const char **) alloca ((MAX (argc, (size_t) 1) + 2) * sizeof (char *));
+    new_argv[0] = "/bin/sh";
+    new_argv[1] = path;
+    for (size_t i = 1; i < argc; ++i) {
+        new_argv[i + 1] = argv[i];
+    }
+    new_argv[MAX (argc, (size_t) 1) + 1] = NULL;
+
+    execve_wrapper (func, SYMBOL_execve, "/bin/sh", (char *const *) new_argv, envp);
+}
+
+// glibc's execvp and execvpe search PATH and exec each candidate from inside
+// libc, where we can't see it, so we search ourselves with the same rules
+// and exec the candidates through execve_wrapper.
+int
+execvpe_wrapper (symbol_id func, const char *file, char *const argv[], char *const envp[])
+{
+    if (file == NULL || file[0] == '\0') {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (strchr (file, '/') != NULL) {
+        execve_wrapper (func, SYMBOL_execve, file, argv, envp);
+        if (errno == ENOEXEC) {
+            execve_script (func, file, argv, envp);
+        }
+        return -1;
+    }
+
+    size_t file_len = strlen (file);
+    if (file_len > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    const char *search = getenv ("PATH");
+    if (search == NULL) {
+        search = "/bin:/usr/bin";
+    }
+
+    bool got_eacces = false;
+    for (const char *dir = search; ; ++dir) {
+        const char *end = strchrnul (dir, ':');
+        size_t dir_len = end - dir;
+
+        char path[PATH_MAX];
+        if (dir_len + 1 + file_len < sizeof (path)) {
+            // An empty entry is the current directory
+            memcpy (path, dir, dir_len);
+            if (dir_len > 0) {
+                path[dir_len++] = '/';
+            }
+            memcpy (path + dir_len, file, file_len + 1);
+
+            execve_wrapper (func, SYMBOL_execve, path, argv, envp);
+            if (errno == ENOEXEC) {
+                execve_script (func, path, argv, envp);
+            }
+
+            switch (errno) {
+            case EACCES:
+                got_eacces = true;
+                // fall through
+            case ENOENT:
+            case ESTALE:
+            case ENOTDIR:
+            case ENODEV:
+            case ETIMEDOUT:
+                // Try the next one
+                break;
+            default:
+                return -1;
+            }
+        }
+
+        if (*end == '\0') {
+            break;
+        }
+        dir = end;
+    }
+
+    if (got_eacces) {
+        errno = EACCES;
+    }
+    return -1;
+}
+
+// posix_spawn execs in a child sharing our memory, from inside libc where we
+// can't interpose, so the path and environment are worked out here, up front,
+// and glibc keeps its clone based fast path.  Returns an errno value like
+// posix_spawn.
+int
+posix_spawn_redirected (latency_timer& timer, symbol_id func, pid_t *pid, const char *path, const char *new_path,
+                        const posix_spawn_file_actions_t *file_actions, const posix_spawnattr_t *attrp,
+                        char *const argv[], char *const envp[])
+{
+    auto _posix_spawn = next_symbol<posix_spawn_t> (SYMBOL_posix_spawn);
+
+    EXEC_ENVIRONMENT (environment, envp);
+    char *const *new_envp = environment.data ();
+    timer.decided ();
+
+    // glibc reports a failed exec in the child as our result, so the same
+    // 32-bit loader fallback as for execve works here
+    exec_kind kind = exec_kind_of (new_path);
+    int result = kind == EXEC_SNAP_LOADER ? ENOENT : _posix_spawn (pid, new_path, file_actions, attrp, argv, new_envp);
+
+    if (result == ENOENT && kind != EXEC_NATIVE && (kind == EXEC_SNAP_LOADER || _access (new_path, F_OK) == 0)) {
+        redirect_buffer buffer;
+        const char *custom_loader = redirect_path (LD_LINUX.c_str (), buffer);
+        if (custom_loader != LD_LINUX.c_str ()) {
+            size_t argc = argv_count (argv);
+            const char **new_argv = (const char **) alloca ((argc + 2) * sizeof (char *));
+            fill_loader_argv (new_argv, new_path, argv, argc);
+            result = _posix_spawn (pid, custom_loader, file_actions, attrp, (char *const *) new_argv, new_envp);
+        }
+    }
+
+    if (__builtin_expect (trace_buffer != NULL, 0)) {
+        trace_call (func, path, new_path, trace_decide (path, new_path), result, 0);
+    }
+    metrics_record (func, path, new_path, result != 0);
     return result;
 }
 
+int
+posix_spawn_wrapper (symbol_id func, pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions,
+                     const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
+{
+    latency_timer timer (func);
+
+    if (path == NULL) {
+        timer.decided ();
+        return next_symbol<posix_spawn_t> (SYMBOL_posix_spawn) (pid, path, file_actions, attrp, argv, envp);
+    }
+
+    redirect_buffer buffer;
+    const char *new_path = redirect_path (path, buffer);
+    return posix_spawn_redirected (timer, func, pid, path, new_path, file_actions, attrp, argv, envp);
+}
+
+// Searches PATH for file in the parent, as the child's search is out of our
+// reach.  Relative entries are left to glibc, the file actions might change
+// the directory they're relative to.
+int
+posix_spawnp_wrapper (pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions,
+                      const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
+{
+    if (file == NULL || file[0] == '\0' || strchr (file, '/') != NULL) {
+        return posix_spawn_wrapper (SYMBOL_posix_spawnp, pid, file, file_actions, attrp, argv, envp);
+    }
+
+    latency_timer timer (SYMBOL_posix_spawnp);
+    size_t file_len = strlen (file);
+    const char *search = getenv ("PATH");
+    if (search == NULL) {
+        search = "/bin:/usr/bin";
+    }
+
+    for (const char *dir = search; file_len <= NAME_MAX; ++dir) {
+        const char *end = strchrnul (dir, ':');
+        size_t dir_len = end - dir;
+        if (dir[0] != '/') {
+            break;
+        }
+
+        char path[PATH_MAX];
+        if (dir_len + 1 + file_len < sizeof (path)) {
+            memcpy (path, dir, dir_len);
+            path[dir_len] = '/';
+            memcpy (path + dir_len + 1, file, file_len + 1);
+
+            redirect_buffer buffer;
+            const char *new_path = redirect_path (path, buffer);
+            if (_access (new_path, X_OK) == 0) {
+                return posix_spawn_redirected (timer, SYMBOL_posix_spawnp, pid, path, new_path,
+                                               file_actions, attrp, argv, envp);
+            }
+        }
+
+        if (*end == '\0') {
+            break;
+        }
+        dir = end;
+    }
+
+    // Not found, or up to glibc from a relative entry on
+    auto _posix_spawnp = next_symbol<posix_spawn_t> (SYMBOL_posix_spawnp);
+    EXEC_ENVIRONMENT (environment, envp);
+    timer.decided ();
+    return _posix_spawnp (pid, file, file_actions, attrp, argv, environment.data ());
+}
+
 } // anonymous namepsace
 
 extern "C" int
@@ -652,19 +5063,45 @@ execv (const char *path, char *const argv[])
 extern "C" int
 execve (const char *path, char *const argv[], char *const envp[])
 {
-    return execve_wrapper ("execve", path, argv, envp);
+    return execve_wrapper (SYMBOL_execve, SYMBOL_execve, path, argv, envp);
 }
 
 extern "C" int
 __execve (const char *path, char *const argv[], char *const envp[])
 {
-    return execve_wrapper ("__execve", path, argv, envp);
+    return execve_wrapper (SYMBOL___execve, SYMBOL___execve, path, argv, envp);
+}
+
+extern "C" int
+execvp (const char *file, char *const argv[])
+{
+    return execvpe_wrapper (SYMBOL_execvp, file, argv, environ);
+}
+
+extern "C" int
+execvpe (const char *file, char *const argv[], char *const envp[])
+{
+    return execvpe_wrapper (SYMBOL_execvpe, file, argv, envp);
+}
+
+extern "C" int
+posix_spawn (pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions,
+             const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
+{
+    return posix_spawn_wrapper (SYMBOL_posix_spawn, pid, path, file_actions, attrp, argv, envp);
+}
+
+extern "C" int
+posix_spawnp (pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions,
+              const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
+{
+    return posix_spawnp_wrapper (pid, file, file_actions, attrp, argv, envp);
 }
 
 // taken from https://git.launchpad.net/~jdstrand/+git/test-sem-open/tree/lib.c
 void debug_sem(const char *s, ...)
 {
-	if (secure_getenv("SEMWRAP_DEBUG")) {
+	if (saved_sem_debug) {
 		va_list va;
 		va_start(va, s);
 		fprintf(stderr, "SEMWRAP: ");
@@ -676,14 +5113,11 @@ void debug_sem(const char *s, ...)
 
 const char *get_snap_name(void)
 {
-	const char *snapname = getenv("SNAP_INSTANCE_NAME");
-	if (!snapname) {
-		snapname = getenv("SNAP_NAME");
-	}
-	if (!snapname) {
+	if (!saved_sem_snap_name_set) {
 		debug_sem("SNAP_NAME and SNAP_INSTANCE_NAME not set");
+		return NULL;
 	}
-	return snapname;
+	return saved_sem_snap_name.c_str();
 }
 
 int rewrite_for_sem_open(const char *snapname, const char *name, char *rewritten,
@@ -711,24 +5145,34 @@ int rewrite_for_sem_open(const char *snapname, const char *name, char *rewritten
 	return 0;
 }
 
+using sem_open_t = sem_t *(*)(const char *, int, ...);
+
+static sem_t *sem_open_rewritten(sem_open_t original_sem_open, const char *rewritten,
+	    int oflag, mode_t mode, unsigned int value);
+
+static void trace_sem(symbol_id id, const char *name, const char *rewritten, bool failed)
+{
+	if (__builtin_expect(trace_buffer != NULL, 0)) {
+		int saved_errno = errno;
+		trace_call(id, name, rewritten, TRACE_REWRITE, failed ? saved_errno : 0, 0);
+		errno = saved_errno;
+	}
+}
+
 extern "C" sem_t
 *sem_open(const char *name, int oflag, ...)
 {
-	mode_t mode;
-	unsigned int value;
+	mode_t mode = 0;
+	unsigned int value = 0;
 
 	debug_sem("sem_open()");
 	debug_sem("requested name: %s", name);
 
-	// lookup the libc's sem_open() if we haven't already
+	auto original_sem_open = next_symbol<sem_open_t>(SYMBOL_sem_open);
+	latency_timer timer(SYMBOL_sem_open);
 	if (!original_sem_open) {
-		dlerror();
-		original_sem_open = (sem_t*(*)(const char *, int, ...)) dlsym(RTLD_NEXT, "sem_open");
-		if (!original_sem_open) {
-			debug_sem("could not find sem_open in libc");
-			return SEM_FAILED;
-		}
-		dlerror();
+		debug_sem("could not find sem_open in libc");
+		return SEM_FAILED;
 	}
 
 	// mode and value must be set with O_CREAT
@@ -748,6 +5192,7 @@ extern "C" sem_t
 
 	// just call libc's sem_open() if snapname not set
 	if (!snapname) {
+		timer.decided();
 		if (oflag & O_CREAT) {
 			return original_sem_open(name, oflag, mode, value);
 		}
@@ -760,94 +5205,170 @@ extern "C" sem_t
 		return SEM_FAILED;
 	}
 	debug_sem("rewritten name: %s", rewritten);
+	timer.decided();
+	sem_t *sem = sem_open_rewritten(original_sem_open, rewritten, oflag, mode, value);
+	trace_sem(SYMBOL_sem_open, name, rewritten, sem == SEM_FAILED);
+	return sem;
+}
+
+// Creates the semaphore file at path from an anonymous O_TMPFILE file, which
+// is initialized and then linked into place through /proc.  Returns 0 once
+// created, 1 if path already existed, -1 on failure and -2 if this isn't
+// supported here, in which case sem_create_mkstemp() has to be used.
+static int sem_create_tmpfile(const char *path, int oflag, mode_t mode,
+	    unsigned int value)
+{
+	// Not through our open(), which would rewrite SHM_DIR itself
+	auto _open = next_symbol<int (*)(const char *, int, ...)>(SYMBOL_open);
+	int fd = _open(SHM_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		// Strict confinement only allows the snap's own names in SHM_DIR
+		if (errno == EINVAL || errno == EISDIR || errno == EOPNOTSUPP ||
+		    errno == EACCES || errno == EPERM) {
+			sem_tmpfile_supported.store(false, std::memory_order_relaxed);
+			return -2;
+		}
+		return -1;
+	}
+
+	// See sem_create_mkstemp() for the mode and the initial contents
+	sem_t initsem;
+	sem_init(&initsem, 1, value);
+	if (fchmod(fd, mode) < 0 || write(fd, &initsem, sizeof(sem_t)) != sizeof(sem_t)) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+
+	char fd_path[32];
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+
+	int result = 0;
+	if (linkat(AT_FDCWD, fd_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW) < 0) {
+		if (!(oflag & O_EXCL) && errno == EEXIST) {
+			result = 1;
+		} else if ((errno == ENOENT && _access(fd_path, F_OK) != 0) ||
+		           errno == EACCES || errno == EPERM) {
+			// No /proc, or not allowed to link from it
+			sem_tmpfile_supported.store(false, std::memory_order_relaxed);
+			result = -2;
+		} else {
+			result = -1;
+		}
+	}
+
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return result;
+}
+
+// The traditional way of creating the semaphore file, with the same return
+// values as sem_create_tmpfile()
+static int sem_create_mkstemp(const char *path, const char *rewritten, int oflag,
+	    mode_t mode, unsigned int value)
+{
+	// Calculate the template path
+	char tmp[PATH_MAX] = { 0 };
+	int n = snprintf(tmp, PATH_MAX, "%s/%s.XXXXXX", SHM_DIR,
+		     rewritten);
+	if (n < 0 || n >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	tmp[PATH_MAX-1] = '\0';
+
+	// Next, create a temporary file
+	int fd = mkstemp(tmp);
+	if (fd < 0) {
+		return -1;
+	}
+	debug_sem("tmp name: %s", tmp);
+
+	// Update the temporary file to have the requested mode
+	if (fchmod(fd, mode) < 0) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	// Then write out an empty semaphore and set the initial value.
+	// We use '1' for pshared since that is how glibc sets up the
+	// semaphore (see glibc's fbtl/sem_open.c)
+	sem_t initsem;
+	sem_init(&initsem, 1, value);
+	if (write(fd, &initsem, sizeof(sem_t)) < 0) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	// Then link the file into place. If the target exists and
+	// O_EXCL was not specified, just cleanup and proceed to open
+	// the existing file as per documented behavior in 'man
+	// sem_open'.
+	int existed = 0;
+	if (link(tmp, path) < 0) {
+		if (oflag & O_EXCL || errno != EEXIST) {
+			unlink(tmp);
+			return -1;
+		}
+		existed = 1;
+	}
+	unlink(tmp);
 
+	return existed;
+}
+
+static sem_t *sem_open_rewritten(sem_open_t original_sem_open, const char *rewritten,
+	    int oflag, mode_t mode, unsigned int value)
+{
 	if (oflag & O_CREAT) {
 		// glibc's sem_open with O_CREAT will create a file in /dev/shm
 		// by creating a tempfile, initializing it, hardlinking it and
 		// unlinking the tempfile. We:
-		// 1. create a temporary file in /dev/shm with rewritten path
-		//    as the template and the specified mode
+		// 1. create a temporary file in /dev/shm, anonymous with
+		//    O_TMPFILE where supported or else with rewritten path
+		//    as the template, with the specified mode
 		// 2. initialize a sem_t with sem_init
 		// 3. write the initialized sem_t to the temporary file using
 		//    sem_open()s declared value. We used '1' for pshared since
 		//    that is how glibc sets up a named semaphore
-		// 4. close the temporary file
-		// 5. hard link the temporary file to the rewritten path. If
+		// 4. hard link the temporary file to the rewritten path. If
 		//    O_EXCL is not specified, ignore EEXIST and just cleanup
 		//    as per documented behavior in 'man sem_open'. If O_EXCL
 		//    is specified and file exists, exit with error. If link is
 		//    successful, cleanup.
-		// 6. call glibc's sem_open() without O_CREAT|O_EXCL
+		// 5. call glibc's sem_open() without O_CREAT|O_EXCL
 		//
 		// See glibc's fbtl/sem_open.c for more details
 
 		// First, calculate the requested path
 		char path[PATH_MAX] = { 0 };
-		// /sem. + '\0' = 6
-		int max_path_size = strlen(SHM_DIR) + strlen(rewritten) + 6;
-		if (max_path_size >= PATH_MAX) {
+		size_t prefix_len = saved_sem_path_prefix.size();
+		const char *sem_name = rewritten + LITERAL_STRLEN("snap.") + saved_sem_snap_name.size() + 1;
+		size_t sem_name_len = strlen(sem_name);
+		if (prefix_len + sem_name_len >= PATH_MAX) {
 			// Should never happen since PATH_MAX should be much
 			// larger than NAME_MAX, but be defensive.
 			errno = ENAMETOOLONG;
 			return SEM_FAILED;
 		}
-		int n = snprintf(path, max_path_size, "%s/sem.%s", SHM_DIR,
-				 rewritten);
-		if (n < 0 || n >= max_path_size) {
-			errno = ENAMETOOLONG;
-			return SEM_FAILED;
-		}
-		path[max_path_size-1] = '\0';
-
-		// Then calculate the template path
-		char tmp[PATH_MAX] = { 0 };
-		n = snprintf(tmp, PATH_MAX, "%s/%s.XXXXXX", SHM_DIR,
-			     rewritten);
-		if (n < 0 || n >= PATH_MAX) {
-			errno = ENAMETOOLONG;
-			return SEM_FAILED;
-		}
-		tmp[PATH_MAX-1] = '\0';
+		memcpy(path, saved_sem_path_prefix.data(), prefix_len);
+		memcpy(path + prefix_len, sem_name, sem_name_len + 1);
 
-		// Next, create a temporary file
-		int fd = mkstemp(tmp);
-		if (fd < 0) {
-			return SEM_FAILED;
+		int existed = -2;
+		if (sem_tmpfile_supported.load(std::memory_order_relaxed)) {
+			existed = sem_create_tmpfile(path, oflag, mode, value);
 		}
-		debug_sem("tmp name: %s", tmp);
-
-		// Update the temporary file to have the requested mode
-		if (fchmod(fd, mode) < 0) {
-			close(fd);
-			unlink(tmp);
-			return SEM_FAILED;
+		if (existed == -2) {
+			existed = sem_create_mkstemp(path, rewritten, oflag, mode, value);
 		}
-
-		// Then write out an empty semaphore and set the initial value.
-		// We use '1' for pshared since that is how glibc sets up the
-		// semaphore (see glibc's fbtl/sem_open.c)
-		sem_t initsem;
-		sem_init(&initsem, 1, value);
-		if (write(fd, &initsem, sizeof(sem_t)) < 0) {
-			close(fd);
-			unlink(tmp);
+		if (existed < 0) {
 			return SEM_FAILED;
 		}
-		close(fd);
-
-		// Then link the file into place. If the target exists and
-		// O_EXCL was not specified, just cleanup and proceed to open
-		// the existing file as per documented behavior in 'man
-		// sem_open'.
-		int existed = 0;
-		if (link(tmp, path) < 0) {
-			if (oflag & O_EXCL || errno != EEXIST) {
-				unlink(tmp);
-				return SEM_FAILED;
-			}
-			existed = 1;
-		}
-		unlink(tmp);
 
 		// Then call sem_open() on the created file, stripping out the
 		// O_CREAT|O_EXCL since we just created it
@@ -876,21 +5397,18 @@ sem_unlink(const char *name)
 	debug_sem("sem_unlink()");
 	debug_sem("requested name: %s", name);
 
-	// lookup the libc's sem_unlink() if we haven't already
+	auto original_sem_unlink = next_symbol<int(*)(const char *)>(SYMBOL_sem_unlink);
+	latency_timer timer(SYMBOL_sem_unlink);
 	if (!original_sem_unlink) {
-		dlerror();
-		original_sem_unlink = (int(*)(const char *))dlsym(RTLD_NEXT, "sem_unlink");
-		if (!original_sem_unlink) {
-			debug_sem("could not find sem_unlink in libc");
-			return -1;
-		}
-		dlerror();
+		debug_sem("could not find sem_unlink in libc");
+		return -1;
 	}
 
 	const char *snapname = get_snap_name();
 
 	// just call libc's sem_unlink() if snapname not set
 	if (!snapname) {
+		timer.decided();
 		return original_sem_unlink(name);
 	}
 
@@ -900,6 +5418,9 @@ sem_unlink(const char *name)
 		return -1;
 	}
 	debug_sem("rewritten name: %s", rewritten);
+	timer.decided();
 
-	return original_sem_unlink(rewritten);
+	int result = original_sem_unlink(rewritten);
+	trace_sem(SYMBOL_sem_unlink, name, rewritten, result != 0);
+	return result;
 }
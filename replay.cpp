@@ -0,0 +1,710 @@
+/* -*- Mode: C; indent-tabs-mode: nil; tab-width: 4 -*-
+ *
+ * Copyright (C) 2017 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays a recorded sequence of path operations, such as the file system
+// calls of an application starting up, to measure what the preload library
+// adds to it.  The paths the recording found are created in a synthetic snap
+// tree, then the replay re-executes itself twice: once plain, calling into
+// the tree's real paths, and once with the preload library, using the paths
+// as recorded so they get redirected into the tree.  Paths the tree doesn't
+// have, such as those recorded missing, and paths below /proc, /sys, /dev and
+// /run are used as they are in both runs, as the library falls back to them.
+// The preloaded run publishes its metrics segment (see metrics.h) and counts
+// the existence checks each operation made from it.
+//
+// Recordings are either strace output, e.g. from
+//
+//   strace -f -e trace=%file -o launch.strace my-app
+//
+// or lines of '<operation> <path> [missing]', where operation is one of open,
+// opendir, stat, lstat, access or readlink and missing marks paths that
+// don't exist.  Relative paths and other calls are skipped.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <map>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "metrics.h"
+
+#ifndef SNAPCRAFT_PRELOAD_LIBRARY_DEF
+#define SNAPCRAFT_PRELOAD_LIBRARY_DEF "libsnapcraft-preload.so"
+#endif
+
+namespace
+{
+const char *const REPLAY_ROOT = "SNAPCRAFT_PRELOAD_REPLAY_ROOT";
+const char *const REPLAY_RECORDING = "SNAPCRAFT_PRELOAD_REPLAY_RECORDING";
+const char *const REPLAY_PRELOADED = "SNAPCRAFT_PRELOAD_REPLAY_PRELOADED";
+const char *const REPLAY_ITERATIONS = "SNAPCRAFT_PRELOAD_REPLAY_ITERATIONS";
+const char *const REPLAY_INSTANCE = "snapcraft-preload-replay";
+
+enum operation_kind { OP_OPEN, OP_OPENDIR, OP_STAT, OP_LSTAT, OP_ACCESS, OP_READLINK, OP_COUNT };
+
+const char *const operation_names[OP_COUNT] = { "open", "opendir", "stat", "lstat", "access", "readlink" };
+
+struct operation
+{
+    operation_kind kind;
+    std::string path;
+    bool exists;
+};
+
+// System calls as named by strace and what they are replayed as
+const struct { const char *name; operation_kind kind; } STRACE_CALLS[] = {
+    { "open", OP_OPEN },
+    { "openat", OP_OPEN },
+    { "openat2", OP_OPEN },
+    { "stat", OP_STAT },
+    { "stat64", OP_STAT },
+    { "newfstatat", OP_STAT },
+    { "fstatat64", OP_STAT },
+    { "statx", OP_STAT },
+    { "lstat", OP_LSTAT },
+    { "lstat64", OP_LSTAT },
+    { "access", OP_ACCESS },
+    { "faccessat", OP_ACCESS },
+    { "faccessat2", OP_ACCESS },
+    { "readlink", OP_READLINK },
+    { "readlinkat", OP_READLINK },
+};
+
+const char *const HOST_PREFIXES[] = { "/proc", "/sys", "/dev", "/run" };
+
+bool
+is_host_path (const std::string& path)
+{
+    for (const char *prefix : HOST_PREFIXES) {
+        size_t len = strlen (prefix);
+        if (path.compare (0, len, prefix) == 0 && (path.size () == len || path[len] == '/')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+parse_kind (const std::string& name, operation_kind& kind)
+{
+    for (int k = 0; k < OP_COUNT; ++k) {
+        if (name == operation_names[k]) {
+            kind = (operation_kind) k;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads the first quoted string of an strace line, returning false if there
+// is none or strace cut it short
+bool
+strace_path (const std::string& line, size_t from, std::string& path)
+{
+    size_t i = line.find ('"', from);
+    if (i == std::string::npos) {
+        return false;
+    }
+
+    path.clear ();
+    for (++i; i < line.size () && line[i] != '"'; ++i) {
+        if (line[i] == '\\' && i + 1 < line.size ()) {
+            ++i;
+        }
+        path += line[i];
+    }
+
+    return i < line.size () && line.compare (i + 1, 3, "...") != 0;
+}
+
+// Parses a line of strace output, e.g.
+//
+//   1234  12:00:00.000000 openat(AT_FDCWD, "/etc/ld.so.cache", O_RDONLY|O_CLOEXEC) = 3
+bool
+parse_strace_line (const std::string& line, operation& op)
+{
+    // Calls interrupted by another thread are completed on a later line,
+    // which lacks the arguments
+    if (line.find ("<unfinished") != std::string::npos || line.find ("resumed>") != std::string::npos) {
+        return false;
+    }
+
+    size_t paren = line.find ('(');
+    if (paren == std::string::npos) {
+        return false;
+    }
+    size_t start = line.find_last_of (" ]", paren);
+    start = start == std::string::npos ? 0 : start + 1;
+    std::string name = line.substr (start, paren - start);
+
+    bool known = false;
+    for (auto const& call : STRACE_CALLS) {
+        if (name == call.name) {
+            op.kind = call.kind;
+            known = true;
+            break;
+        }
+    }
+
+    size_t result = line.rfind (" = ");
+    if (!known || result == std::string::npos || !strace_path (line, paren, op.path)) {
+        return false;
+    }
+
+    if (op.kind == OP_OPEN && line.find ("O_DIRECTORY") != std::string::npos) {
+        op.kind = OP_OPENDIR;
+    } else if (op.kind == OP_STAT && line.find ("AT_SYMLINK_NOFOLLOW") != std::string::npos) {
+        op.kind = OP_LSTAT;
+    }
+    op.exists = line.compare (result + 3, 2, "-1") != 0;
+    return true;
+}
+
+bool
+parse_list_line (const std::string& line, operation& op)
+{
+    char name[32], path[PATH_MAX], missing[32];
+    int fields = sscanf (line.c_str (), "%31s %4095s %31s", name, path, missing);
+    if (fields < 2 || !parse_kind (name, op.kind) || (fields == 3 && strcmp (missing, "missing") != 0)) {
+        return false;
+    }
+
+    op.path = path;
+    op.exists = fields == 2;
+    return true;
+}
+
+bool
+read_recording (const char *file, std::vector<operation>& ops, unsigned& skipped)
+{
+    FILE *in = fopen (file, "r");
+    if (!in) {
+        perror (file);
+        return false;
+    }
+
+    char *buffer = NULL;
+    size_t size = 0;
+    skipped = 0;
+    while (getline (&buffer, &size, in) > 0) {
+        std::string line = buffer;
+        while (!line.empty () && (line.back () == '\n' || line.back () == '\r')) {
+            line.resize (line.size () - 1);
+        }
+        if (line.empty () || line[0] == '#') {
+            continue;
+        }
+
+        operation op;
+        bool parsed = line.find ('(') != std::string::npos ? parse_strace_line (line, op) : parse_list_line (line, op);
+        if (!parsed || op.path.empty () || op.path[0] != '/') {
+            ++skipped;
+            continue;
+        }
+        ops.push_back (op);
+    }
+
+    free (buffer);
+    fclose (in);
+    return true;
+}
+
+bool
+make_directories (const std::string& path)
+{
+    for (size_t slash = path.find ('/', 1); ; slash = path.find ('/', slash + 1)) {
+        std::string dir = path.substr (0, slash);
+        if (mkdir (dir.c_str (), 0755) != 0 && errno != EEXIST) {
+            perror (dir.c_str ());
+            return false;
+        }
+        if (slash == std::string::npos) {
+            return true;
+        }
+    }
+}
+
+// Creates every path the recording found below snap, as a directory when
+// something was found below it or it was opened as one, else as a file or a
+// symbolic link.
+bool
+create_tree (const std::string& snap, std::vector<operation> const& ops)
+{
+    std::set<std::string> directories;
+    std::map<std::string, operation_kind> entries;
+
+    for (operation const& op : ops) {
+        if (!op.exists || is_host_path (op.path)) {
+            continue;
+        }
+
+        std::string path = op.path;
+        bool directory = op.kind == OP_OPENDIR;
+        while (path.size () > 1 && path.back () == '/') {
+            path.resize (path.size () - 1);
+            directory = true;
+        }
+        if (path == "/") {
+            continue;
+        }
+
+        if (directory) {
+            directories.insert (path);
+        } else if (!entries.count (path) || op.kind == OP_READLINK) {
+            entries[path] = op.kind;
+        }
+        for (size_t slash = path.rfind ('/'); slash != std::string::npos && slash > 0; slash = path.rfind ('/', slash - 1)) {
+            directories.insert (path.substr (0, slash));
+        }
+    }
+
+    if (!make_directories (snap)) {
+        return false;
+    }
+    for (std::string const& dir : directories) {
+        if (!make_directories (snap + dir)) {
+            return false;
+        }
+    }
+
+    for (auto const& entry : entries) {
+        if (directories.count (entry.first)) {
+            continue;
+        }
+
+        std::string path = snap + entry.first;
+        bool ok;
+        if (entry.second == OP_READLINK) {
+            ok = symlink ("target", path.c_str ()) == 0;
+        } else {
+            int fd = open (path.c_str (), O_CREAT | O_WRONLY, 0644);
+            ok = fd >= 0;
+            if (ok) {
+                close (fd);
+            }
+        }
+        if (!ok && errno != EEXIST) {
+            perror (path.c_str ());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+remove_tree (const std::string& path)
+{
+    DIR *dir = opendir (path.c_str ());
+    if (dir) {
+        while (struct dirent *entry = readdir (dir)) {
+            if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0) {
+                continue;
+            }
+            std::string child = path + "/" + entry->d_name;
+            if (entry->d_type == DT_DIR) {
+                remove_tree (child);
+            } else {
+                unlink (child.c_str ());
+            }
+        }
+        closedir (dir);
+    }
+    rmdir (path.c_str ());
+}
+
+double
+now_ns ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void
+run_operation (operation_kind kind, const char *path)
+{
+    struct stat st;
+    char target[PATH_MAX];
+
+    switch (kind) {
+    case OP_OPEN: {
+        int fd = open (path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            close (fd);
+        }
+        break;
+    }
+    case OP_OPENDIR: {
+        DIR *dir = opendir (path);
+        if (dir) {
+            closedir (dir);
+        }
+        break;
+    }
+    case OP_STAT:
+        stat (path, &st);
+        break;
+    case OP_LSTAT:
+        lstat (path, &st);
+        break;
+    case OP_ACCESS:
+        access (path, F_OK);
+        break;
+    case OP_READLINK:
+        if (readlink (path, target, sizeof (target)) < 0) {
+            // Missing paths are replayed too
+        }
+        break;
+    case OP_COUNT:
+        break;
+    }
+}
+
+// Maps the metrics segment the preload library publishes for this process
+const metrics_header *
+map_metrics ()
+{
+    std::string path = std::string ("/dev/shm/snap.") + REPLAY_INSTANCE + METRICS_INFIX + std::to_string (getpid ());
+    int fd = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && (size_t) st.st_size >= sizeof (metrics_header)) {
+        map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close (fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const metrics_header *header = static_cast<const metrics_header *> (map);
+    if (memcmp (header->magic, METRICS_MAGIC, sizeof (METRICS_MAGIC)) != 0 ||
+        header->version != METRICS_VERSION ||
+        header->counters_size != sizeof (metrics_counters) ||
+        header->function_count > (st.st_size - sizeof (metrics_header)) / sizeof (metrics_counters)) {
+        munmap (map, st.st_size);
+        return NULL;
+    }
+    return header;
+}
+
+struct existence_counts
+{
+    uint64_t checks;
+    uint64_t syscalls;
+};
+
+// The existence checks made so far by every function
+existence_counts
+read_existence_counts (const metrics_header *header)
+{
+    existence_counts counts = { 0, 0 };
+    if (!header) {
+        return counts;
+    }
+
+    const metrics_counters *counters = reinterpret_cast<const metrics_counters *> (header + 1);
+    for (uint32_t i = 0; i < header->function_count; ++i) {
+        counts.checks += counters[i].existence_checks.load (std::memory_order_relaxed);
+        counts.syscalls += counters[i].existence_syscalls.load (std::memory_order_relaxed);
+    }
+    return counts;
+}
+
+// Runs in the re-executed child, printing '<operation> <calls> <ns> <checks>
+// <syscalls> <first syscalls>' lines with the time spent per replay in each
+// operation, the existence checks it made per replay and how many of them
+// needed a syscall, then and in the first replay, and a 'total' line with the
+// fastest replay of the whole sequence and the checks of all operations
+int
+run_child (const std::string& root, const char *recording, bool preloaded, long iterations)
+{
+    std::vector<operation> ops;
+    unsigned skipped;
+    if (!read_recording (recording, ops, skipped)) {
+        return 1;
+    }
+
+    // Plain runs find the files where the preload library would send them,
+    // which is the path as recorded when the tree doesn't have it
+    std::vector<std::string> paths;
+    for (operation const& op : ops) {
+        std::string in_tree = root + "/snap" + op.path;
+        struct stat st;
+        bool redirected = !preloaded && !is_host_path (op.path) && lstat (in_tree.c_str (), &st) == 0;
+        paths.push_back (redirected ? in_tree : op.path);
+    }
+
+    const metrics_header *metrics = preloaded ? map_metrics () : NULL;
+    if (preloaded && !metrics) {
+        fprintf (stderr, "cannot read the preload library's metrics segment\n");
+        return 1;
+    }
+
+    unsigned calls[OP_COUNT] = { 0 };
+    double time[OP_COUNT] = { 0 };
+    uint64_t checks[OP_COUNT] = { 0 };
+    uint64_t syscalls[OP_COUNT] = { 0 };
+    uint64_t first_syscalls[OP_COUNT] = { 0 };
+    for (operation const& op : ops) {
+        calls[op.kind]++;
+    }
+
+    // The first replay only warms up caches on both sides, and the counters
+    // are read outside of the time taken
+    double best = 0;
+    existence_counts before = read_existence_counts (metrics);
+    for (long i = 0; i <= iterations; ++i) {
+        double elapsed = 0;
+        for (size_t j = 0; j < ops.size (); ++j) {
+            double start = now_ns ();
+            run_operation (ops[j].kind, paths[j].c_str ());
+            double took = now_ns () - start;
+
+            existence_counts after = read_existence_counts (metrics);
+            if (i > 0) {
+                time[ops[j].kind] += took;
+                checks[ops[j].kind] += after.checks - before.checks;
+                syscalls[ops[j].kind] += after.syscalls - before.syscalls;
+            } else {
+                first_syscalls[ops[j].kind] += after.syscalls - before.syscalls;
+            }
+            before = after;
+            elapsed += took;
+        }
+        if (i == 1 || (i > 1 && elapsed < best)) {
+            best = elapsed;
+        }
+    }
+
+    double total_checks = 0, total_syscalls = 0, total_first = 0;
+    for (int k = 0; k < OP_COUNT; ++k) {
+        if (calls[k]) {
+            printf ("%s %u %.1f %.1f %.1f %.1f\n", operation_names[k], calls[k], time[k] / iterations,
+                    (double) checks[k] / iterations, (double) syscalls[k] / iterations, (double) first_syscalls[k]);
+        }
+        total_checks += (double) checks[k] / iterations;
+        total_syscalls += (double) syscalls[k] / iterations;
+        total_first += first_syscalls[k];
+    }
+    printf ("total %zu %.1f %.1f %.1f %.1f\n", ops.size (), best, total_checks, total_syscalls, total_first);
+    return 0;
+}
+
+struct options
+{
+    std::string library;
+    long iterations;
+    std::string format;
+    const char *recording;
+};
+
+struct timing
+{
+    unsigned calls;
+    double ns;
+    // Existence checks per replay, those needing a syscall, and those
+    // needing a syscall in the first replay
+    double checks;
+    double syscalls;
+    double first_syscalls;
+};
+
+using results = std::map<std::string, timing>;
+
+bool
+run_parent_pass (const char *self, const std::string& root, options const& opts, bool preloaded,
+                 std::vector<std::string>& keys, results& timings)
+{
+    int fds[2];
+    if (pipe (fds) != 0) {
+        perror ("pipe");
+        return false;
+    }
+
+    pid_t pid = fork ();
+    if (pid == 0) {
+        close (fds[0]);
+        dup2 (fds[1], STDOUT_FILENO);
+        setenv (REPLAY_ROOT, root.c_str (), 1);
+        setenv (REPLAY_RECORDING, opts.recording, 1);
+        setenv (REPLAY_ITERATIONS, std::to_string (opts.iterations).c_str (), 1);
+        if (preloaded) {
+            setenv (REPLAY_PRELOADED, "1", 1);
+            setenv ("SNAPCRAFT_PRELOAD", (root + "/snap").c_str (), 1);
+            setenv ("SNAP_INSTANCE_NAME", REPLAY_INSTANCE, 1);
+            setenv ("SNAPCRAFT_PRELOAD_METRICS", "1", 1);
+            setenv ("LD_PRELOAD", opts.library.c_str (), 1);
+        }
+        execl (self, self, (char *) NULL);
+        perror ("execl");
+        _exit (1);
+    }
+
+    close (fds[1]);
+    FILE *output = fdopen (fds[0], "r");
+    char name[64];
+    timing t;
+    while (fscanf (output, "%63s %u %lf %lf %lf %lf", name, &t.calls, &t.ns, &t.checks, &t.syscalls, &t.first_syscalls) == 6) {
+        if (!preloaded) {
+            keys.push_back (name);
+        }
+        timings[name] = t;
+    }
+    fclose (output);
+
+    int status;
+    waitpid (pid, &status, 0);
+    return WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+// Existence checks are those the library made per replay, and how many of
+// them needed a syscall then and in the first replay, before its caches knew
+// anything
+void
+write_results (const std::string& format, std::vector<std::string> const& keys, results& plain, results& preloaded)
+{
+    if (format == "csv") {
+        printf ("operation,calls,plain_us,preload_us,overhead_us,overhead_ns_per_call,checks,check_syscalls,first_check_syscalls\n");
+    } else {
+        printf ("%-10s %8s %12s %12s %12s %14s %10s %10s %12s\n",
+                "operation", "calls", "plain us", "preload us", "overhead us", "ns per call",
+                "checks", "syscalls", "1st syscalls");
+    }
+
+    for (std::string const& key : keys) {
+        timing const& a = plain[key];
+        timing const& b = preloaded[key];
+        double overhead = b.ns - a.ns;
+        double per_call = a.calls ? overhead / a.calls : 0;
+        if (format == "csv") {
+            printf ("%s,%u,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.0f\n", key.c_str (), a.calls, a.ns / 1e3, b.ns / 1e3,
+                    overhead / 1e3, per_call, b.checks, b.syscalls, b.first_syscalls);
+        } else {
+            printf ("%-10s %8u %12.1f %12.1f %12.1f %14.1f %10.1f %10.1f %12.0f\n", key.c_str (), a.calls, a.ns / 1e3,
+                    b.ns / 1e3, overhead / 1e3, per_call, b.checks, b.syscalls, b.first_syscalls);
+        }
+    }
+}
+
+void
+usage (const char *self)
+{
+    fprintf (stderr, "Usage: %s [--library PATH] [--iterations N] [--format table|csv] RECORDING\n", self);
+}
+
+} // unnamed namespace
+
+int
+main (int argc, char *argv[])
+{
+    options opts;
+    opts.library = SNAPCRAFT_PRELOAD_LIBRARY_DEF;
+    opts.iterations = 20;
+    opts.format = "table";
+    opts.recording = NULL;
+
+    const char *root = getenv (REPLAY_ROOT);
+    if (root) {
+        const char *n = getenv (REPLAY_ITERATIONS);
+        return run_child (root, getenv (REPLAY_RECORDING), getenv (REPLAY_PRELOADED) != NULL,
+                          n ? atol (n) : opts.iterations);
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp (argv[i], "--library") == 0 && i + 1 < argc) {
+            opts.library = argv[++i];
+        } else if (strcmp (argv[i], "--iterations") == 0 && i + 1 < argc) {
+            opts.iterations = atol (argv[++i]);
+        } else if (strcmp (argv[i], "--format") == 0 && i + 1 < argc) {
+            opts.format = argv[++i];
+        } else if (argv[i][0] != '-' && !opts.recording) {
+            opts.recording = argv[i];
+        } else {
+            usage (argv[0]);
+            return 1;
+        }
+    }
+
+    if (!opts.recording || opts.iterations <= 0 || (opts.format != "table" && opts.format != "csv")) {
+        usage (argv[0]);
+        return 1;
+    }
+
+    // The children read it from their own working directory
+    char recording[PATH_MAX];
+    if (!realpath (opts.recording, recording)) {
+        perror (opts.recording);
+        return 1;
+    }
+    opts.recording = recording;
+
+    std::vector<operation> ops;
+    unsigned skipped;
+    if (!read_recording (opts.recording, ops, skipped)) {
+        return 1;
+    }
+    if (ops.empty ()) {
+        fprintf (stderr, "%s: no operations to replay\n", opts.recording);
+        return 1;
+    }
+    if (skipped && opts.format != "csv") {
+        printf ("skipped %u lines of other calls or relative paths\n\n", skipped);
+    }
+
+    char tmp_template[] = "/tmp/snapcraft-preload-replay.XXXXXX";
+    char *tmp = mkdtemp (tmp_template);
+    if (!tmp) {
+        perror ("mkdtemp");
+        return 1;
+    }
+
+    std::vector<std::string> keys;
+    results plain, preloaded;
+    bool ok = create_tree (std::string (tmp) + "/snap", ops) &&
+              run_parent_pass ("/proc/self/exe", tmp, opts, false, keys, plain) &&
+              run_parent_pass ("/proc/self/exe", tmp, opts, true, keys, preloaded);
+
+    remove_tree (tmp);
+
+    if (!ok) {
+        fprintf (stderr, "replay failed\n");
+        return 1;
+    }
+
+    write_results (opts.format, keys, plain, preloaded);
+    return 0;
+}
@@ -0,0 +1,234 @@
+/* -*- Mode: C; indent-tabs-mode: nil; tab-width: 4 -*-
+ *
+ * Copyright (C) 2017 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures how long starting an app takes through the snapcraft-preload
+// launcher, compared with the shell script it replaces and with setting up
+// the environment directly.  Each run starts /bin/true with the preload
+// library, from a synthetic $SNAP holding it, and waits for it to exit.  The
+// three ways are run in turn on every iteration so they see the same noise.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <algorithm>
+#include <errno.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef SNAPCRAFT_PRELOAD_LIBRARY_DEF
+#define SNAPCRAFT_PRELOAD_LIBRARY_DEF "libsnapcraft-preload.so"
+#endif
+#ifndef SNAPCRAFT_PRELOAD_LAUNCHER_DEF
+#define SNAPCRAFT_PRELOAD_LAUNCHER_DEF "snapcraft-preload"
+#endif
+#ifndef SNAPCRAFT_PRELOAD_SCRIPT_DEF
+#define SNAPCRAFT_PRELOAD_SCRIPT_DEF "snapcraft-preload.sh"
+#endif
+#ifndef SNAPCRAFT_LIBPATH_DEF
+#define SNAPCRAFT_LIBPATH_DEF "lib/libsnapcraft-preload.so"
+#endif
+
+namespace
+{
+const char *const TARGET = "/bin/true";
+
+struct launch
+{
+    const char *name;
+    // Command line, the target is appended
+    std::vector<std::string> command;
+    // Set up by hand instead of by the command
+    bool preloaded;
+    std::vector<double> times;
+};
+
+double
+now_us ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+std::vector<char *>
+make_environment (const std::string& snap, std::string const& library, bool preloaded,
+                  std::vector<std::string>& storage)
+{
+    for (char **e = environ; *e; ++e) {
+        if (strncmp (*e, "SNAP=", 5) != 0 && strncmp (*e, "SNAPCRAFT_PRELOAD", 17) != 0 &&
+            strncmp (*e, "LD_PRELOAD=", 11) != 0) {
+            storage.push_back (*e);
+        }
+    }
+    storage.push_back ("SNAP=" + snap);
+    if (preloaded) {
+        storage.push_back ("SNAPCRAFT_PRELOAD=" + snap);
+        storage.push_back ("LD_PRELOAD=" + library);
+    }
+
+    std::vector<char *> env;
+    for (std::string& entry : storage) {
+        env.push_back (&entry[0]);
+    }
+    env.push_back (NULL);
+    return env;
+}
+
+// Time from spawning the command to reaping it, or -1 if it failed
+double
+run_once (launch const& l, char *const *env)
+{
+    std::vector<char *> argv;
+    for (std::string const& arg : l.command) {
+        argv.push_back (const_cast<char *> (arg.c_str ()));
+    }
+    argv.push_back (const_cast<char *> (TARGET));
+    argv.push_back (NULL);
+
+    double start = now_us ();
+    pid_t pid;
+    int status;
+    if (posix_spawn (&pid, argv[0], NULL, NULL, argv.data (), env) != 0 ||
+        waitpid (pid, &status, 0) != pid || !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+        return -1;
+    }
+    return now_us () - start;
+}
+
+void
+usage (const char *self)
+{
+    fprintf (stderr, "Usage: %s [--iterations N] [--library PATH] [--launcher PATH] [--script PATH]\n", self);
+}
+
+} // unnamed namespace
+
+int
+main (int argc, char *argv[])
+{
+    long iterations = 500;
+    std::string library = SNAPCRAFT_PRELOAD_LIBRARY_DEF;
+    std::string launcher = SNAPCRAFT_PRELOAD_LAUNCHER_DEF;
+    std::string script = SNAPCRAFT_PRELOAD_SCRIPT_DEF;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp (argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atol (argv[++i]);
+        } else if (strcmp (argv[i], "--library") == 0 && i + 1 < argc) {
+            library = argv[++i];
+        } else if (strcmp (argv[i], "--launcher") == 0 && i + 1 < argc) {
+            launcher = argv[++i];
+        } else if (strcmp (argv[i], "--script") == 0 && i + 1 < argc) {
+            script = argv[++i];
+        } else {
+            usage (argv[0]);
+            return 1;
+        }
+    }
+
+    if (iterations <= 0) {
+        usage (argv[0]);
+        return 1;
+    }
+
+    char *absolute = realpath (library.c_str (), NULL);
+    if (!absolute) {
+        perror (library.c_str ());
+        return 1;
+    }
+    library = absolute;
+    free (absolute);
+
+    // $SNAP with the library where the launchers expect it
+    char tmp_template[] = "/tmp/snapcraft-preload-startup.XXXXXX";
+    char *tmp = mkdtemp (tmp_template);
+    if (!tmp) {
+        perror ("mkdtemp");
+        return 1;
+    }
+    std::string snap = tmp;
+    std::string snap_library = snap + "/" + SNAPCRAFT_LIBPATH_DEF;
+    std::string snap_libdir = snap_library.substr (0, snap_library.rfind ('/'));
+    if (mkdir (snap_libdir.c_str (), 0755) != 0 || symlink (library.c_str (), snap_library.c_str ()) != 0) {
+        perror (snap_libdir.c_str ());
+        rmdir (snap_libdir.c_str ());
+        rmdir (tmp);
+        return 1;
+    }
+
+    std::vector<launch> launches = {
+        { "direct", {}, true, {} },
+        { "script", { script }, false, {} },
+        { "launcher", { launcher }, false, {} },
+    };
+
+    std::vector<std::string> plain_storage, preloaded_storage;
+    std::vector<char *> plain_env = make_environment (snap, snap_library, false, plain_storage);
+    std::vector<char *> preloaded_env = make_environment (snap, snap_library, true, preloaded_storage);
+
+    bool ok = true;
+    long warmup = iterations / 10 + 1;
+    for (long i = 0; ok && i < warmup + iterations; ++i) {
+        for (launch& l : launches) {
+            double us = run_once (l, l.preloaded ? preloaded_env.data () : plain_env.data ());
+            if (us < 0) {
+                fprintf (stderr, "running %s through '%s' failed\n", TARGET,
+                         l.command.empty () ? TARGET : l.command[0].c_str ());
+                ok = false;
+                break;
+            }
+            if (i >= warmup) {
+                l.times.push_back (us);
+            }
+        }
+    }
+
+    unlink (snap_library.c_str ());
+    rmdir (snap_libdir.c_str ());
+    rmdir (tmp);
+
+    if (!ok) {
+        return 1;
+    }
+
+    printf ("%-10s %10s %10s %10s %12s\n", "launch", "min_us", "median_us", "mean_us", "vs_direct_us");
+    double direct_median = 0;
+    for (launch& l : launches) {
+        std::sort (l.times.begin (), l.times.end ());
+        double sum = 0;
+        for (double us : l.times) {
+            sum += us;
+        }
+        double median = l.times[l.times.size () / 2];
+        if (l.command.empty ()) {
+            direct_median = median;
+        }
+        printf ("%-10s %10.1f %10.1f %10.1f %12.1f\n", l.name, l.times.front (), median,
+                sum / l.times.size (), median - direct_median);
+    }
+
+    return 0;
+}
@@ -0,0 +1,454 @@
+/* -*- Mode: C; indent-tabs-mode: nil; tab-width: 4 -*-
+ *
+ * Copyright (C) 2017 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Shows what the processes of running snaps are redirecting, from the metrics
+// segments they publish with SNAPCRAFT_PRELOAD_METRICS=1, see metrics.h.
+// Like vmstat, the first line covers each process' life so far and every
+// following one the last interval, all in calls per second:
+//
+//   procs      processes publishing metrics
+//   calls      open, stat, access, exec and other calls by function family
+//   decisions  calls by where their path went
+//   existence  checks made deciding that, and those that needed a syscall
+//   errors     calls that failed
+//
+// With --functions, the calls so far are listed by function instead.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "metrics.h"
+
+namespace
+{
+const char *const SHM_DIR = "/dev/shm";
+
+enum family { FAMILY_OPEN, FAMILY_STAT, FAMILY_ACCESS, FAMILY_EXEC, FAMILY_OTHER, FAMILIES };
+
+const char *const family_names[FAMILIES] = { "open", "stat", "access", "exec", "other" };
+const char *const decision_names[METRICS_DECISIONS] = { "unchg", "preload", "rewrite", "writbl", "bypass" };
+
+struct function_counts
+{
+    uint64_t decisions[METRICS_DECISIONS];
+    uint64_t errors;
+    uint64_t checks;
+    uint64_t syscalls;
+
+    uint64_t
+    calls () const
+    {
+        uint64_t total = 0;
+        for (uint64_t n : decisions) {
+            total += n;
+        }
+        return total;
+    }
+};
+
+struct process
+{
+    uint32_t pid;
+    uint32_t ppid;
+    uint64_t start_realtime;
+    std::vector<std::pair<std::string, function_counts>> functions;
+};
+
+// One line's worth of calls
+struct summary
+{
+    double calls[FAMILIES];
+    double decisions[METRICS_DECISIONS];
+    double checks;
+    double syscalls;
+    double errors;
+};
+
+struct options
+{
+    const char *snap;
+    long pid;
+    bool functions;
+};
+
+family
+family_of (std::string const& function)
+{
+    if (function.find ("exec") != std::string::npos || function.find ("spawn") != std::string::npos) {
+        return FAMILY_EXEC;
+    }
+    if (function.find ("open") != std::string::npos || function.compare (0, 5, "creat") == 0) {
+        return FAMILY_OPEN;
+    }
+    if (function.find ("stat") != std::string::npos) {
+        return FAMILY_STAT;
+    }
+    if (function.find ("access") != std::string::npos) {
+        return FAMILY_ACCESS;
+    }
+    return FAMILY_OTHER;
+}
+
+uint64_t
+realtime_now ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The current parent of pid from /proc, or fallback if it's not readable
+uint32_t
+parent_of (uint32_t pid, uint32_t fallback)
+{
+    char path[64];
+    snprintf (path, sizeof (path), "/proc/%u/stat", pid);
+    FILE *file = fopen (path, "r");
+    if (!file) {
+        return fallback;
+    }
+
+    // The command may hold spaces and parentheses, the fields after the last ')' don't
+    char line[1024];
+    size_t n = fread (line, 1, sizeof (line) - 1, file);
+    fclose (file);
+    line[n] = '\0';
+
+    const char *end = strrchr (line, ')');
+    unsigned ppid;
+    char state;
+    if (!end || sscanf (end + 1, " %c %u", &state, &ppid) != 2) {
+        return fallback;
+    }
+    return ppid;
+}
+
+// Whether pid is ancestor or one of its descendants
+bool
+in_tree (uint32_t pid, uint32_t ppid, uint32_t ancestor)
+{
+    for (unsigned depth = 0; depth < 256 && pid > 1; ++depth) {
+        if (pid == ancestor) {
+            return true;
+        }
+        pid = depth == 0 ? parent_of (pid, ppid) : parent_of (pid, 0);
+    }
+    return pid == ancestor;
+}
+
+bool
+read_segment (const char *path, process& p)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && (size_t) st.st_size >= sizeof (metrics_header)) {
+        map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close (fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    const metrics_header *header = static_cast<const metrics_header *> (map);
+    bool ok = memcmp (header->magic, METRICS_MAGIC, sizeof (METRICS_MAGIC)) == 0 &&
+              header->version == METRICS_VERSION &&
+              header->counters_size == sizeof (metrics_counters) &&
+              header->function_count <= METRICS_FUNCTIONS_MAX &&
+              header->function_count <= (st.st_size - sizeof (metrics_header)) / sizeof (metrics_counters);
+
+    if (ok) {
+        p.pid = header->pid;
+        p.ppid = header->ppid;
+        p.start_realtime = header->start_realtime;
+        p.functions.clear ();
+
+        const metrics_counters *counters = reinterpret_cast<const metrics_counters *> (header + 1);
+        for (uint32_t i = 0; i < header->function_count; ++i) {
+            function_counts c;
+            for (unsigned d = 0; d < METRICS_DECISIONS; ++d) {
+                c.decisions[d] = counters[i].decisions[d].load (std::memory_order_relaxed);
+            }
+            c.errors = counters[i].errors.load (std::memory_order_relaxed);
+            c.checks = counters[i].existence_checks.load (std::memory_order_relaxed);
+            c.syscalls = counters[i].existence_syscalls.load (std::memory_order_relaxed);
+            if (c.calls () != 0) {
+                p.functions.emplace_back (std::string (header->functions[i], strnlen (header->functions[i], METRICS_FUNCTION_NAME_MAX)), c);
+            }
+        }
+    }
+
+    munmap (map, st.st_size);
+    return ok;
+}
+
+// Reads the segments of the selected live processes, removing those left
+// behind by processes that died without doing so
+std::vector<process>
+read_processes (options const& opts)
+{
+    std::vector<process> processes;
+    std::string prefix = opts.snap ? std::string ("snap.") + opts.snap + METRICS_INFIX : "snap.";
+
+    DIR *dir = opendir (SHM_DIR);
+    if (!dir) {
+        return processes;
+    }
+
+    while (struct dirent *entry = readdir (dir)) {
+        const char *infix = strstr (entry->d_name, METRICS_INFIX);
+        if (!infix || strncmp (entry->d_name, prefix.c_str (), prefix.size ()) != 0) {
+            continue;
+        }
+
+        std::string path = std::string (SHM_DIR) + "/" + entry->d_name;
+        long pid = atol (infix + strlen (METRICS_INFIX));
+        if (pid <= 0 || (kill (pid, 0) != 0 && errno == ESRCH)) {
+            unlink (path.c_str ());
+            continue;
+        }
+
+        process p;
+        if (read_segment (path.c_str (), p) && (opts.pid == 0 || in_tree (p.pid, p.ppid, opts.pid))) {
+            processes.push_back (std::move (p));
+        }
+    }
+
+    closedir (dir);
+    return processes;
+}
+
+void
+add_counts (summary& s, std::string const& function, function_counts const& c, double scale)
+{
+    s.calls[family_of (function)] += c.calls () * scale;
+    for (unsigned d = 0; d < METRICS_DECISIONS; ++d) {
+        s.decisions[d] += c.decisions[d] * scale;
+    }
+    s.checks += c.checks * scale;
+    s.syscalls += c.syscalls * scale;
+    s.errors += c.errors * scale;
+}
+
+// Rates over each process' life so far
+summary
+summarize_lifetime (std::vector<process> const& processes)
+{
+    summary s = {};
+    uint64_t now = realtime_now ();
+    for (process const& p : processes) {
+        double seconds = now > p.start_realtime ? (now - p.start_realtime) / 1e9 : 0;
+        double scale = seconds > 0.001 ? 1 / seconds : 1000;
+        for (auto const& f : p.functions) {
+            add_counts (s, f.first, f.second, scale);
+        }
+    }
+    return s;
+}
+
+// Rates since the previous snapshot.  Processes that weren't in it, or are a
+// different one with the same pid, count from the start.
+summary
+summarize_interval (std::vector<process> const& previous, std::vector<process> const& current, double seconds)
+{
+    std::map<uint32_t, process const *> before;
+    for (process const& p : previous) {
+        before[p.pid] = &p;
+    }
+
+    summary s = {};
+    for (process const& p : current) {
+        auto old = before.find (p.pid);
+        bool same = old != before.end () && old->second->start_realtime == p.start_realtime;
+
+        for (auto const& f : p.functions) {
+            function_counts delta = f.second;
+            if (same) {
+                for (auto const& g : old->second->functions) {
+                    if (g.first == f.first) {
+                        for (unsigned d = 0; d < METRICS_DECISIONS; ++d) {
+                            delta.decisions[d] -= g.second.decisions[d];
+                        }
+                        delta.errors -= g.second.errors;
+                        delta.checks -= g.second.checks;
+                        delta.syscalls -= g.second.syscalls;
+                        break;
+                    }
+                }
+            }
+            add_counts (s, f.first, delta, 1 / seconds);
+        }
+    }
+    return s;
+}
+
+// label centered in dashes over width columns
+void
+print_group (const char *label, int width)
+{
+    int len = strlen (label);
+    int left = (width - len) / 2;
+    printf (" %s%s%s", std::string (left, '-').c_str (), label, std::string (width - len - left, '-').c_str ());
+}
+
+void
+print_header ()
+{
+    printf ("procs");
+    print_group ("calls/s", FAMILIES * 8 - 1);
+    print_group ("decisions/s", METRICS_DECISIONS * 9 - 1);
+    print_group ("existence/s", 2 * 9 - 1);
+    print_group ("", 7);
+    printf ("\n%5s", "n");
+    for (const char *name : family_names) {
+        printf (" %7s", name);
+    }
+    for (const char *name : decision_names) {
+        printf (" %8s", name);
+    }
+    printf (" %8s %8s %7s\n", "checks", "syscalls", "errors");
+}
+
+void
+print_summary (size_t procs, summary const& s)
+{
+    printf ("%5zu", procs);
+    for (double n : s.calls) {
+        printf (" %7.0f", n);
+    }
+    for (double n : s.decisions) {
+        printf (" %8.0f", n);
+    }
+    printf (" %8.0f %8.0f %7.0f\n", s.checks, s.syscalls, s.errors);
+    fflush (stdout);
+}
+
+void
+print_functions (std::vector<process> const& processes)
+{
+    std::map<std::string, function_counts> totals;
+    for (process const& p : processes) {
+        for (auto const& f : p.functions) {
+            function_counts& t = totals[f.first];
+            for (unsigned d = 0; d < METRICS_DECISIONS; ++d) {
+                t.decisions[d] += f.second.decisions[d];
+            }
+            t.errors += f.second.errors;
+            t.checks += f.second.checks;
+            t.syscalls += f.second.syscalls;
+        }
+    }
+
+    printf ("%-24s %10s", "function", "calls");
+    for (const char *name : decision_names) {
+        printf (" %10s", name);
+    }
+    printf (" %10s %10s %10s\n", "checks", "syscalls", "errors");
+
+    for (auto const& f : totals) {
+        printf ("%-24s %10llu", f.first.c_str (), (unsigned long long) f.second.calls ());
+        for (uint64_t n : f.second.decisions) {
+            printf (" %10llu", (unsigned long long) n);
+        }
+        printf (" %10llu %10llu %10llu\n", (unsigned long long) f.second.checks,
+                (unsigned long long) f.second.syscalls, (unsigned long long) f.second.errors);
+    }
+}
+
+void
+usage (const char *self)
+{
+    fprintf (stderr, "Usage: %s [--snap NAME] [--pid PID] [--functions] [INTERVAL [COUNT]]\n", self);
+}
+
+} // unnamed namespace
+
+int
+main (int argc, char *argv[])
+{
+    options opts = { NULL, 0, false };
+    double interval = 0;
+    long count = -1;
+
+    int positional = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp (argv[i], "--snap") == 0 && i + 1 < argc) {
+            opts.snap = argv[++i];
+        } else if (strcmp (argv[i], "--pid") == 0 && i + 1 < argc) {
+            opts.pid = atol (argv[++i]);
+        } else if (strcmp (argv[i], "--functions") == 0) {
+            opts.functions = true;
+        } else if (argv[i][0] == '-' || positional == 2) {
+            usage (argv[0]);
+            return 1;
+        } else if (positional++ == 0) {
+            interval = atof (argv[i]);
+        } else {
+            count = atol (argv[i]);
+        }
+    }
+
+    if (positional > 0 && interval <= 0) {
+        usage (argv[0]);
+        return 1;
+    }
+
+    std::vector<process> processes = read_processes (opts);
+    if (opts.functions) {
+        print_functions (processes);
+        return 0;
+    }
+
+    print_header ();
+    print_summary (processes.size (), summarize_lifetime (processes));
+
+    struct timespec before;
+    clock_gettime (CLOCK_MONOTONIC, &before);
+    for (long n = 1; interval > 0 && (count < 0 || n < count); ++n) {
+        struct timespec delay;
+        delay.tv_sec = (time_t) interval;
+        delay.tv_nsec = (long) ((interval - delay.tv_sec) * 1e9);
+        nanosleep (&delay, NULL);
+
+        std::vector<process> current = read_processes (opts);
+        struct timespec now;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        double seconds = (now.tv_sec - before.tv_sec) + (now.tv_nsec - before.tv_nsec) / 1e9;
+        before = now;
+
+        print_summary (current.size (), summarize_interval (processes, current, seconds));
+        processes.swap (current);
+    }
+
+    return 0;
+}
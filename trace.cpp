@@ -0,0 +1,203 @@
+/* -*- Mode: C; indent-tabs-mode: nil; tab-width: 4 -*-
+ *
+ * Copyright (C) 2017 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Decodes the trace files written with SNAPCRAFT_PRELOAD_TRACE, see trace.h,
+// printing one line per call in the order they were recorded:
+//
+//   <seconds since start> <pid> <tid> <function> <decision> <errno> <path> -> <redirected>
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "trace.h"
+
+namespace
+{
+const char *const decision_names[] = { "unchanged", "preload", "rewrite", "writable" };
+
+struct filter
+{
+    const char *function;
+    const char *path;
+    long tid;
+    bool errors;
+    bool redirected;
+};
+
+bool
+matches (filter const& f, const trace_header& header, const trace_record& record)
+{
+    if (f.function && (record.function >= header.function_count ||
+                       strncmp (header.functions[record.function], f.function, TRACE_FUNCTION_NAME_MAX) != 0)) {
+        return false;
+    }
+    if (f.path && !strstr (record.path, f.path) && !strstr (record.redirected, f.path)) {
+        return false;
+    }
+    if (f.tid && record.tid != (uint32_t) f.tid) {
+        return false;
+    }
+    if (f.errors && record.error == 0) {
+        return false;
+    }
+    if (f.redirected && record.decision == TRACE_UNCHANGED) {
+        return false;
+    }
+    return true;
+}
+
+void
+print_record (const trace_header& header, const trace_record& record)
+{
+    char function[TRACE_FUNCTION_NAME_MAX + 1] = "?";
+    if (record.function < header.function_count) {
+        memcpy (function, header.functions[record.function], TRACE_FUNCTION_NAME_MAX);
+        function[TRACE_FUNCTION_NAME_MAX] = '\0';
+    }
+
+    const char *decision = record.decision < sizeof (decision_names) / sizeof (decision_names[0]) ?
+                           decision_names[record.decision] : "?";
+    double seconds = (double) (record.timestamp - header.start_monotonic) / 1e9;
+
+    printf ("%12.6f %u %u %s%s %s %s %s%.*s -> %s%.*s\n",
+            seconds, header.pid, record.tid, function,
+            (record.flags & TRACE_BEFORE_CALL) ? "(before)" : "",
+            decision, record.error ? strerror (record.error) : "-",
+            (record.flags & TRACE_PATH_TRUNCATED) ? "..." : "", TRACE_PATH_MAX, record.path,
+            (record.flags & TRACE_REDIRECTED_TRUNCATED) ? "..." : "", TRACE_PATH_MAX, record.redirected);
+}
+
+bool
+read_trace (const char *path, filter const& f)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror (path);
+        return false;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && (size_t) st.st_size >= sizeof (trace_header)) {
+        map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close (fd);
+
+    const trace_header *header = static_cast<const trace_header *> (map);
+    if (map == MAP_FAILED ||
+        memcmp (header->magic, TRACE_MAGIC, sizeof (TRACE_MAGIC)) != 0 ||
+        header->version != TRACE_VERSION ||
+        header->record_size != sizeof (trace_record) ||
+        header->capacity == 0 ||
+        header->capacity > (st.st_size - sizeof (trace_header)) / sizeof (trace_record)) {
+        fprintf (stderr, "%s: not a snapcraft-preload trace\n", path);
+        if (map != MAP_FAILED) {
+            munmap (map, st.st_size);
+        }
+        return false;
+    }
+
+    // Complete records in the order they were claimed
+    const trace_record *records = reinterpret_cast<const trace_record *> (header + 1);
+    std::vector<std::pair<uint64_t, uint64_t>> order;
+    for (uint64_t i = 0; i < header->capacity; ++i) {
+        uint64_t sequence = records[i].sequence.load (std::memory_order_acquire);
+        if (sequence != 0 && (sequence - 1) % header->capacity == i) {
+            order.emplace_back (sequence, i);
+        }
+    }
+    std::sort (order.begin (), order.end ());
+
+    uint64_t head = header->head.load (std::memory_order_relaxed);
+    if (head > header->capacity) {
+        fprintf (stderr, "%s: ring wrapped, the oldest %llu records were overwritten\n",
+                 path, (unsigned long long) (head - header->capacity));
+    }
+
+    // Copy each one out, the writer may still be running
+    for (auto const& entry : order) {
+        const trace_record& record = records[entry.second];
+        alignas (trace_record) char copy_buffer[sizeof (trace_record)];
+        memcpy (copy_buffer, (const void *) &record, sizeof (record));
+        std::atomic_thread_fence (std::memory_order_acquire);
+        if (record.sequence.load (std::memory_order_relaxed) != entry.first) {
+            continue;
+        }
+
+        const trace_record& copy = *reinterpret_cast<const trace_record *> (copy_buffer);
+        if (matches (f, *header, copy)) {
+            print_record (*header, copy);
+        }
+    }
+
+    munmap (map, st.st_size);
+    return true;
+}
+
+void
+usage (const char *self)
+{
+    fprintf (stderr, "Usage: %s [--function NAME] [--path SUBSTRING] [--tid TID] [--errors] [--redirected] TRACE...\n", self);
+}
+
+} // unnamed namespace
+
+int
+main (int argc, char *argv[])
+{
+    filter f = { NULL, NULL, 0, false, false };
+    std::vector<const char *> files;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp (argv[i], "--function") == 0 && i + 1 < argc) {
+            f.function = argv[++i];
+        } else if (strcmp (argv[i], "--path") == 0 && i + 1 < argc) {
+            f.path = argv[++i];
+        } else if (strcmp (argv[i], "--tid") == 0 && i + 1 < argc) {
+            f.tid = atol (argv[++i]);
+        } else if (strcmp (argv[i], "--errors") == 0) {
+            f.errors = true;
+        } else if (strcmp (argv[i], "--redirected") == 0) {
+            f.redirected = true;
+        } else if (argv[i][0] == '-') {
+            usage (argv[0]);
+            return 1;
+        } else {
+            files.push_back (argv[i]);
+        }
+    }
+
+    if (files.empty ()) {
+        usage (argv[0]);
+        return 1;
+    }
+
+    bool ok = true;
+    for (const char *file : files) {
+        ok = read_trace (file, f) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,96 @@
+/* -*- Mode: C; indent-tabs-mode: nil; tab-width: 4 -*-
+ *
+ * Copyright (C) 2017 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Layout of the trace files written by the preload library when
+// SNAPCRAFT_PRELOAD_TRACE is set, shared with the reader.
+//
+// A trace file is a trace_header followed by a ring of `capacity` fixed size
+// trace_records.  Writers claim positions in the ring by bumping `head`, the
+// record for position p lives at index p % capacity and holds p + 1 in its
+// sequence once it's complete, so readers can tell complete records from
+// overwritten and half written ones.  The header also carries the names of
+// the functions, so a trace can be decoded by a reader from another build.
+
+#ifndef SNAPCRAFT_PRELOAD_TRACE_H
+#define SNAPCRAFT_PRELOAD_TRACE_H
+
+#include <atomic>
+#include <stdint.h>
+
+#define TRACE_MAGIC "SPTRACE"
+#define TRACE_VERSION 1
+#define TRACE_FUNCTIONS_MAX 128
+#define TRACE_FUNCTION_NAME_MAX 24
+#define TRACE_PATH_MAX 112
+
+enum trace_decision {
+    // The path was passed on unchanged
+    TRACE_UNCHANGED,
+    // Redirected into SNAPCRAFT_PRELOAD
+    TRACE_PRELOAD,
+    // Rewritten to a rule's target
+    TRACE_REWRITE,
+    // Sent to a rule's writable target as it doesn't exist outside
+    TRACE_WRITABLE,
+};
+
+enum {
+    // Only the end of the path fit in the record
+    TRACE_PATH_TRUNCATED = 1 << 0,
+    TRACE_REDIRECTED_TRUNCATED = 1 << 1,
+    // Recorded before a call that doesn't return on success, i.e. execve
+    TRACE_BEFORE_CALL = 1 << 2,
+};
+
+struct trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    uint32_t pid;
+    uint32_t function_count;
+    // CLOCK_REALTIME and CLOCK_MONOTONIC in ns when the trace started
+    uint64_t start_realtime;
+    uint64_t start_monotonic;
+    // Next position to claim, records are chunk_size aligned per thread
+    std::atomic<uint64_t> head;
+    uint32_t chunk_size;
+    uint32_t reserved;
+    char functions[TRACE_FUNCTIONS_MAX][TRACE_FUNCTION_NAME_MAX];
+};
+
+struct trace_record
+{
+    // Position + 1 once written, 0 while being written
+    std::atomic<uint64_t> sequence;
+    // CLOCK_MONOTONIC in ns
+    uint64_t timestamp;
+    uint32_t tid;
+    uint16_t function;
+    uint8_t decision;
+    uint8_t flags;
+    // errno of a failed call, 0 on success
+    int32_t error;
+    uint32_t reserved;
+    char path[TRACE_PATH_MAX];
+    char redirected[TRACE_PATH_MAX];
+};
+
+static_assert (sizeof (trace_record) == 256, "trace records should stay 256 bytes");
+
+#endif